@@ -0,0 +1,338 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+# include <x86intrin.h>
+# define HAVE_CYCLES 1
+#endif
+
+#include "copy-checksum.h"
+#include "copy-progress.h"
+#include "copy-utils.h"
+
+/*
+ * Microbenchmarks of the pieces of copy that run for every chunk or every
+ * file. Each one is run in samples of enough iterations to take about
+ * SAMPLE_NANOSECONDS, WARMUP samples first that are thrown away, then
+ * SAMPLES that are kept. What is printed is the median time per
+ * iteration, the median absolute deviation from it, and where the time
+ * stamp counter is available the cycles per iteration and per byte.
+ *
+ *   make bench            runs all of them
+ *   ./copy-bench md5      runs those with `md5' in their name
+ */
+
+#define WARMUP             3
+#define SAMPLES           21
+#define SAMPLE_NANOSECONDS 20000000.0
+
+#define BENCH_PATH_SOURCE "/home/user/source/some/deeper/directory/file.txt"
+#define BENCH_PATH_ROOT   "/home/user/source"
+#define BENCH_PATH_DEST   "/mnt/backup/destination"
+
+/* what copy.c defines for the progress */
+const char *program_name = "copy-bench";
+size_t total_sources = 1;
+byte_t so_far_bytes = BYTE_C (0);
+byte_t total_bytes = BYTE_C (0);
+double update_interval = PROGRESS_UPDATE_INTERVAL;
+
+/* results go here so the compiler cannot drop the work */
+static volatile size_t sink;
+
+static unsigned char data[1048576];
+
+struct bench
+{
+  const char *name;
+  void (*run) (size_t iterations);
+  /* bytes handled by one iteration, 0 if that means nothing */
+  size_t bytes;
+};
+
+static double
+now_nanoseconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((double) ts.tv_sec * 1e9) + (double) ts.tv_nsec;
+}
+
+static double
+now_cycles (void)
+{
+#ifdef HAVE_CYCLES
+  return (double) __rdtsc ();
+#else
+  return 0.0;
+#endif
+}
+
+static void
+bench_md5_transform (size_t iterations)
+{
+  size_t x;
+  unsigned int state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+  for (x = 0; x < iterations; ++x)
+    md5_transform (state, data + ((x & 63) * 64));
+  sink = state[0];
+}
+
+static void
+bench_md5_update (size_t iterations, unsigned int n)
+{
+  size_t x;
+  struct md5_ctx ctx;
+
+  md5_init (&ctx);
+  for (x = 0; x < iterations; ++x)
+    md5_update (&ctx, data, n);
+  sink = ctx.state[0];
+}
+
+static void
+bench_md5_update_4k (size_t iterations)
+{
+  bench_md5_update (iterations, 4096);
+}
+
+static void
+bench_md5_update_1m (size_t iterations)
+{
+  bench_md5_update (iterations, sizeof (data));
+}
+
+static void
+bench_format_size (size_t iterations)
+{
+  size_t x;
+  char buffer[SIZE_BUFMAX];
+
+  for (x = 0; x < iterations; ++x)
+    format_size (buffer, (byte_t) (x * 7919) << (x & 31), x & 1);
+  sink = (size_t) buffer[0];
+}
+
+static void
+bench_format_percent (size_t iterations)
+{
+  size_t x;
+  char buffer[PERCENT_BUFMAX];
+
+  for (x = 0; x < iterations; ++x)
+    format_percent (buffer, (byte_t) x, (byte_t) iterations);
+  sink = (size_t) buffer[0];
+}
+
+static void
+bench_rebase_path (size_t iterations)
+{
+  size_t x;
+  size_t n_root;
+  char buffer[PATH_BUFMAX];
+
+  n_root = strlen (BENCH_PATH_ROOT);
+  for (x = 0; x < iterations; ++x)
+    rebase_path (buffer, BENCH_PATH_SOURCE, n_root, BENCH_PATH_DEST);
+  sink = (size_t) buffer[n_root];
+}
+
+/* Every update is a frame when the interval is 0, otherwise almost none
+   are. Frames go to /dev/null. */
+static void
+bench_progress (size_t iterations, double interval)
+{
+  int fd;
+  int saved;
+  size_t x;
+
+  fflush (stdout);
+  saved = dup (STDOUT_FILENO);
+  fd = open ("/dev/null", O_WRONLY);
+  if ((saved == -1) || (fd == -1) || (dup2 (fd, STDOUT_FILENO) == -1))
+    die (errno, "failed to redirect progress to /dev/null");
+  close (fd);
+
+  update_interval = interval;
+  total_bytes = (byte_t) iterations * 4096;
+  so_far_bytes = BYTE_C (0);
+  progress_init (total_bytes, 1);
+  for (x = 0; x < iterations; ++x)
+    progress_update (4096);
+
+  dup2 (saved, STDOUT_FILENO);
+  close (saved);
+  update_interval = PROGRESS_UPDATE_INTERVAL;
+}
+
+static void
+bench_progress_frame (size_t iterations)
+{
+  bench_progress (iterations, 0.0);
+}
+
+static void
+bench_progress_update (size_t iterations)
+{
+  bench_progress (iterations, PROGRESS_UPDATE_INTERVAL);
+}
+
+static void
+bench_streq (size_t iterations)
+{
+  size_t x;
+  size_t n;
+
+  n = 0;
+  for (x = 0; x < iterations; ++x)
+  {
+    n += streq (BENCH_PATH_SOURCE, BENCH_PATH_SOURCE, false);
+    n += streq ((x & 1) ? "." : "..", "..", false);
+  }
+  sink = n;
+}
+
+static const struct bench benches[] =
+{
+  {"md5_transform", bench_md5_transform, 64},
+  {"md5_update_4k", bench_md5_update_4k, 4096},
+  {"md5_update_1m", bench_md5_update_1m, sizeof (data)},
+  {"format_size", bench_format_size, 0},
+  {"format_percent", bench_format_percent, 0},
+  {"rebase_path", bench_rebase_path, 0},
+  {"progress_frame", bench_progress_frame, 4096},
+  {"progress_update", bench_progress_update, 4096},
+  {"streq", bench_streq, 0},
+  {NULL, NULL, 0}
+};
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+static double
+median (double *values, size_t n)
+{
+  qsort (values, n, sizeof (double), compare_doubles);
+  return (n & 1) ? values[n / 2]
+                 : ((values[(n / 2) - 1] + values[n / 2]) / 2.0);
+}
+
+/* Median absolute deviation of VALUES from M. */
+static double
+deviation (const double *values, size_t n, double m)
+{
+  size_t x;
+  double d[SAMPLES];
+
+  for (x = 0; x < n; ++x)
+    d[x] = (values[x] > m) ? (values[x] - m) : (m - values[x]);
+  return median (d, n);
+}
+
+/* The number of iterations it takes to fill a sample. */
+static size_t
+calibrate (const struct bench *b)
+{
+  size_t iterations;
+  double start;
+  double elapsed;
+
+  for (iterations = 1;; iterations *= 2)
+  {
+    start = now_nanoseconds ();
+    b->run (iterations);
+    elapsed = now_nanoseconds () - start;
+    if (elapsed >= (SAMPLE_NANOSECONDS / 8))
+      return (size_t) ((SAMPLE_NANOSECONDS / elapsed) * iterations) + 1;
+  }
+}
+
+static void
+bench_run (const struct bench *b)
+{
+  int x;
+  size_t iterations;
+  double start;
+  double start_cycles;
+  double m;
+  double mad;
+  double cycles_m;
+  double ns[SAMPLES];
+  double cycles[SAMPLES];
+
+  iterations = calibrate (b);
+  for (x = 0; x < WARMUP; ++x)
+    b->run (iterations);
+  for (x = 0; x < SAMPLES; ++x)
+  {
+    start = now_nanoseconds ();
+    start_cycles = now_cycles ();
+    b->run (iterations);
+    cycles[x] = (now_cycles () - start_cycles) / iterations;
+    ns[x] = (now_nanoseconds () - start) / iterations;
+  }
+
+  m = median (ns, SAMPLES);
+  mad = deviation (ns, SAMPLES, m);
+  cycles_m = median (cycles, SAMPLES);
+  printf ("%-16s %12.1f ns %9.1f ns", b->name, m, mad);
+#ifdef HAVE_CYCLES
+  printf (" %12.1f", cycles_m);
+  if (b->bytes)
+    printf (" %9.3f", cycles_m / b->bytes);
+#endif
+  fputc ('\n', stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t x;
+  const struct bench *b;
+
+  for (x = 0; x < sizeof (data); ++x)
+    data[x] = (unsigned char) ((x * 2654435761u) >> 13);
+
+  printf ("%-16s %15s %12s", "benchmark", "median", "mad");
+#ifdef HAVE_CYCLES
+  printf (" %12s %9s", "cycles", "cyc/byte");
+#endif
+  fputc ('\n', stdout);
+  for (b = benches; b->name; ++b)
+    if ((argc < 2) || strstr (b->name, argv[1]))
+      bench_run (b);
+  return EXIT_SUCCESS;
+}
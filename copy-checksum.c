@@ -20,11 +20,18 @@
  * the RSA Data Security, Inc. MD5 Message-Digest Algorithm.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "copy-checksum.h"
+#include "copy-pool.h"
 #include "copy-utils.h"
 
 #define S11  7
@@ -82,13 +89,6 @@
     (a) += (b); \
   } while (0)
 
-struct md5_ctx
-{
-  unsigned int state[4];
-  unsigned int count[2];
-  unsigned char buffer[64];
-};
-
 static unsigned char padding[64] =
 {
   0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -127,7 +127,7 @@ md5_decode (unsigned int *o, unsigned char *i, unsigned int n)
            (((unsigned int) i[y + 3]) << 24);
 }
 
-static void
+void
 md5_transform (unsigned int state[4], unsigned char block[64])
 {
   unsigned int a;
@@ -218,7 +218,7 @@ md5_transform (unsigned int state[4], unsigned char block[64])
   memset ((unsigned char *) x, 0, sizeof (x));
 }
 
-static void
+void
 md5_init (struct md5_ctx *ctx)
 {
   ctx->count[0] = 0;
@@ -230,7 +230,7 @@ md5_init (struct md5_ctx *ctx)
   ctx->state[3] = 0x10325476;
 }
 
-static void
+void
 md5_update (struct md5_ctx *ctx, unsigned char *input, unsigned int n)
 {
   unsigned int i;
@@ -272,7 +272,7 @@ md5_update_from_file (struct md5_ctx *ctx, FILE *fp)
   }
 }
 
-static void
+void
 md5_final (struct md5_ctx *ctx, unsigned char digest[MD5_DIGEST_SIZE])
 {
   unsigned int index;
@@ -290,7 +290,7 @@ md5_final (struct md5_ctx *ctx, unsigned char digest[MD5_DIGEST_SIZE])
   memset ((unsigned char *) ctx, 0, sizeof (*ctx));
 }
 
-static void
+void
 md5_from_digest (char buffer[CHECKSUM_BUFMAX],
                  unsigned char digest[MD5_DIGEST_SIZE])
 {
@@ -301,21 +301,174 @@ md5_from_digest (char buffer[CHECKSUM_BUFMAX],
   buffer[CHECKSUM_BUFMAX - 1] = '\0';
 }
 
-void
+bool
 get_checksum (char *buffer, const char *path)
 {
+  int fd;
   struct md5_ctx ctx;
   FILE *fp;
   unsigned char digest[MD5_DIGEST_SIZE];
 
-  fp = fopen (path, "rb");
+  fd = open_source (path, O_RDONLY);
+  fp = (fd != -1) ? fdopen (fd, "rb") : NULL;
   if (!fp)
-    die (errno, "failed to open `%s' to generate MD5 checksum", path);
+  {
+    if (fd != -1)
+      close (fd);
+    x_error (errno, "failed to open `%s' to generate MD5 checksum", path);
+    return false;
+  }
   memset (&ctx, 0, sizeof (struct md5_ctx));
   md5_init (&ctx);
   md5_update_from_file (&ctx, fp);
   md5_final (&ctx, digest);
   md5_from_digest (buffer, digest);
+  if (ferror (fp))
+  {
+    x_error (errno, "failed to read `%s' to generate MD5 checksum", path);
+    fclose (fp);
+    return false;
+  }
   fclose (fp);
+  return true;
 }
 
+/*
+ * A tree checksum is the MD5 of the MD5s of every TREE_LEAF_SIZE bytes
+ * of a file, followed by its size as 8 little endian bytes. The leaves do
+ * not depend on each other, so N threads each hash a stretch of 1/N of
+ * the file with pread(), and a huge file is hashed as fast as the cores
+ * and the device queue allow rather than by one core.
+ */
+
+struct tree_range
+{
+  int fd;
+  struct tree_checksum *sum;
+  size_t first;
+  size_t last;
+  int errnum;
+};
+
+static void
+tree_range_task (void *arg)
+{
+  size_t leaf;
+  size_t len;
+  off_t pos;
+  struct md5_ctx ctx;
+  struct tree_range *r;
+  unsigned char *buffer;
+
+  r = (struct tree_range *) arg;
+  buffer = malloc (TREE_LEAF_SIZE);
+  if (!buffer)
+  {
+    r->errnum = errno;
+    return;
+  }
+  for (leaf = r->first; leaf < r->last; ++leaf)
+  {
+    pos = (off_t) leaf * TREE_LEAF_SIZE;
+    len = ((r->sum->size - pos) < TREE_LEAF_SIZE)
+          ? (size_t) (r->sum->size - pos) : TREE_LEAF_SIZE;
+    /* errno is this thread's own, and only set by a failed read */
+    errno = 0;
+    if (pread_full (r->fd, buffer, len, pos) != (ssize_t) len)
+    {
+      /* a file that shrank while being read is just as unreadable */
+      r->errnum = (errno != 0) ? errno : EIO;
+      break;
+    }
+    md5_init (&ctx);
+    md5_update (&ctx, buffer, (unsigned int) len);
+    md5_final (&ctx, r->sum->leaves[leaf]);
+  }
+  free (buffer);
+}
+
+/* Fills in SUM for the file PATH with up to N_THREADS threads. */
+bool
+get_tree_checksum (struct tree_checksum *sum,
+                   const char *path,
+                   size_t n_threads)
+{
+  int fd;
+  int errnum;
+  size_t x;
+  size_t n_ranges;
+  uint64_t size;
+  struct stat st;
+  struct md5_ctx ctx;
+  struct pool *pool;
+  unsigned char size_bytes[8];
+
+  memset (sum, 0, sizeof (struct tree_checksum));
+  fd = open_source (path, O_RDONLY);
+  if ((fd == -1) || (fstat (fd, &st) != 0))
+  {
+    x_error (errno, "failed to open `%s' to generate MD5 checksum", path);
+    if (fd != -1)
+      close (fd);
+    return false;
+  }
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  sum->size = st.st_size;
+  sum->n_leaves = (size_t) ((st.st_size + TREE_LEAF_SIZE - 1) /
+                            TREE_LEAF_SIZE);
+  sum->leaves = malloc ((sum->n_leaves + 1) * MD5_DIGEST_SIZE);
+  if (!sum->leaves)
+  {
+    x_error (errno, "failed to allocate checksum for `%s'", path);
+    close (fd);
+    return false;
+  }
+
+  n_ranges = (n_threads < sum->n_leaves) ? n_threads : sum->n_leaves;
+  if (n_ranges == 0)
+    n_ranges = 1;
+  struct tree_range ranges[n_ranges];
+  pool = pool_new ((n_ranges > 1) ? n_ranges : 0, 0);
+  for (x = 0; x < n_ranges; ++x)
+  {
+    ranges[x].fd = fd;
+    ranges[x].sum = sum;
+    ranges[x].first = (sum->n_leaves * x) / n_ranges;
+    ranges[x].last = (sum->n_leaves * (x + 1)) / n_ranges;
+    ranges[x].errnum = 0;
+    pool_submit (pool, tree_range_task, &ranges[x]);
+  }
+  pool_wait (pool);
+  pool_free (pool);
+  close (fd);
+
+  errnum = 0;
+  for (x = 0; (x < n_ranges) && (errnum == 0); ++x)
+    errnum = ranges[x].errnum;
+  if (errnum != 0)
+  {
+    x_error (errnum, "failed to read `%s' to generate MD5 checksum", path);
+    tree_checksum_free (sum);
+    errno = errnum;
+    return false;
+  }
+
+  md5_init (&ctx);
+  if (sum->n_leaves > 0)
+    md5_update (&ctx, (unsigned char *) sum->leaves,
+                (unsigned int) (sum->n_leaves * MD5_DIGEST_SIZE));
+  size = (uint64_t) st.st_size;
+  for (x = 0; x < 8; ++x)
+    size_bytes[x] = (unsigned char) (size >> (8 * x));
+  md5_update (&ctx, size_bytes, 8);
+  md5_final (&ctx, sum->root);
+  return true;
+}
+
+void
+tree_checksum_free (struct tree_checksum *sum)
+{
+  free (sum->leaves);
+  sum->leaves = NULL;
+  sum->n_leaves = 0;
+}
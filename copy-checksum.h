@@ -20,10 +20,41 @@
 #ifndef __COPY_CHECKSUM_H__
 #define __COPY_CHECKSUM_H__ 
 
+#include "copy-utils.h"
+
 #define MD5_DIGEST_SIZE 16
 #define CHECKSUM_BUFMAX (MD5_DIGEST_SIZE * 2 + 1)
 
-void get_checksum (char *buffer, const char *path);
+/* bytes of a file hashed into each leaf of its tree checksum */
+#define TREE_LEAF_SIZE 1048576
+
+struct md5_ctx
+{
+  unsigned int state[4];
+  unsigned int count[2];
+  unsigned char buffer[64];
+};
+
+void md5_transform (unsigned int state[4], unsigned char block[64]);
+void md5_init (struct md5_ctx *ctx);
+void md5_update (struct md5_ctx *ctx, unsigned char *input, unsigned int n);
+void md5_final (struct md5_ctx *ctx, unsigned char digest[MD5_DIGEST_SIZE]);
+void md5_from_digest (char buffer[CHECKSUM_BUFMAX],
+                      unsigned char digest[MD5_DIGEST_SIZE]);
+bool get_checksum (char *buffer, const char *path);
+
+struct tree_checksum
+{
+  off_t size;
+  size_t n_leaves;
+  unsigned char (*leaves)[MD5_DIGEST_SIZE];
+  unsigned char root[MD5_DIGEST_SIZE];
+};
+
+bool get_tree_checksum (struct tree_checksum *sum,
+                        const char *path,
+                        size_t n_threads);
+void tree_checksum_free (struct tree_checksum *sum);
 
 #endif /* __COPY_CHECKSUM_H__ */
 
@@ -0,0 +1,109 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "copy-control.h"
+#include "copy-utils.h"
+
+static volatile sig_atomic_t armed            = 0;
+static volatile sig_atomic_t pause_requested  = 0;
+static volatile sig_atomic_t cancel_requested = 0;
+
+static void
+install_handler (int signum, void (*handler) (int))
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof (struct sigaction));
+  sa.sa_handler = handler;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction (signum, &sa, NULL);
+}
+
+static void
+control_handler (int signum)
+{
+  sigset_t set;
+
+  /* Outside of the transfers (prompts, scanning) there is nothing to
+     drain, so the signal gets its usual effect. It is blocked while its
+     handler runs, so it has to be unblocked to take that effect now
+     rather than come back to this handler once it returns. */
+  if (!armed)
+  {
+    install_handler (signum, SIG_DFL);
+    sigemptyset (&set);
+    sigaddset (&set, signum);
+    pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+    raise (signum);
+    install_handler (signum, control_handler);
+    return;
+  }
+  if (signum == SIGTSTP)
+    pause_requested = 1;
+  else
+    cancel_requested = 1;
+}
+
+void
+control_init (void)
+{
+  install_handler (SIGTSTP, control_handler);
+  install_handler (SIGINT, control_handler);
+  install_handler (SIGTERM, control_handler);
+}
+
+/* While armed, SIGTSTP and SIGINT/SIGTERM only raise requests that the
+   transfers honor at their next checkpoint. */
+void
+control_arm (bool armed_)
+{
+  armed = armed_ ? 1 : 0;
+}
+
+bool
+control_pause_requested (void)
+{
+  return pause_requested ? true : false;
+}
+
+/* Stops the process the way SIGTSTP normally would and returns once it is
+   continued. */
+void
+control_pause (void)
+{
+  pause_requested = 0;
+  /* SIGSTOP rather than SIGTSTP, which an orphaned process group ignores */
+  raise (SIGSTOP);
+}
+
+bool
+control_cancel_requested (void)
+{
+  return cancel_requested ? true : false;
+}
+
@@ -0,0 +1,32 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_CONTROL_H__
+#define __COPY_CONTROL_H__
+
+#include "copy-utils.h"
+
+void control_init (void);
+void control_arm (bool armed);
+bool control_pause_requested (void);
+void control_pause (void);
+bool control_cancel_requested (void);
+
+#endif /* __COPY_CONTROL_H__ */
+
@@ -0,0 +1,619 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copy-engine.h"
+#include "copy-errors.h"
+#include "copy-utils.h"
+#include "copy-zero.h"
+
+/* O_DIRECT transfers need buffers, sizes and offsets aligned to the
+   logical block size of the device, which is never more than this */
+#define DIRECT_ALIGN 4096
+
+/* the unit zeros are looked for in when writing sparse files */
+#define SPARSE_BLOCK 4096
+
+/* what a new pipe holds on Linux, and the least run_splice keeps it at */
+#define SPLICE_PIPE_SIZE 65536
+
+typedef bool (*engine_run_func) (struct engine_transfer *t);
+
+struct engine
+{
+  const char *name;
+  engine_run_func run;
+  /* whether the data passes through memory it could be looked at in */
+  bool user_space;
+  /* whether --probe may pick it; a mapped file truncated by someone else
+     kills the copy with SIGBUS, so mmap is only used when asked for */
+  bool automatic;
+};
+
+static bool run_stdio (struct engine_transfer *t);
+static bool run_read_write (struct engine_transfer *t);
+static bool run_copy_file_range (struct engine_transfer *t);
+static bool run_splice (struct engine_transfer *t);
+static bool run_mmap (struct engine_transfer *t);
+static bool run_direct (struct engine_transfer *t);
+
+static const struct engine engines[N_ENGINES] =
+{
+  {"stdio", run_stdio, true, true},
+  {"rw", run_read_write, true, true},
+  {"copy_file_range", run_copy_file_range, false, true},
+  {"splice", run_splice, false, true},
+  {"mmap", run_mmap, true, false},
+  {"direct", run_direct, true, true}
+};
+
+static bool
+fail (struct engine_transfer *t, int phase)
+{
+  t->failed_phase = phase;
+  t->failed_errno = errno;
+  return false;
+}
+
+static ssize_t
+read_some (int fd, char *buffer, size_t n)
+{
+  ssize_t r;
+
+  do
+    r = read (fd, buffer, n);
+  while ((r == -1) && (errno == EINTR));
+  return r;
+}
+
+static bool
+write_all (int fd, const char *buffer, size_t n)
+{
+  ssize_t w;
+
+  while (n > 0)
+  {
+    w = write (fd, buffer, n);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buffer += w;
+    n -= (size_t) w;
+  }
+  return true;
+}
+
+/* Returns how many bytes at the start of BUFFER are in blocks that are
+   not all zeros. */
+static size_t
+data_run (const char *buffer, size_t n)
+{
+  size_t x;
+  size_t block;
+
+  for (x = 0; x < n; x += block)
+  {
+    block = ((n - x) < SPARSE_BLOCK) ? (n - x) : SPARSE_BLOCK;
+    if (zero_block (buffer + x, block))
+      break;
+  }
+  return x;
+}
+
+/* Returns how many bytes at the start of BUFFER are in blocks of zeros. */
+static size_t
+zero_run (const char *buffer, size_t n)
+{
+  size_t x;
+  size_t block;
+
+  for (x = 0; x < n; x += block)
+  {
+    block = ((n - x) < SPARSE_BLOCK) ? (n - x) : SPARSE_BLOCK;
+    if (!zero_block (buffer + x, block))
+      break;
+  }
+  return x;
+}
+
+/* Writes N bytes of BUFFER to the destination, skipping over the blocks
+   of zeros instead when writing sparse. */
+static bool
+write_data (struct engine_transfer *t, const char *buffer, size_t n)
+{
+  size_t k;
+
+  if (!t->sparse)
+    return write_all (t->dst_fd, buffer, n);
+  while (n > 0)
+  {
+    k = data_run (buffer, n);
+    if ((k > 0) && !write_all (t->dst_fd, buffer, k))
+      return false;
+    buffer += k;
+    n -= k;
+    k = zero_run (buffer, n);
+    if ((k > 0) && (lseek (t->dst_fd, (off_t) k, SEEK_CUR) == (off_t) -1))
+      return false;
+    t->sparse_bytes += k;
+    buffer += k;
+    n -= k;
+  }
+  return true;
+}
+
+/* The same for the stdio engine's stream. */
+static bool
+fwrite_data (struct engine_transfer *t,
+             FILE *fp,
+             const char *buffer,
+             size_t n)
+{
+  size_t k;
+
+  if (!t->sparse)
+    return fwrite (buffer, 1, n, fp) == n;
+  while (n > 0)
+  {
+    k = data_run (buffer, n);
+    if ((k > 0) && (fwrite (buffer, 1, k, fp) != k))
+      return false;
+    buffer += k;
+    n -= k;
+    k = zero_run (buffer, n);
+    if ((k > 0) && (fseeko (fp, (off_t) k, SEEK_CUR) != 0))
+      return false;
+    t->sparse_bytes += k;
+    buffer += k;
+    n -= k;
+  }
+  return true;
+}
+
+/* The original way: buffered streams, one chunk at a time. */
+static bool
+run_stdio (struct engine_transfer *t)
+{
+  int fd;
+  bool ok;
+  size_t bytes_read;
+  FILE *src_fp;
+  FILE *dst_fp;
+
+  fd = dup (t->src_fd);
+  src_fp = (fd != -1) ? fdopen (fd, "rb") : NULL;
+  if (!src_fp)
+  {
+    if (fd != -1)
+      close (fd);
+    return fail (t, PHASE_OPEN);
+  }
+  fd = dup (t->dst_fd);
+  dst_fp = (fd != -1) ? fdopen (fd, "wb") : NULL;
+  if (!dst_fp)
+  {
+    if (fd != -1)
+      close (fd);
+    fclose (src_fp);
+    return fail (t, PHASE_OPEN);
+  }
+
+  t->state = dst_fp;
+  ok = true;
+  for (;;)
+  {
+    bytes_read = fread (t->buffer, 1, t->buffer_size, src_fp);
+    if (!fwrite_data (t, dst_fp, t->buffer, bytes_read))
+    {
+      ok = fail (t, PHASE_WRITE);
+      break;
+    }
+    if (ferror (src_fp))
+    {
+      ok = fail (t, PHASE_READ);
+      break;
+    }
+    if (!t->chunk_func (t, bytes_read))
+    {
+      ok = false;
+      break;
+    }
+    if (feof (src_fp))
+      break;
+  }
+  t->state = NULL;
+
+  fclose (src_fp);
+  if ((fclose (dst_fp) != 0) && ok)
+    ok = fail (t, PHASE_WRITE);
+  return ok;
+}
+
+static bool
+run_read_write (struct engine_transfer *t)
+{
+  ssize_t n;
+
+  for (;;)
+  {
+    n = read_some (t->src_fd, t->buffer, t->buffer_size);
+    if (n == -1)
+      return fail (t, PHASE_READ);
+    if (n == 0)
+      return true;
+    if (!write_data (t, t->buffer, (size_t) n))
+      return fail (t, PHASE_WRITE);
+    if (!t->chunk_func (t, (size_t) n))
+      return false;
+  }
+}
+
+/* Lets the kernel (or the filesystem, for reflinks and server side copies)
+   move the data without it passing through user space. */
+static bool
+run_copy_file_range (struct engine_transfer *t)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  bool copied;
+  ssize_t n;
+
+  copied = false;
+  for (;;)
+  {
+    n = copy_file_range (t->src_fd, NULL, t->dst_fd, NULL,
+                         t->buffer_size, 0);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      /* unsupported between these two files, nothing was moved yet */
+      if (!copied && ((errno == EXDEV) || (errno == ENOSYS) ||
+                      (errno == EOPNOTSUPP) || (errno == EINVAL)))
+        return run_splice (t);
+      return fail (t, PHASE_WRITE);
+    }
+    /* files like those in /proc claim to be empty but are not */
+    if (n == 0)
+      return copied ? true : run_read_write (t);
+    copied = true;
+    if (!t->chunk_func (t, (size_t) n))
+      return false;
+  }
+#else
+  return run_splice (t);
+#endif
+}
+
+/* Empties the pipe into the destination the ordinary way, for when the
+   destination turned out not to take spliced data. */
+static bool
+drain_pipe (struct engine_transfer *t, int fd, size_t n)
+{
+  ssize_t r;
+
+  while (n > 0)
+  {
+    r = read_some (fd, t->buffer, n);
+    if (r <= 0)
+      return fail (t, PHASE_READ);
+    if (!write_all (t->dst_fd, t->buffer, (size_t) r))
+      return fail (t, PHASE_WRITE);
+    n -= (size_t) r;
+  }
+  return true;
+}
+
+/* Moves the data from the source into a pipe and from the pipe into the
+   destination, so it stays in the kernel even where copy_file_range does
+   not work (across filesystems on older kernels, FUSE, overlays). Either
+   end refusing to splice makes the rest of the file go through rw. */
+static bool
+run_splice (struct engine_transfer *t)
+{
+#ifdef HAVE_SPLICE
+  bool ok;
+  bool copied;
+  int r;
+  int pipe_fd[2];
+  size_t page;
+  size_t n_pipe;
+  ssize_t n;
+  ssize_t w;
+  ssize_t left;
+
+  if (pipe (pipe_fd) != 0)
+    return run_read_write (t);
+  n_pipe = SPLICE_PIPE_SIZE;
+#ifdef F_SETPIPE_SZ
+  /* the default pipe (64K) turns big buffers into many small splices, so
+     it is grown to the buffer size, in whole pages, but never shrunk;
+     beyond /proc/sys/fs/pipe-max-size this fails and the size stays */
+  if (t->buffer_size > SPLICE_PIPE_SIZE)
+  {
+    page = (size_t) sysconf (_SC_PAGESIZE);
+    r = fcntl (pipe_fd[1], F_SETPIPE_SZ,
+               (int) ((t->buffer_size + page - 1) / page * page));
+    if (r == -1)
+      r = fcntl (pipe_fd[1], F_GETPIPE_SZ);
+    if (r > 0)
+      n_pipe = (size_t) r;
+  }
+#endif
+
+  ok = true;
+  copied = false;
+  for (;;)
+  {
+    n = splice (t->src_fd, NULL, pipe_fd[1], NULL, n_pipe,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (!copied && (errno == EINVAL))
+      {
+        close (pipe_fd[0]);
+        close (pipe_fd[1]);
+        return run_read_write (t);
+      }
+      ok = fail (t, PHASE_READ);
+      break;
+    }
+    if (n == 0)
+      break;
+
+    for (left = n; left > 0; left -= w)
+    {
+      w = splice (pipe_fd[0], NULL, t->dst_fd, NULL, (size_t) left,
+                  SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (w == -1)
+      {
+        if (errno == EINTR)
+        {
+          w = 0;
+          continue;
+        }
+        if (!copied && (errno == EINVAL))
+          break;
+        ok = fail (t, PHASE_WRITE);
+        break;
+      }
+    }
+    if (!ok)
+      break;
+    if (left > 0)
+    {
+      /* a destination that cannot be spliced to, with part of the first
+         chunk already in the pipe */
+      ok = drain_pipe (t, pipe_fd[0], (size_t) left) &&
+           t->chunk_func (t, (size_t) n);
+      close (pipe_fd[0]);
+      close (pipe_fd[1]);
+      return ok && run_read_write (t);
+    }
+    copied = true;
+    if (!t->chunk_func (t, (size_t) n))
+    {
+      ok = false;
+      break;
+    }
+  }
+  close (pipe_fd[0]);
+  close (pipe_fd[1]);
+  return ok;
+#else
+  return run_read_write (t);
+#endif
+}
+
+static bool
+run_mmap (struct engine_transfer *t)
+{
+  bool ok;
+  size_t n;
+  size_t size;
+  size_t offset;
+  char *map;
+
+  size = (size_t) t->size;
+  if ((size == 0) || ((byte_t) size != t->size))
+    return run_read_write (t);
+  map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, t->src_fd, 0);
+  if (map == MAP_FAILED)
+    return run_read_write (t);
+  madvise (map, size, MADV_SEQUENTIAL);
+
+  ok = true;
+  for (offset = 0; offset < size; offset += n)
+  {
+    n = size - offset;
+    if (n > t->buffer_size)
+      n = t->buffer_size;
+    if (!write_data (t, map + offset, n))
+    {
+      ok = fail (t, PHASE_WRITE);
+      break;
+    }
+    if (!t->chunk_func (t, n))
+    {
+      ok = false;
+      break;
+    }
+  }
+  munmap (map, size);
+  return ok;
+}
+
+/* Bypasses the page cache on both ends, which keeps a large copy from
+   evicting everything else. The unaligned tail of a file is written with
+   O_DIRECT turned off again. */
+static bool
+run_direct (struct engine_transfer *t)
+{
+#ifdef O_DIRECT
+  bool ok;
+  bool copied;
+  int src_flags;
+  int dst_flags;
+  size_t n_buffer;
+  ssize_t n;
+  void *buffer;
+
+  src_flags = fcntl (t->src_fd, F_GETFL);
+  dst_flags = fcntl (t->dst_fd, F_GETFL);
+  if ((src_flags == -1) || (dst_flags == -1) ||
+      (fcntl (t->src_fd, F_SETFL, src_flags | O_DIRECT) != 0))
+    return run_read_write (t);
+  if (fcntl (t->dst_fd, F_SETFL, dst_flags | O_DIRECT) != 0)
+  {
+    fcntl (t->src_fd, F_SETFL, src_flags);
+    return run_read_write (t);
+  }
+
+  n_buffer = ((t->buffer_size + DIRECT_ALIGN - 1) / DIRECT_ALIGN) *
+             DIRECT_ALIGN;
+  if (posix_memalign (&buffer, DIRECT_ALIGN, n_buffer) != 0)
+  {
+    fcntl (t->src_fd, F_SETFL, src_flags);
+    fcntl (t->dst_fd, F_SETFL, dst_flags);
+    return run_read_write (t);
+  }
+
+  ok = true;
+  copied = false;
+  for (;;)
+  {
+    n = read_some (t->src_fd, buffer, n_buffer);
+    if ((n == -1) && !copied && (errno == EINVAL))
+    {
+      /* the filesystem refuses O_DIRECT only once it is used */
+      fcntl (t->src_fd, F_SETFL, src_flags);
+      fcntl (t->dst_fd, F_SETFL, dst_flags);
+      free (buffer);
+      return run_read_write (t);
+    }
+    if (n == -1)
+    {
+      ok = fail (t, PHASE_READ);
+      break;
+    }
+    if (n == 0)
+      break;
+    if (((size_t) n % DIRECT_ALIGN) != 0)
+    {
+      /* the end of the file, or a short read after which the offsets
+         are no longer aligned */
+      fcntl (t->src_fd, F_SETFL, src_flags);
+      fcntl (t->dst_fd, F_SETFL, dst_flags);
+    }
+    if (!write_data (t, buffer, (size_t) n))
+    {
+      ok = fail (t, PHASE_WRITE);
+      break;
+    }
+    copied = true;
+    if (!t->chunk_func (t, (size_t) n))
+    {
+      ok = false;
+      break;
+    }
+  }
+  fcntl (t->src_fd, F_SETFL, src_flags);
+  fcntl (t->dst_fd, F_SETFL, dst_flags);
+  free (buffer);
+  return ok;
+#else
+  return run_read_write (t);
+#endif
+}
+
+/* Returns the engine called NAME, or -1. */
+int
+engine_find (const char *name)
+{
+  int x;
+
+  for (x = 0; x < N_ENGINES; ++x)
+    if (streq (engines[x].name, name, false))
+      return x;
+  return -1;
+}
+
+const char *
+engine_name (int engine)
+{
+  return engines[engine].name;
+}
+
+/* Whether ENGINE may be chosen without being named with --engine. */
+bool
+engine_automatic (int engine)
+{
+  return engines[engine].automatic;
+}
+
+/* Moves the data from T->src_fd to T->dst_fd. Returns false when it
+   failed, with T->failed_phase and T->failed_errno set, or when the chunk
+   function stopped it, with T->failed_phase left at -1. */
+bool
+engine_run (int engine, struct engine_transfer *t)
+{
+  off_t end;
+
+  t->failed_phase = -1;
+  t->failed_errno = 0;
+  t->state = NULL;
+  t->sparse_bytes = BYTE_C (0);
+  /* zeros can only be found in data that is seen */
+  if (t->sparse && !engines[engine].user_space)
+    engine = ENGINE_READ_WRITE;
+  if (!engines[engine].run (t))
+    return false;
+
+  /* a file ending in a hole has not been extended over it yet */
+  if (t->sparse_bytes > 0)
+  {
+    end = lseek (t->dst_fd, 0, SEEK_CUR);
+    if ((end == (off_t) -1) || (ftruncate (t->dst_fd, end) != 0))
+      return fail (t, PHASE_WRITE);
+  }
+  return true;
+}
+
+/* Gets everything written so far by an engine in progress onto the disk.
+   Only the stdio engine keeps data of its own (its output stream) that
+   would need to be written first. */
+bool
+engine_sync (struct engine_transfer *t)
+{
+  if (t->state && (fflush ((FILE *) t->state) != 0))
+    return false;
+  return fsync (t->dst_fd) == 0;
+}
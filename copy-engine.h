@@ -0,0 +1,68 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_ENGINE_H__
+#define __COPY_ENGINE_H__
+
+#include "copy-utils.h"
+
+/* the ways the data of a single file can be moved */
+enum
+{
+  ENGINE_STDIO,
+  ENGINE_READ_WRITE,
+  ENGINE_COPY_FILE_RANGE,
+  ENGINE_SPLICE,
+  ENGINE_MMAP,
+  ENGINE_DIRECT,
+  N_ENGINES
+};
+
+struct engine_transfer;
+
+/* Called after every chunk with the number of bytes it moved. Returning
+   false stops the transfer without it counting as an error. */
+typedef bool (*engine_chunk_func) (struct engine_transfer *t, size_t bytes);
+
+struct engine_transfer
+{
+  int src_fd;
+  int dst_fd;
+  byte_t size;
+  char *buffer;
+  size_t buffer_size;
+  engine_chunk_func chunk_func;
+  void *data;
+  /* write blocks of zeros as holes, counting them in sparse_bytes */
+  bool sparse;
+  byte_t sparse_bytes;
+  /* set by the engine when it fails */
+  int failed_phase;
+  int failed_errno;
+  /* private to the engine */
+  void *state;
+};
+
+int engine_find (const char *name);
+const char *engine_name (int engine);
+bool engine_automatic (int engine);
+bool engine_run (int engine, struct engine_transfer *t);
+bool engine_sync (struct engine_transfer *t);
+
+#endif /* __COPY_ENGINE_H__ */
@@ -0,0 +1,220 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include "copy-errors.h"
+#include "copy-utils.h"
+
+#define ERROR_LOG_MAGIC   "copy-errors"
+#define ERROR_LOG_VERSION 1
+
+/* the summary lists this many errors, the log file has them all */
+#define ERROR_SUMMARY_MAX 10
+
+#define ERROR_LOG_LINE_BUFMAX ((PATH_BUFMAX * 2) + 64)
+
+static const char *phase_names[N_PHASES] =
+{
+  "scan", "stat", "directory", "mkdir", "open", "read",
+  "write", "close", "attributes", "verify", "remove",
+  "publish", "changed"
+};
+
+static pthread_mutex_t     lock      = PTHREAD_MUTEX_INITIALIZER;
+static struct error_entry *entries   = NULL;
+static size_t              n_entries =    0;
+static size_t              n_alloc   =    0;
+
+static char *
+error_strdup (const char *s)
+{
+  char *p;
+
+  p = strdup (s ? s : "");
+  if (!p)
+    die (errno, "failed to record error");
+  return p;
+}
+
+/* Safe to call from any thread. */
+void
+error_log_add (int phase,
+               int errnum,
+               const char *src_path,
+               const char *dst_path)
+{
+  struct error_entry *e;
+
+  pthread_mutex_lock (&lock);
+  if (n_entries == n_alloc)
+  {
+    n_alloc = n_alloc ? (n_alloc * 2) : 16;
+    entries = realloc (entries, n_alloc * sizeof (struct error_entry));
+    if (!entries)
+      die (errno, "failed to record error");
+  }
+  e = &entries[n_entries++];
+  e->phase = phase;
+  e->errnum = errnum;
+  e->src_path = error_strdup (src_path);
+  e->dst_path = error_strdup (dst_path);
+  pthread_mutex_unlock (&lock);
+}
+
+size_t
+error_log_count (void)
+{
+  size_t n;
+
+  pthread_mutex_lock (&lock);
+  n = n_entries;
+  pthread_mutex_unlock (&lock);
+  return n;
+}
+
+void
+error_log_summary (void)
+{
+  size_t x;
+  size_t by_phase[N_PHASES];
+
+  pthread_mutex_lock (&lock);
+  if (n_entries == 0)
+  {
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+
+  fflush (stdout);
+  memset (by_phase, 0, sizeof (by_phase));
+  for (x = 0; (x < n_entries); ++x)
+    by_phase[entries[x].phase]++;
+
+  fprintf (stderr, "%zu error%s:", n_entries, (n_entries == 1) ? "" : "s");
+  for (x = 0; (x < N_PHASES); ++x)
+    if (by_phase[x])
+      fprintf (stderr, " %s %zu", phase_names[x], by_phase[x]);
+  fputc ('\n', stderr);
+
+  for (x = 0; ((x < n_entries) && (x < ERROR_SUMMARY_MAX)); ++x)
+    fprintf (stderr, "  %s: %s: %s\n",
+             phase_names[entries[x].phase],
+             entries[x].src_path,
+             entries[x].errnum ? strerror (entries[x].errnum)
+                               : ((entries[x].phase == PHASE_CHANGED)
+                                  ? "still changing" : "failed"));
+  if (n_entries > ERROR_SUMMARY_MAX)
+    fprintf (stderr, "  ... and %zu more\n", n_entries - ERROR_SUMMARY_MAX);
+  pthread_mutex_unlock (&lock);
+}
+
+/*
+ * The error log is a text file with a header line and one error per line,
+ * its fields separated by tabs:
+ *
+ *   copy-errors 1
+ *   open	13	/path/to/source/file	/path/to/destination/file
+ *
+ * The fields are the phase, the errno value, the source path and the
+ * destination path, which is all --retry needs to redo just that entry.
+ */
+bool
+error_log_write (const char *path)
+{
+  size_t x;
+  FILE *fp;
+
+  fp = x_fopen (path, "w");
+  if (!fp)
+    return false;
+  fprintf (fp, ERROR_LOG_MAGIC " %d\n", ERROR_LOG_VERSION);
+  pthread_mutex_lock (&lock);
+  for (x = 0; (x < n_entries); ++x)
+    fprintf (fp, "%s\t%d\t%s\t%s\n",
+             phase_names[entries[x].phase],
+             entries[x].errnum,
+             entries[x].src_path,
+             entries[x].dst_path);
+  pthread_mutex_unlock (&lock);
+  return x_fclose (fp, path);
+}
+
+bool
+error_log_read (const char *path, error_entry_func func)
+{
+  int version;
+  size_t n;
+  char *field[4];
+  char *p;
+  FILE *fp;
+  struct error_entry e;
+  char line[ERROR_LOG_LINE_BUFMAX];
+
+  fp = x_fopen (path, "r");
+  if (!fp)
+    return false;
+
+  version = 0;
+  if (!fgets (line, ERROR_LOG_LINE_BUFMAX, fp) ||
+      (sscanf (line, ERROR_LOG_MAGIC " %d", &version) != 1) ||
+      (version != ERROR_LOG_VERSION))
+  {
+    x_fclose (fp, path);
+    x_error (0, "not an error log (or an unsupported version) -- `%s'",
+             path);
+    return false;
+  }
+
+  while (fgets (line, ERROR_LOG_LINE_BUFMAX, fp))
+  {
+    p = strchr (line, '\n');
+    if (p)
+      *p = '\0';
+    for (n = 0, p = line; (n < 4); ++n)
+    {
+      field[n] = p;
+      if (n < 3)
+      {
+        p = strchr (p, '\t');
+        if (!p)
+          break;
+        *p++ = '\0';
+      }
+    }
+    if (n < 4)
+      continue;
+    for (e.phase = 0; (e.phase < N_PHASES); ++e.phase)
+      if (streq (field[0], phase_names[e.phase], false))
+        break;
+    if (e.phase == N_PHASES)
+      continue;
+    e.errnum = (int) strtol (field[1], (char **) NULL, 10);
+    e.src_path = field[2];
+    e.dst_path = field[3];
+    func (&e);
+  }
+  return x_fclose (fp, path);
+}
+
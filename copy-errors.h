@@ -0,0 +1,64 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_ERRORS_H__
+#define __COPY_ERRORS_H__
+
+#include "copy-utils.h"
+
+/* the step of the copy an error happened in */
+enum
+{
+  PHASE_SCAN,
+  PHASE_STAT,
+  PHASE_DIRECTORY,
+  PHASE_MKDIR,
+  PHASE_OPEN,
+  PHASE_READ,
+  PHASE_WRITE,
+  PHASE_CLOSE,
+  PHASE_ATTRIBUTES,
+  PHASE_VERIFY,
+  PHASE_REMOVE,
+  PHASE_PUBLISH,
+  PHASE_CHANGED,
+  N_PHASES
+};
+
+struct error_entry
+{
+  int phase;
+  int errnum;
+  char *src_path;
+  char *dst_path;
+};
+
+typedef void (*error_entry_func) (const struct error_entry *e);
+
+void error_log_add (int phase,
+                    int errnum,
+                    const char *src_path,
+                    const char *dst_path);
+size_t error_log_count (void);
+void error_log_summary (void);
+bool error_log_write (const char *path);
+bool error_log_read (const char *path, error_entry_func func);
+
+#endif /* __COPY_ERRORS_H__ */
+
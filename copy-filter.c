@@ -0,0 +1,744 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <string.h>
+
+#include "copy-filter.h"
+#include "copy-utils.h"
+
+/* patterns with more tokens than this are handed to fnmatch() */
+#define GLOB_TOKEN_MAX 63
+/* past this many states a glob is matched by simulating its NFA */
+#define DFA_STATE_MAX 512
+
+#define DFA_DEAD_STATE  0
+#define DFA_START_STATE 1
+
+#define LITERAL_TABLE_MIN 64
+
+#define FILTER_LINE_BUFMAX 4096
+
+enum
+{
+  TOKEN_CHAR,
+  TOKEN_ANY,
+  TOKEN_CLASS,
+  TOKEN_STAR,       /* `*' -- anything but a separator */
+  TOKEN_DSTAR,      /* trailing double star -- anything at all */
+  TOKEN_DIRS_ENTRY, /* double star and separator -- zero or more dirs... */
+  TOKEN_DIRS_BODY   /* ...which are matched here up to their separator */
+};
+
+enum
+{
+  RULE_LITERAL,
+  RULE_PREFIX,
+  RULE_SUFFIX,
+  RULE_GLOB
+};
+
+struct glob_token
+{
+  int type;
+  unsigned char c;
+  unsigned char set[32];
+};
+
+struct glob
+{
+  size_t n_tokens;
+  struct glob_token tokens[GLOB_TOKEN_MAX];
+  /* DFA built from the token NFA (NULL if it got too big) */
+  size_t n_states;
+  size_t n_classes;
+  unsigned char class_of[256];
+  uint16_t *next;
+  bool *accept;
+};
+
+struct filter_rule
+{
+  int kind;
+  bool include;
+  bool dir_only;
+  bool anchored;
+  char *text;
+  size_t n_text;
+  struct glob *glob;
+  long prev_same;
+};
+
+struct literal_slot
+{
+  const char *key;
+  size_t n_key;
+  long rule;
+};
+
+static struct filter_rule *  rules            = NULL;
+static size_t                n_rules          =    0;
+static long *                linear_rules     = NULL;
+static size_t                n_linear_rules   =    0;
+static struct literal_slot * literal_table    = NULL;
+static size_t                n_literal_table  =    0;
+static size_t                n_literals       =    0;
+
+static struct
+{
+  bool active;
+  bool has_min_size;
+  bool has_max_size;
+  bool has_newer_than;
+  bool has_older_than;
+  byte_t min_size;
+  byte_t max_size;
+  time_t newer_than;
+  time_t older_than;
+} predicates;
+
+static void *
+filter_realloc (void *p, size_t n)
+{
+  p = realloc (p, n);
+  if (!p)
+    die (errno, "failed to allocate filter rules");
+  return p;
+}
+
+static bool
+has_glob_meta (const char *s, size_t n)
+{
+  size_t x;
+
+  for (x = 0; (x < n); ++x)
+    if ((s[x] == '*') || (s[x] == '?') || (s[x] == '[') || (s[x] == '\\'))
+      return true;
+  return false;
+}
+
+static size_t
+hash_bytes (const char *s, size_t n)
+{
+  size_t x;
+  uint64_t h;
+
+  h = UINT64_C (14695981039346656037);
+  for (x = 0; (x < n); ++x)
+  {
+    h ^= (unsigned char) s[x];
+    h *= UINT64_C (1099511628211);
+  }
+  return (size_t) h;
+}
+
+static struct literal_slot *
+literal_slot_find (const char *key, size_t n_key)
+{
+  size_t x;
+  struct literal_slot *slot;
+
+  x = hash_bytes (key, n_key) & (n_literal_table - 1);
+  for (;; x = (x + 1) & (n_literal_table - 1))
+  {
+    slot = &literal_table[x];
+    if (!slot->key ||
+        ((slot->n_key == n_key) && (memcmp (slot->key, key, n_key) == 0)))
+      return slot;
+  }
+}
+
+static void
+literal_table_insert (long r)
+{
+  size_t x;
+  size_t n_old;
+  struct literal_slot *old;
+  struct literal_slot *slot;
+
+  if ((n_literals + 1) * 2 > n_literal_table)
+  {
+    old = literal_table;
+    n_old = n_literal_table;
+    n_literal_table = n_old ? (n_old * 2) : LITERAL_TABLE_MIN;
+    literal_table = filter_realloc (NULL, n_literal_table *
+                                          sizeof (struct literal_slot));
+    memset (literal_table, 0, n_literal_table * sizeof (struct literal_slot));
+    for (x = 0; (x < n_old); ++x)
+      if (old[x].key)
+        *literal_slot_find (old[x].key, old[x].n_key) = old[x];
+    free (old);
+  }
+
+  slot = literal_slot_find (rules[r].text, rules[r].n_text);
+  if (slot->key)
+    rules[r].prev_same = slot->rule;
+  else
+  {
+    slot->key = rules[r].text;
+    slot->n_key = rules[r].n_text;
+    n_literals++;
+  }
+  slot->rule = r;
+}
+
+static bool
+token_advances (const struct glob_token *t, unsigned char c)
+{
+  switch (t->type)
+  {
+    case TOKEN_CHAR:
+      return t->c == c;
+    case TOKEN_ANY:
+      return !is_dir_separator (c);
+    case TOKEN_CLASS:
+      return !is_dir_separator (c) && (t->set[c >> 3] & (1 << (c & 7)));
+    case TOKEN_DIRS_BODY:
+      return is_dir_separator (c);
+  }
+  return false;
+}
+
+static bool
+token_stays (const struct glob_token *t, unsigned char c)
+{
+  switch (t->type)
+  {
+    case TOKEN_STAR:
+      return !is_dir_separator (c);
+    case TOKEN_DSTAR:
+    case TOKEN_DIRS_BODY:
+      return true;
+  }
+  return false;
+}
+
+static uint64_t
+glob_closure (const struct glob *g, uint64_t mask)
+{
+  size_t x;
+
+  /* epsilon moves only go forward so one pass is enough */
+  for (x = 0; (x < g->n_tokens); ++x)
+  {
+    if (!(mask & (UINT64_C (1) << x)))
+      continue;
+    if ((g->tokens[x].type == TOKEN_STAR) ||
+        (g->tokens[x].type == TOKEN_DSTAR))
+      mask |= UINT64_C (1) << (x + 1);
+    else if (g->tokens[x].type == TOKEN_DIRS_ENTRY)
+      mask |= (UINT64_C (1) << (x + 1)) | (UINT64_C (1) << (x + 2));
+  }
+  return mask;
+}
+
+static uint64_t
+glob_step (const struct glob *g, uint64_t mask, unsigned char c)
+{
+  size_t x;
+  uint64_t next;
+
+  next = 0;
+  for (x = 0; (x < g->n_tokens); ++x)
+  {
+    if (!(mask & (UINT64_C (1) << x)))
+      continue;
+    if (token_advances (&g->tokens[x], c))
+      next |= UINT64_C (1) << (x + 1);
+    if (token_stays (&g->tokens[x], c))
+      next |= UINT64_C (1) << x;
+  }
+  return glob_closure (g, next);
+}
+
+/* Returns the number of pattern bytes consumed by the bracket expression
+   at P, or 0 if it is not terminated (in which case `[' is literal). */
+static size_t
+glob_parse_class (struct glob_token *t, const char *p, const char *end)
+{
+  bool negate;
+  unsigned int c;
+  unsigned int lo;
+  unsigned int hi;
+  const char *s;
+
+  s = p + 1;
+  negate = false;
+  if ((s < end) && ((*s == '!') || (*s == '^')))
+  {
+    negate = true;
+    s++;
+  }
+
+  memset (t->set, 0, sizeof (t->set));
+  for (bool first = true; (s < end); first = false)
+  {
+    if ((*s == ']') && !first)
+      break;
+    if ((*s == '\\') && ((s + 1) < end))
+      s++;
+    lo = (unsigned char) *s++;
+    hi = lo;
+    if (((s + 1) < end) && (*s == '-') && (s[1] != ']'))
+    {
+      hi = (unsigned char) s[1];
+      s += 2;
+    }
+    for (c = lo; (c <= hi); ++c)
+      t->set[c >> 3] |= 1 << (c & 7);
+  }
+  if (s >= end)
+    return 0;
+
+  if (negate)
+    for (c = 0; (c < 32); ++c)
+      t->set[c] = ~t->set[c];
+  t->type = TOKEN_CLASS;
+  return (s + 1) - p;
+}
+
+static bool
+glob_parse (struct glob *g, const char *p, size_t n)
+{
+  size_t used;
+  const char *start;
+  const char *end;
+  struct glob_token *t;
+
+  start = p;
+  end = p + n;
+  g->n_tokens = 0;
+  while (p < end)
+  {
+    if ((g->n_tokens + 2) > GLOB_TOKEN_MAX)
+      return false;
+    t = &g->tokens[g->n_tokens++];
+    memset (t, 0, sizeof (struct glob_token));
+    if (*p == '*')
+    {
+      if (((p + 1) < end) && (p[1] == '*') &&
+          ((p == start) || is_dir_separator (p[-1])))
+      {
+        while ((p < end) && (*p == '*'))
+          p++;
+        if (p == end)
+        {
+          t->type = TOKEN_DSTAR;
+          continue;
+        }
+        if (is_dir_separator (*p))
+        {
+          t->type = TOKEN_DIRS_ENTRY;
+          g->tokens[g->n_tokens++].type = TOKEN_DIRS_BODY;
+          p++;
+          continue;
+        }
+      }
+      while ((p < end) && (*p == '*'))
+        p++;
+      t->type = TOKEN_STAR;
+    }
+    else if (*p == '?')
+    {
+      t->type = TOKEN_ANY;
+      p++;
+    }
+    else if ((*p == '[') && ((used = glob_parse_class (t, p, end)) > 0))
+      p += used;
+    else
+    {
+      if ((*p == '\\') && ((p + 1) < end))
+        p++;
+      t->type = TOKEN_CHAR;
+      t->c = (unsigned char) *p++;
+    }
+  }
+  return true;
+}
+
+/* Bytes that every token treats alike share one column of the DFA. */
+static void
+glob_build_classes (struct glob *g)
+{
+  size_t x;
+  size_t k;
+  unsigned int c;
+  uint64_t advance[256];
+  uint64_t stay[256];
+
+  g->n_classes = 0;
+  for (c = 0; (c < 256); ++c)
+  {
+    advance[c] = 0;
+    stay[c] = 0;
+    for (x = 0; (x < g->n_tokens); ++x)
+    {
+      if (token_advances (&g->tokens[x], c))
+        advance[c] |= UINT64_C (1) << x;
+      if (token_stays (&g->tokens[x], c))
+        stay[c] |= UINT64_C (1) << x;
+    }
+    for (k = 0; (k < c); ++k)
+      if ((advance[k] == advance[c]) && (stay[k] == stay[c]))
+        break;
+    if (k < c)
+      g->class_of[c] = g->class_of[k];
+    else
+      g->class_of[c] = (unsigned char) g->n_classes++;
+  }
+}
+
+static void
+glob_build_dfa (struct glob *g)
+{
+  size_t s;
+  size_t k;
+  size_t x;
+  size_t n_max;
+  unsigned int c;
+  uint64_t next;
+  uint64_t accept_bit;
+  uint64_t *masks;
+  unsigned char rep[256];
+
+  glob_build_classes (g);
+  for (c = 256; (c-- > 0);)
+    rep[g->class_of[c]] = (unsigned char) c;
+
+  n_max = DFA_STATE_MAX;
+  masks = filter_realloc (NULL, n_max * sizeof (uint64_t));
+  g->next = filter_realloc (NULL, n_max * g->n_classes * sizeof (uint16_t));
+  masks[DFA_DEAD_STATE] = 0;
+  masks[DFA_START_STATE] = glob_closure (g, UINT64_C (1));
+  g->n_states = 2;
+
+  for (s = 0; (s < g->n_states); ++s)
+  {
+    for (k = 0; (k < g->n_classes); ++k)
+    {
+      next = glob_step (g, masks[s], rep[k]);
+      for (x = 0; (x < g->n_states); ++x)
+        if (masks[x] == next)
+          break;
+      if (x == g->n_states)
+      {
+        if (g->n_states == n_max)
+        {
+          free (masks);
+          free (g->next);
+          g->next = NULL;
+          return;
+        }
+        masks[g->n_states++] = next;
+      }
+      g->next[(s * g->n_classes) + k] = (uint16_t) x;
+    }
+  }
+
+  accept_bit = UINT64_C (1) << g->n_tokens;
+  g->accept = filter_realloc (NULL, g->n_states * sizeof (bool));
+  for (s = 0; (s < g->n_states); ++s)
+    g->accept[s] = (masks[s] & accept_bit) ? true : false;
+  free (masks);
+}
+
+static bool
+glob_match (const struct glob *g, const char *s)
+{
+  size_t state;
+  uint64_t mask;
+
+  if (g->next)
+  {
+    state = DFA_START_STATE;
+    for (; *s; ++s)
+    {
+      state = g->next[(state * g->n_classes) +
+                      g->class_of[(unsigned char) *s]];
+      if (state == DFA_DEAD_STATE)
+        return false;
+    }
+    return g->accept[state];
+  }
+
+  mask = glob_closure (g, UINT64_C (1));
+  for (; (*s && mask); ++s)
+    mask = glob_step (g, mask, (unsigned char) *s);
+  return (mask & (UINT64_C (1) << g->n_tokens)) ? true : false;
+}
+
+static bool
+rule_matches (const struct filter_rule *r, const char *s)
+{
+  size_t n;
+
+  switch (r->kind)
+  {
+    case RULE_LITERAL:
+      return streq (s, r->text, false);
+    case RULE_PREFIX:
+      return strncmp (s, r->text, r->n_text) == 0;
+    case RULE_SUFFIX:
+      n = strlen (s);
+      return (n >= r->n_text) &&
+             (memcmp (s + (n - r->n_text), r->text, r->n_text) == 0);
+  }
+  if (r->glob)
+    return glob_match (r->glob, s);
+  return fnmatch (r->text, s, FNM_PATHNAME) == 0;
+}
+
+/*
+ * Patterns follow .gitignore: a trailing separator only matches directories,
+ * a pattern containing a separator anywhere else is matched against the
+ * whole path relative to the source directory, and any other pattern is
+ * matched against the last path component at any depth. The last matching
+ * pattern wins.
+ */
+void
+filter_add (const char *pattern, bool include)
+{
+  long index;
+  size_t n;
+  char *body;
+  struct filter_rule *r;
+
+  n = strlen (pattern);
+  index = (long) n_rules;
+  rules = filter_realloc (rules, (n_rules + 1) * sizeof (struct filter_rule));
+  r = &rules[n_rules++];
+  memset (r, 0, sizeof (struct filter_rule));
+  r->include = include;
+  r->prev_same = -1;
+
+  while ((n > 1) && is_dir_separator (pattern[n - 1]))
+  {
+    r->dir_only = true;
+    n--;
+  }
+  if (is_dir_separator (*pattern))
+  {
+    r->anchored = true;
+    pattern++;
+    n--;
+  }
+  else if (memchr (pattern, DIR_SEPARATOR_C, n))
+    r->anchored = true;
+
+  body = filter_realloc (NULL, n + 1);
+  memcpy (body, pattern, n);
+  body[n] = '\0';
+  r->text = body;
+  r->n_text = n;
+
+  if (!has_glob_meta (body, n))
+  {
+    r->kind = RULE_LITERAL;
+    if (!r->anchored)
+    {
+      literal_table_insert (index);
+      return;
+    }
+  }
+  else if (!r->anchored && (n > 1) && (body[0] == '*') &&
+           !has_glob_meta (body + 1, n - 1))
+  {
+    r->kind = RULE_SUFFIX;
+    memmove (body, body + 1, n);
+    r->n_text = n - 1;
+  }
+  else if (!r->anchored && (n > 1) && (body[n - 1] == '*') &&
+           !has_glob_meta (body, n - 1))
+  {
+    r->kind = RULE_PREFIX;
+    body[n - 1] = '\0';
+    r->n_text = n - 1;
+  }
+  else
+  {
+    r->kind = RULE_GLOB;
+    r->glob = filter_realloc (NULL, sizeof (struct glob));
+    memset (r->glob, 0, sizeof (struct glob));
+    if (glob_parse (r->glob, body, n))
+      glob_build_dfa (r->glob);
+    else
+    {
+      free (r->glob);
+      r->glob = NULL;
+    }
+  }
+
+  linear_rules = filter_realloc (linear_rules,
+                                 (n_linear_rules + 1) * sizeof (long));
+  linear_rules[n_linear_rules++] = index;
+}
+
+/* Blank lines and lines starting with `#' are ignored, and a leading `!'
+   turns a line into an include pattern. */
+void
+filter_add_file (const char *path)
+{
+  size_t n;
+  char *p;
+  FILE *fp;
+  char line[FILTER_LINE_BUFMAX];
+
+  fp = x_fopen (path, "r");
+  if (!fp)
+    exit (EXIT_FAILURE);
+
+  while (fgets (line, FILTER_LINE_BUFMAX, fp))
+  {
+    n = strlen (line);
+    while ((n > 0) && isspace ((unsigned char) line[n - 1]) &&
+           ((n < 2) || (line[n - 2] != '\\')))
+      line[--n] = '\0';
+    p = line;
+    if (!*p || (*p == '#'))
+      continue;
+    if (*p == '!')
+      filter_add (p + 1, true);
+    else
+    {
+      if ((*p == '\\') && ((p[1] == '!') || (p[1] == '#')))
+        p++;
+      filter_add (p, false);
+    }
+  }
+  x_fclose (fp, path);
+}
+
+bool
+filter_active (void)
+{
+  return n_rules > 0;
+}
+
+/* REL_PATH is relative to the root of the directory being copied. */
+bool
+filter_excluded (const char *rel_path, bool is_dir)
+{
+  long best;
+  long index;
+  size_t x;
+  const char *base;
+  struct filter_rule *r;
+  struct literal_slot *slot;
+
+  base = strrchr (rel_path, DIR_SEPARATOR_C);
+  base = base ? (base + 1) : rel_path;
+
+  best = -1;
+  if (n_literals > 0)
+  {
+    slot = literal_slot_find (base, strlen (base));
+    if (slot->key)
+    {
+      for (index = slot->rule; (index >= 0); index = rules[index].prev_same)
+      {
+        if (!rules[index].dir_only || is_dir)
+        {
+          best = index;
+          break;
+        }
+      }
+    }
+  }
+
+  for (x = n_linear_rules; (x-- > 0);)
+  {
+    index = linear_rules[x];
+    if (index < best)
+      break;
+    r = &rules[index];
+    if (r->dir_only && !is_dir)
+      continue;
+    if (rule_matches (r, r->anchored ? rel_path : base))
+    {
+      best = index;
+      break;
+    }
+  }
+
+  return (best >= 0) && !rules[best].include;
+}
+
+void
+filter_set_min_size (byte_t bytes)
+{
+  predicates.active = true;
+  predicates.has_min_size = true;
+  predicates.min_size = bytes;
+}
+
+void
+filter_set_max_size (byte_t bytes)
+{
+  predicates.active = true;
+  predicates.has_max_size = true;
+  predicates.max_size = bytes;
+}
+
+void
+filter_set_newer_than (time_t t)
+{
+  predicates.active = true;
+  predicates.has_newer_than = true;
+  predicates.newer_than = t;
+}
+
+void
+filter_set_older_than (time_t t)
+{
+  predicates.active = true;
+  predicates.has_older_than = true;
+  predicates.older_than = t;
+}
+
+bool
+filter_predicates_active (void)
+{
+  return predicates.active;
+}
+
+/* Checks the size and age predicates against the stat data of a regular
+   file. Directories are never skipped by them. */
+bool
+filter_skipped (const struct stat *st)
+{
+  if (!predicates.active || !S_ISREG (st->st_mode))
+    return false;
+  if (predicates.has_min_size &&
+      ((byte_t) st->st_size < predicates.min_size))
+    return true;
+  if (predicates.has_max_size &&
+      ((byte_t) st->st_size > predicates.max_size))
+    return true;
+  if (predicates.has_newer_than && (st->st_mtime <= predicates.newer_than))
+    return true;
+  if (predicates.has_older_than && (st->st_mtime >= predicates.older_than))
+    return true;
+  return false;
+}
+
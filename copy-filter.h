@@ -0,0 +1,37 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_FILTER_H__
+#define __COPY_FILTER_H__
+
+#include "copy-utils.h"
+
+void filter_add (const char *pattern, bool include);
+void filter_add_file (const char *path);
+bool filter_active (void);
+bool filter_excluded (const char *rel_path, bool is_dir);
+void filter_set_min_size (byte_t bytes);
+void filter_set_max_size (byte_t bytes);
+void filter_set_newer_than (time_t t);
+void filter_set_older_than (time_t t);
+bool filter_predicates_active (void);
+bool filter_skipped (const struct stat *st);
+
+#endif /* __COPY_FILTER_H__ */
+
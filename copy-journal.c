@@ -0,0 +1,171 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include "copy-journal.h"
+#include "copy-utils.h"
+
+#define JOURNAL_MAGIC   "copy-journal"
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_LINE_BUFMAX (PATH_BUFMAX + 32)
+
+/*
+ * A journal is a small text file, one record per line:
+ *
+ *   copy-journal 1
+ *   source /path/to/first/source
+ *   target /path/to/destination/source
+ *   source /path/to/second/file
+ *   target /path/to/destination/file
+ *   next 2
+ *
+ * Each source is followed by the path it is copied to, which is recorded
+ * rather than recomputed since by now the destination exists and would be
+ * taken for a directory to copy into. `next' is the 1-based index of the
+ * first source that was not finished.
+ * Every file of that source that exists at the destination with its full
+ * size is complete, since the file that was in flight has been rolled back
+ * before the journal was written.
+ */
+bool
+journal_write (const char *path,
+               const char **src_path,
+               const char **rpath,
+               size_t n_src,
+               size_t next_item)
+{
+  size_t x;
+  size_t n_path;
+  FILE *fp;
+
+  n_path = strlen (path);
+  char tmp_path[n_path + 5];
+  memcpy (tmp_path, path, n_path);
+  memcpy (tmp_path + n_path, ".tmp", 5);
+
+  fp = x_fopen (tmp_path, "w");
+  if (!fp)
+    return false;
+  fprintf (fp, JOURNAL_MAGIC " %d\n", JOURNAL_VERSION);
+  for (x = 0; (x < n_src); ++x)
+    fprintf (fp, "source %s\ntarget %s\n", src_path[x], rpath[x]);
+  fprintf (fp, "next %zu\n", next_item);
+  if ((fflush (fp) != 0) || (fsync (fileno (fp)) != 0))
+  {
+    x_error (errno, "failed to write journal `%s'", tmp_path);
+    fclose (fp);
+    unlink (tmp_path);
+    return false;
+  }
+  if (!x_fclose (fp, tmp_path))
+    return false;
+  if (rename (tmp_path, path) != 0)
+  {
+    x_error (errno, "failed to write journal `%s'", path);
+    unlink (tmp_path);
+    return false;
+  }
+  return true;
+}
+
+static char *
+journal_strdup (const char *s)
+{
+  char *p;
+
+  p = strdup (s);
+  if (!p)
+    die (errno, "failed to read journal");
+  return p;
+}
+
+bool
+journal_read (const char *path, struct journal *j)
+{
+  int version;
+  bool complete;
+  size_t n;
+  size_t x;
+  FILE *fp;
+  char line[JOURNAL_LINE_BUFMAX];
+
+  memset (j, 0, sizeof (struct journal));
+  fp = x_fopen (path, "r");
+  if (!fp)
+    return false;
+
+  version = 0;
+  if (!fgets (line, JOURNAL_LINE_BUFMAX, fp) ||
+      (sscanf (line, JOURNAL_MAGIC " %d", &version) != 1) ||
+      (version != JOURNAL_VERSION))
+  {
+    x_fclose (fp, path);
+    x_error (0, "not a journal (or an unsupported version) -- `%s'", path);
+    return false;
+  }
+
+  while (fgets (line, JOURNAL_LINE_BUFMAX, fp))
+  {
+    n = strlen (line);
+    if ((n > 0) && (line[n - 1] == '\n'))
+      line[--n] = '\0';
+    if (strncmp (line, "source ", 7) == 0)
+    {
+      j->src_path = realloc (j->src_path, (j->n_src + 1) * sizeof (char *));
+      j->rpath = realloc (j->rpath, (j->n_src + 1) * sizeof (char *));
+      if (!j->src_path || !j->rpath)
+        die (errno, "failed to read journal");
+      j->src_path[j->n_src] = journal_strdup (line + 7);
+      j->rpath[j->n_src++] = NULL;
+    }
+    else if ((strncmp (line, "target ", 7) == 0) && (j->n_src > 0) &&
+             !j->rpath[j->n_src - 1])
+      j->rpath[j->n_src - 1] = journal_strdup (line + 7);
+    else if (strncmp (line, "next ", 5) == 0)
+      j->next_item = (size_t) strtoul (line + 5, (char **) NULL, 10);
+  }
+  x_fclose (fp, path);
+
+  complete = (j->n_src > 0) && (j->next_item >= 1) &&
+             (j->next_item <= j->n_src);
+  for (x = 0; (complete && (x < j->n_src)); ++x)
+    if (!j->rpath[x])
+      complete = false;
+  if (!complete)
+  {
+    x_error (0, "incomplete journal -- `%s'", path);
+    return false;
+  }
+  return true;
+}
+
+void
+journal_remove (const char *path)
+{
+  if ((unlink (path) != 0) && (errno != ENOENT))
+    x_error (errno, "failed to remove journal `%s'", path);
+}
+
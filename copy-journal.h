@@ -0,0 +1,44 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_JOURNAL_H__
+#define __COPY_JOURNAL_H__
+
+#include "copy-utils.h"
+
+#define JOURNAL_SUFFIX ".copy-journal"
+
+struct journal
+{
+  size_t n_src;
+  size_t next_item;
+  char **src_path;
+  char **rpath;
+};
+
+bool journal_write (const char *path,
+                    const char **src_path,
+                    const char **rpath,
+                    size_t n_src,
+                    size_t next_item);
+bool journal_read (const char *path, struct journal *j);
+void journal_remove (const char *path);
+
+#endif /* __COPY_JOURNAL_H__ */
+
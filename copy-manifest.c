@@ -0,0 +1,629 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copy-manifest.h"
+#include "copy-utils.h"
+
+/*
+ * A manifest is everything one scan of the sources found, in a form that
+ * is used straight from an mmap of the file. All numbers are in the byte
+ * order of the machine that wrote it (a manifest from the other kind of
+ * machine is refused by its version not matching):
+ *
+ *   header     64 bytes
+ *     magic              8  "COPYMAN\0"
+ *     version            4
+ *     restart interval   4
+ *     records            8
+ *     sources            8
+ *     sources offset     8
+ *     records offset     8
+ *     restarts offset    8
+ *     total bytes        8
+ *
+ *   sources, each padded to 8 bytes
+ *     bytes              8  sum of the sizes of its files
+ *     first record       8
+ *     records            8
+ *     source length      4
+ *     target length      4
+ *     source path           NUL terminated
+ *     target path           NUL terminated
+ *
+ *   records, sorted by source and then by path
+ *     size               8
+ *     mtime              8
+ *     atime              8
+ *     mode               4
+ *     uid                4
+ *     gid                4
+ *     source             4
+ *     shared             2  bytes of the previous path that this one starts
+ *                           with
+ *     suffix length      2
+ *     suffix                the rest of the path
+ *
+ *   restarts, 8 bytes each
+ *     the offset (from the records offset) of every restart interval-th
+ *     record, which always has nothing shared with the one before it, so
+ *     reading can start there
+ *
+ * Paths are relative to their source, the source itself having the empty
+ * path. Since a directory sorts before everything inside it, reading the
+ * records in order always creates a directory before its contents.
+ */
+
+#define MANIFEST_MAGIC       "COPYMAN"
+#define MANIFEST_MAGIC_SIZE  8
+#define MANIFEST_VERSION     1
+#define MANIFEST_RESTART     16
+#define MANIFEST_HEADER_SIZE 64
+#define MANIFEST_SOURCE_SIZE 32
+#define MANIFEST_RECORD_SIZE 44
+#define MANIFEST_ALIGN       8
+
+struct manifest_header
+{
+  char magic[MANIFEST_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t restart_interval;
+  uint64_t n_records;
+  uint64_t n_sources;
+  uint64_t sources_offset;
+  uint64_t records_offset;
+  uint64_t restarts_offset;
+  uint64_t total_bytes;
+};
+
+struct manifest
+{
+  const char *map;
+  size_t n_map;
+  struct manifest_header h;
+  struct manifest_source *sources;
+};
+
+struct writer_entry
+{
+  char *path;
+  size_t source;
+  byte_t size;
+  int64_t mtime;
+  int64_t atime;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+};
+
+struct manifest_writer
+{
+  size_t n_entries;
+  size_t n_alloc;
+  size_t n_sources;
+  struct writer_entry *entries;
+  struct manifest_source *sources;
+};
+
+struct manifest_writer *
+manifest_writer_new (void)
+{
+  struct manifest_writer *w;
+
+  w = calloc (1, sizeof (struct manifest_writer));
+  if (!w)
+    die (errno, "failed to allocate manifest");
+  return w;
+}
+
+size_t
+manifest_writer_add_source (struct manifest_writer *w,
+                            const char *src_path,
+                            const char *dst_path)
+{
+  struct manifest_source *s;
+
+  w->sources = realloc (w->sources, (w->n_sources + 1) *
+                                    sizeof (struct manifest_source));
+  if (!w->sources)
+    die (errno, "failed to allocate manifest");
+  s = &w->sources[w->n_sources];
+  memset (s, 0, sizeof (struct manifest_source));
+  s->src_path = strdup (src_path);
+  s->dst_path = strdup (dst_path);
+  if (!s->src_path || !s->dst_path)
+    die (errno, "failed to allocate manifest");
+  return w->n_sources++;
+}
+
+/* Adds PATH (relative to SOURCE) with the status ST. Only the sizes of
+   regular files count towards the bytes to copy. */
+void
+manifest_writer_add (struct manifest_writer *w,
+                     size_t source,
+                     const char *path,
+                     const struct stat *st)
+{
+  struct writer_entry *e;
+
+  if (w->n_entries == w->n_alloc)
+  {
+    w->n_alloc = w->n_alloc ? (w->n_alloc * 2) : 1024;
+    w->entries = realloc (w->entries,
+                          w->n_alloc * sizeof (struct writer_entry));
+    if (!w->entries)
+      die (errno, "failed to allocate manifest");
+  }
+  e = &w->entries[w->n_entries++];
+  e->path = strdup (path);
+  if (!e->path)
+    die (errno, "failed to allocate manifest");
+  e->source = source;
+  e->size = (byte_t) st->st_size;
+  e->mtime = (int64_t) st->st_mtime;
+  e->atime = (int64_t) st->st_atime;
+  e->mode = (uint32_t) st->st_mode;
+  e->uid = (uint32_t) st->st_uid;
+  e->gid = (uint32_t) st->st_gid;
+  if (S_ISREG (st->st_mode))
+    w->sources[source].bytes += e->size;
+}
+
+size_t
+manifest_writer_count (const struct manifest_writer *w)
+{
+  return w->n_entries;
+}
+
+static int
+writer_entry_compare (const void *a, const void *b)
+{
+  const struct writer_entry *x = (const struct writer_entry *) a;
+  const struct writer_entry *y = (const struct writer_entry *) b;
+
+  if (x->source != y->source)
+    return (x->source < y->source) ? -1 : 1;
+  return strcmp (x->path, y->path);
+}
+
+static void
+writer_free (struct manifest_writer *w)
+{
+  size_t x;
+
+  for (x = 0; x < w->n_entries; ++x)
+    free (w->entries[x].path);
+  for (x = 0; x < w->n_sources; ++x)
+  {
+    free ((char *) w->sources[x].src_path);
+    free ((char *) w->sources[x].dst_path);
+  }
+  free (w->entries);
+  free (w->sources);
+  free (w);
+}
+
+static void
+put (char *buffer, size_t *offset, const void *value, size_t n)
+{
+  memcpy (buffer + *offset, value, n);
+  *offset += n;
+}
+
+static void
+write_padding (FILE *fp, uint64_t *offset)
+{
+  static const char zeros[MANIFEST_ALIGN];
+  size_t n;
+
+  n = (MANIFEST_ALIGN - (*offset % MANIFEST_ALIGN)) % MANIFEST_ALIGN;
+  fwrite (zeros, 1, n, fp);
+  *offset += n;
+}
+
+static uint16_t
+shared_prefix (const char *a, const char *b)
+{
+  uint16_t n;
+
+  for (n = 0; a[n] && (a[n] == b[n]) && (n < UINT16_MAX); ++n)
+    ;
+  return n;
+}
+
+/* Sorts what was added and writes it to PATH (through a temporary file,
+   so a reader never sees half of it). W is freed either way. */
+bool
+manifest_writer_finish (struct manifest_writer *w, const char *path)
+{
+  bool ok;
+  size_t x;
+  size_t n;
+  size_t n_path;
+  uint16_t shared;
+  uint16_t n_suffix;
+  uint32_t n_src;
+  uint32_t n_dst;
+  uint32_t source;
+  uint64_t offset;
+  uint64_t *restarts;
+  struct manifest_header h;
+  struct writer_entry *e;
+  char record[MANIFEST_SOURCE_SIZE + MANIFEST_RECORD_SIZE];
+  FILE *fp;
+
+  qsort (w->entries, w->n_entries, sizeof (struct writer_entry),
+         writer_entry_compare);
+  for (x = 0; x < w->n_entries; ++x)
+  {
+    e = &w->entries[x];
+    if (w->sources[e->source].n_records++ == 0)
+      w->sources[e->source].first_record = x;
+  }
+
+  n_path = strlen (path);
+  char tmp_path[n_path + 5];
+  memcpy (tmp_path, path, n_path);
+  memcpy (tmp_path + n_path, ".tmp", 5);
+
+  fp = x_fopen (tmp_path, "wb");
+  if (!fp)
+  {
+    writer_free (w);
+    return false;
+  }
+
+  memset (&h, 0, sizeof (struct manifest_header));
+  memcpy (h.magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC));
+  h.version = MANIFEST_VERSION;
+  h.restart_interval = MANIFEST_RESTART;
+  h.n_records = w->n_entries;
+  h.n_sources = w->n_sources;
+  fwrite (&h, 1, MANIFEST_HEADER_SIZE, fp);
+  offset = MANIFEST_HEADER_SIZE;
+
+  h.sources_offset = offset;
+  for (x = 0; x < w->n_sources; ++x)
+  {
+    const struct manifest_source *s = &w->sources[x];
+    uint64_t first = s->first_record;
+    uint64_t count = s->n_records;
+
+    n = 0;
+    n_src = (uint32_t) strlen (s->src_path);
+    n_dst = (uint32_t) strlen (s->dst_path);
+    put (record, &n, &s->bytes, 8);
+    put (record, &n, &first, 8);
+    put (record, &n, &count, 8);
+    put (record, &n, &n_src, 4);
+    put (record, &n, &n_dst, 4);
+    fwrite (record, 1, n, fp);
+    fwrite (s->src_path, 1, n_src + 1, fp);
+    fwrite (s->dst_path, 1, n_dst + 1, fp);
+    offset += n + n_src + n_dst + 2;
+    write_padding (fp, &offset);
+    h.total_bytes += s->bytes;
+  }
+
+  h.records_offset = offset;
+  restarts = malloc (((w->n_entries / MANIFEST_RESTART) + 1) *
+                     sizeof (uint64_t));
+  if (!restarts)
+    die (errno, "failed to allocate manifest");
+  for (x = 0; x < w->n_entries; ++x)
+  {
+    e = &w->entries[x];
+    if ((x % MANIFEST_RESTART) == 0)
+    {
+      restarts[x / MANIFEST_RESTART] = offset - h.records_offset;
+      shared = 0;
+    }
+    else
+      shared = shared_prefix (e->path, w->entries[x - 1].path);
+    n_suffix = (uint16_t) (strlen (e->path) - shared);
+    source = (uint32_t) e->source;
+
+    n = 0;
+    put (record, &n, &e->size, 8);
+    put (record, &n, &e->mtime, 8);
+    put (record, &n, &e->atime, 8);
+    put (record, &n, &e->mode, 4);
+    put (record, &n, &e->uid, 4);
+    put (record, &n, &e->gid, 4);
+    put (record, &n, &source, 4);
+    put (record, &n, &shared, 2);
+    put (record, &n, &n_suffix, 2);
+    fwrite (record, 1, n, fp);
+    fwrite (e->path + shared, 1, n_suffix, fp);
+    offset += n + n_suffix;
+  }
+  write_padding (fp, &offset);
+
+  h.restarts_offset = offset;
+  fwrite (restarts, sizeof (uint64_t),
+          (w->n_entries + MANIFEST_RESTART - 1) / MANIFEST_RESTART, fp);
+  free (restarts);
+  writer_free (w);
+
+  ok = (fseek (fp, 0, SEEK_SET) == 0) &&
+       (fwrite (&h, 1, MANIFEST_HEADER_SIZE, fp) == MANIFEST_HEADER_SIZE) &&
+       (fflush (fp) == 0) &&
+       (fsync (fileno (fp)) == 0) &&
+       !ferror (fp);
+  if (!ok)
+    x_error (errno, "failed to write manifest `%s'", tmp_path);
+  if (!x_fclose (fp, tmp_path) || !ok)
+  {
+    unlink (tmp_path);
+    return false;
+  }
+  if (rename (tmp_path, path) != 0)
+  {
+    x_error (errno, "failed to write manifest `%s'", path);
+    unlink (tmp_path);
+    return false;
+  }
+  return true;
+}
+
+static bool
+manifest_invalid (struct manifest *m, const char *path)
+{
+  x_error (0, "not a manifest (or a damaged one) -- `%s'", path);
+  manifest_close (m);
+  return false;
+}
+
+static bool
+load_sources (struct manifest *m, const char *path)
+{
+  size_t x;
+  uint32_t n_src;
+  uint32_t n_dst;
+  uint64_t first;
+  uint64_t count;
+  uint64_t offset;
+  const char *p;
+  struct manifest_source *s;
+
+  m->sources = calloc (m->h.n_sources ? m->h.n_sources : 1,
+                       sizeof (struct manifest_source));
+  if (!m->sources)
+    die (errno, "failed to load manifest `%s'", path);
+
+  offset = m->h.sources_offset;
+  for (x = 0; x < m->h.n_sources; ++x)
+  {
+    if ((offset + MANIFEST_SOURCE_SIZE) > m->h.records_offset)
+      return false;
+    s = &m->sources[x];
+    p = m->map + offset;
+    memcpy (&s->bytes, p, 8);
+    memcpy (&first, p + 8, 8);
+    memcpy (&count, p + 16, 8);
+    memcpy (&n_src, p + 24, 4);
+    memcpy (&n_dst, p + 28, 4);
+    offset += MANIFEST_SOURCE_SIZE;
+    if (((offset + n_src + n_dst + 2) > m->h.records_offset) ||
+        (m->map[offset + n_src] != '\0') ||
+        (m->map[offset + n_src + 1 + n_dst] != '\0') ||
+        (first > m->h.n_records) ||
+        (count > (m->h.n_records - first)))
+      return false;
+    s->src_path = m->map + offset;
+    s->dst_path = m->map + offset + n_src + 1;
+    s->first_record = (size_t) first;
+    s->n_records = (size_t) count;
+    offset += n_src + n_dst + 2;
+    offset += (MANIFEST_ALIGN - (offset % MANIFEST_ALIGN)) % MANIFEST_ALIGN;
+  }
+  return true;
+}
+
+/* Maps the manifest at PATH. Only the header and the (small) table of
+   sources are looked at, the records are read in place as they are
+   needed. */
+struct manifest *
+manifest_open (const char *path)
+{
+  int fd;
+  uint64_t n_restarts;
+  struct stat st;
+  struct manifest *m;
+  void *map;
+
+  fd = open (path, O_RDONLY);
+  if (fd == -1)
+  {
+    x_error (errno, "failed to open manifest `%s'", path);
+    return NULL;
+  }
+  if (fstat (fd, &st) != 0)
+  {
+    x_error (errno, "failed to stat manifest `%s'", path);
+    close (fd);
+    return NULL;
+  }
+  if (st.st_size < MANIFEST_HEADER_SIZE)
+  {
+    x_error (0, "not a manifest -- `%s'", path);
+    close (fd);
+    return NULL;
+  }
+  map = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+  {
+    x_error (errno, "failed to map manifest `%s'", path);
+    return NULL;
+  }
+  madvise (map, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+  m = calloc (1, sizeof (struct manifest));
+  if (!m)
+    die (errno, "failed to load manifest `%s'", path);
+  m->map = (const char *) map;
+  m->n_map = (size_t) st.st_size;
+  memcpy (&m->h, m->map, MANIFEST_HEADER_SIZE);
+
+  if ((memcmp (m->h.magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC)) != 0) ||
+      (m->h.version != MANIFEST_VERSION) ||
+      (m->h.restart_interval == 0))
+  {
+    manifest_invalid (m, path);
+    return NULL;
+  }
+  n_restarts = (m->h.n_records + m->h.restart_interval - 1) /
+               m->h.restart_interval;
+  if ((m->h.sources_offset < MANIFEST_HEADER_SIZE) ||
+      (m->h.records_offset < m->h.sources_offset) ||
+      (m->h.restarts_offset < m->h.records_offset) ||
+      (m->h.restarts_offset > m->n_map) ||
+      ((m->h.restarts_offset % MANIFEST_ALIGN) != 0) ||
+      (n_restarts > ((m->n_map - m->h.restarts_offset) / 8)) ||
+      !load_sources (m, path))
+  {
+    manifest_invalid (m, path);
+    return NULL;
+  }
+  return m;
+}
+
+void
+manifest_close (struct manifest *m)
+{
+  if (!m)
+    return;
+  munmap ((void *) m->map, m->n_map);
+  free (m->sources);
+  free (m);
+}
+
+size_t
+manifest_n_sources (const struct manifest *m)
+{
+  return (size_t) m->h.n_sources;
+}
+
+size_t
+manifest_n_records (const struct manifest *m)
+{
+  return (size_t) m->h.n_records;
+}
+
+byte_t
+manifest_total_bytes (const struct manifest *m)
+{
+  return (byte_t) m->h.total_bytes;
+}
+
+const struct manifest_source *
+manifest_source (const struct manifest *m, size_t source)
+{
+  return &m->sources[source];
+}
+
+/* Positions C to read record INDEX next, starting from the closest
+   restart before it. */
+bool
+manifest_seek (const struct manifest *m,
+               struct manifest_cursor *c,
+               size_t index)
+{
+  uint64_t restart;
+  struct manifest_entry e;
+
+  if (index > m->h.n_records)
+    return false;
+  c->m = m;
+  c->n_path = 0;
+  c->path[0] = '\0';
+  c->index = (index / m->h.restart_interval) * m->h.restart_interval;
+  c->offset = 0;
+  if (c->index < m->h.n_records)
+  {
+    memcpy (&restart, m->map + m->h.restarts_offset +
+                      ((c->index / m->h.restart_interval) * 8), 8);
+    c->offset = (size_t) restart;
+  }
+  while (c->index < index)
+    if (!manifest_next (c, &e))
+      return false;
+  return true;
+}
+
+/* Reads the next record into E, whose path stays valid until the next
+   call. Returns false at the end, and also (with an error) when the
+   record is damaged. */
+bool
+manifest_next (struct manifest_cursor *c, struct manifest_entry *e)
+{
+  uint16_t shared;
+  uint16_t n_suffix;
+  uint32_t source;
+  uint64_t size;
+  const char *p;
+  const struct manifest *m;
+
+  m = c->m;
+  if (c->index >= m->h.n_records)
+    return false;
+  if ((m->h.records_offset + c->offset + MANIFEST_RECORD_SIZE) >
+      m->h.restarts_offset)
+    goto damaged;
+  p = m->map + m->h.records_offset + c->offset;
+  memcpy (&size, p, 8);
+  memcpy (&e->mtime, p + 8, 8);
+  memcpy (&e->atime, p + 16, 8);
+  memcpy (&e->mode, p + 24, 4);
+  memcpy (&e->uid, p + 28, 4);
+  memcpy (&e->gid, p + 32, 4);
+  memcpy (&source, p + 36, 4);
+  memcpy (&shared, p + 40, 2);
+  memcpy (&n_suffix, p + 42, 2);
+  if ((shared > c->n_path) ||
+      (((size_t) shared + n_suffix) >= PATH_BUFMAX) ||
+      (source >= m->h.n_sources) ||
+      ((m->h.records_offset + c->offset + MANIFEST_RECORD_SIZE + n_suffix) >
+       m->h.restarts_offset))
+    goto damaged;
+
+  memcpy (c->path + shared, p + MANIFEST_RECORD_SIZE, n_suffix);
+  c->n_path = (size_t) shared + n_suffix;
+  c->path[c->n_path] = '\0';
+  c->offset += MANIFEST_RECORD_SIZE + n_suffix;
+  c->index++;
+
+  e->path = c->path;
+  e->source = (size_t) source;
+  e->size = (byte_t) size;
+  return true;
+
+damaged:
+  x_error (0, "damaged manifest record %zu", c->index);
+  return false;
+}
@@ -0,0 +1,82 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_MANIFEST_H__
+#define __COPY_MANIFEST_H__
+
+#include "copy-utils.h"
+
+struct manifest;
+struct manifest_writer;
+
+struct manifest_source
+{
+  const char *src_path;
+  const char *dst_path;
+  byte_t bytes;
+  size_t first_record;
+  size_t n_records;
+};
+
+struct manifest_entry
+{
+  /* relative to the source, empty for the source itself */
+  const char *path;
+  size_t source;
+  byte_t size;
+  int64_t mtime;
+  int64_t atime;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+};
+
+struct manifest_cursor
+{
+  const struct manifest *m;
+  size_t index;
+  size_t offset;
+  size_t n_path;
+  char path[PATH_BUFMAX];
+};
+
+struct manifest_writer *manifest_writer_new (void);
+size_t manifest_writer_add_source (struct manifest_writer *w,
+                                   const char *src_path,
+                                   const char *dst_path);
+void manifest_writer_add (struct manifest_writer *w,
+                          size_t source,
+                          const char *path,
+                          const struct stat *st);
+size_t manifest_writer_count (const struct manifest_writer *w);
+bool manifest_writer_finish (struct manifest_writer *w, const char *path);
+
+struct manifest *manifest_open (const char *path);
+void manifest_close (struct manifest *m);
+size_t manifest_n_sources (const struct manifest *m);
+size_t manifest_n_records (const struct manifest *m);
+byte_t manifest_total_bytes (const struct manifest *m);
+const struct manifest_source *manifest_source (const struct manifest *m,
+                                               size_t source);
+bool manifest_seek (const struct manifest *m,
+                    struct manifest_cursor *c,
+                    size_t index);
+bool manifest_next (struct manifest_cursor *c, struct manifest_entry *e);
+
+#endif /* __COPY_MANIFEST_H__ */
@@ -0,0 +1,299 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy-metrics.h"
+#include "copy-utils.h"
+
+/*
+ * The metrics are written in the text format of Prometheus, for the
+ * textfile collector of node_exporter. A thread rewrites the file every
+ * interval, through a temporary file and rename() so the collector never
+ * reads half of it, and once more when the copy ends, with copy_running
+ * at 0 then. A copy that stalls keeps copy_running at 1 with a throughput
+ * of 0.
+ */
+
+static const char *phase_names[N_METRICS_PHASES] =
+{
+  "scan",
+  "directories",
+  "data",
+  "attributes",
+  "verify"
+};
+
+static pthread_mutex_t    lock          = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     wake          =  PTHREAD_COND_INITIALIZER;
+static pthread_t          thread;
+static bool               started       =                     false;
+static bool               stopping      =                     false;
+static bool               warned        =                     false;
+static const char *       metrics_path  =                      NULL;
+static char *             job_label     =                      NULL;
+static double             interval      =                       0.0;
+static metrics_count_func count_func    =                      NULL;
+static int                phase         =        METRICS_PHASE_NONE;
+static struct timeval     phase_start;
+static double             phase_seconds[N_METRICS_PHASES];
+static byte_t             last_bytes    =                BYTE_C (0);
+static struct timeval     last_time;
+
+static double
+seconds_since (const struct timeval *start, const struct timeval *now)
+{
+  return ((double) get_milliseconds (start, now)) / MILLISECONDS_PER_SECOND;
+}
+
+/* Label values are quoted, with backslashes, quotes and newlines
+   escaped. */
+static char *
+label_escape (const char *s)
+{
+  char *p;
+  char *escaped;
+
+  escaped = malloc ((strlen (s) * 2) + 1);
+  if (!escaped)
+    die (errno, "failed to allocate metrics");
+  for (p = escaped; *s; ++s)
+  {
+    if ((*s == '\\') || (*s == '"') || (*s == '\n'))
+      *p++ = '\\';
+    *p++ = (*s == '\n') ? 'n' : *s;
+  }
+  *p = '\0';
+  return escaped;
+}
+
+static void
+metric_header (FILE *fp, const char *name, const char *type, const char *help)
+{
+  fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+metric_value (FILE *fp,
+              const char *name,
+              const char *label,
+              const char *label_value,
+              double value)
+{
+  if (label)
+    fprintf (fp, "%s{job_name=\"%s\",%s=\"%s\"} %.15g\n",
+             name, job_label, label, label_value, value);
+  else
+    fprintf (fp, "%s{job_name=\"%s\"} %.15g\n", name, job_label, value);
+}
+
+static void
+metric (FILE *fp,
+        const char *name,
+        const char *type,
+        const char *help,
+        double value)
+{
+  metric_header (fp, name, type, help);
+  metric_value (fp, name, NULL, NULL, value);
+}
+
+static void
+metrics_print (FILE *fp,
+               const struct metrics_counts *c,
+               double throughput,
+               const double *seconds,
+               bool running)
+{
+  int x;
+
+  metric (fp, "copy_bytes_copied_total", "counter",
+          "Bytes copied to the destination.",
+          (double) c->bytes_copied);
+  metric (fp, "copy_files_copied_total", "counter",
+          "Files copied to the destination.",
+          (double) c->files_copied);
+  metric (fp, "copy_bytes_skipped_total", "counter",
+          "Bytes not copied for being filtered out or already copied.",
+          (double) c->bytes_skipped);
+  metric (fp, "copy_errors_total", "counter",
+          "Errors recorded in the error log.",
+          (double) c->errors);
+  metric (fp, "copy_retries_total", "counter",
+          "Failed entries that were tried again.",
+          (double) c->retries);
+  metric (fp, "copy_throughput_bytes_per_second", "gauge",
+          "Bytes copied per second since the last update.",
+          throughput);
+  metric (fp, "copy_files_in_flight", "gauge",
+          "Files being copied right now.",
+          (double) c->files_in_flight);
+  metric_header (fp, "copy_queue_depth", "gauge",
+                 "Files waiting to be copied.");
+  metric_value (fp, "copy_queue_depth", "queue", "jobs",
+                (double) c->jobs_queued);
+  metric_value (fp, "copy_queue_depth", "queue", "uring",
+                (double) c->uring_queued);
+  metric_header (fp, "copy_phase_seconds_total", "counter",
+                 "Time spent in each phase of the copy.");
+  for (x = 0; x < N_METRICS_PHASES; ++x)
+    metric_value (fp, "copy_phase_seconds_total", "phase", phase_names[x],
+                  seconds[x]);
+  metric (fp, "copy_running", "gauge",
+          "Whether the copy is still running.",
+          running ? 1.0 : 0.0);
+}
+
+static void
+metrics_write (bool running)
+{
+  int x;
+  double elapsed;
+  double throughput;
+  double seconds[N_METRICS_PHASES];
+  struct timeval now;
+  struct metrics_counts c;
+  FILE *fp;
+
+  memset (&c, 0, sizeof (struct metrics_counts));
+  count_func (&c);
+  x_gettimeofday (&now);
+  pthread_mutex_lock (&lock);
+  for (x = 0; x < N_METRICS_PHASES; ++x)
+    seconds[x] = phase_seconds[x];
+  if (phase != METRICS_PHASE_NONE)
+    seconds[phase] += seconds_since (&phase_start, &now);
+  pthread_mutex_unlock (&lock);
+
+  elapsed = seconds_since (&last_time, &now);
+  throughput = 0.0;
+  if ((elapsed > 0.0) && (c.bytes_copied > last_bytes))
+    throughput = ((double) (c.bytes_copied - last_bytes)) / elapsed;
+  last_bytes = c.bytes_copied;
+  last_time = now;
+
+  size_t n_path = strlen (metrics_path);
+  char tmp_path[n_path + 5];
+  memcpy (tmp_path, metrics_path, n_path);
+  memcpy (tmp_path + n_path, ".tmp", 5);
+
+  fp = fopen (tmp_path, "w");
+  if (fp)
+  {
+    metrics_print (fp, &c, throughput, seconds, running);
+    if (fclose (fp) == 0)
+    {
+      if (rename (tmp_path, metrics_path) == 0)
+        return;
+    }
+  }
+  /* once is enough, not every interval */
+  if (!warned)
+    x_error (errno, "failed to write metrics `%s'", metrics_path);
+  warned = true;
+  (void) unlink (tmp_path);
+}
+
+static void *
+metrics_thread (void *data)
+{
+  double whole;
+  struct timespec deadline;
+
+  (void) data;
+  pthread_mutex_lock (&lock);
+  while (!stopping)
+  {
+    pthread_mutex_unlock (&lock);
+    metrics_write (true);
+    pthread_mutex_lock (&lock);
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long) (modf (interval, &whole) * 1e9);
+    deadline.tv_sec += (time_t) whole + (deadline.tv_nsec / 1000000000L);
+    deadline.tv_nsec %= 1000000000L;
+    while (!stopping &&
+           (pthread_cond_timedwait (&wake, &lock, &deadline) != ETIMEDOUT))
+      ;
+  }
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+/* Writes the metrics to PATH every EVERY seconds until metrics_stop(),
+   labeled with JOB_NAME, with the counts COUNT fills in. */
+void
+metrics_start (const char *path,
+               const char *job_name,
+               double every,
+               metrics_count_func count)
+{
+  int errnum;
+
+  metrics_path = path;
+  job_label = label_escape (job_name);
+  interval = every;
+  count_func = count;
+  x_gettimeofday (&last_time);
+  errnum = pthread_create (&thread, NULL, metrics_thread, NULL);
+  if (errnum != 0)
+    die (errnum, "failed to start writing metrics");
+  started = true;
+}
+
+/* Ends the phase the copy was in and starts timing PHASE, which may be
+   METRICS_PHASE_NONE. */
+void
+metrics_phase (int next)
+{
+  struct timeval now;
+
+  x_gettimeofday (&now);
+  pthread_mutex_lock (&lock);
+  if (phase != METRICS_PHASE_NONE)
+    phase_seconds[phase] += seconds_since (&phase_start, &now);
+  phase = next;
+  phase_start = now;
+  pthread_mutex_unlock (&lock);
+}
+
+/* Stops the thread and writes the metrics one last time. */
+void
+metrics_stop (void)
+{
+  if (!started)
+    return;
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_signal (&wake);
+  pthread_mutex_unlock (&lock);
+  pthread_join (thread, NULL);
+  started = false;
+  metrics_phase (METRICS_PHASE_NONE);
+  metrics_write (false);
+  free (job_label);
+  job_label = NULL;
+}
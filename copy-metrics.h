@@ -0,0 +1,63 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_METRICS_H__
+#define __COPY_METRICS_H__
+
+#include "copy-utils.h"
+
+/* the default value, in seconds */
+#define METRICS_INTERVAL 10
+
+/* what the copy is busy with, timed for the metrics */
+enum
+{
+  METRICS_PHASE_NONE = -1,
+  METRICS_PHASE_SCAN,
+  METRICS_PHASE_DIRECTORIES,
+  METRICS_PHASE_DATA,
+  METRICS_PHASE_ATTRIBUTES,
+  METRICS_PHASE_VERIFY,
+  N_METRICS_PHASES
+};
+
+struct metrics_counts
+{
+  byte_t bytes_copied;
+  byte_t bytes_skipped;
+  size_t files_copied;
+  size_t errors;
+  size_t retries;
+  size_t files_in_flight;
+  size_t jobs_queued;
+  size_t uring_queued;
+};
+
+/* fills in the counts as they are right now; called from the thread that
+   writes the metrics */
+typedef void (*metrics_count_func) (struct metrics_counts *counts);
+
+void metrics_start (const char *path,
+                    const char *job_name,
+                    double every,
+                    metrics_count_func count);
+void metrics_phase (int phase);
+void metrics_stop (void);
+
+#endif /* __COPY_METRICS_H__ */
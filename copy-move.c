@@ -0,0 +1,176 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy-checksum.h"
+#include "copy-errors.h"
+#include "copy-move.h"
+#include "copy-pool.h"
+#include "copy-utils.h"
+
+struct move_job
+{
+  char *src_path;
+  char *dst_path;
+};
+
+static struct pool *move_pool = NULL;
+
+static bool
+move_verify (const char *src_path, const char *dst_path)
+{
+  struct stat src_st;
+  struct stat dst_st;
+  char src_sum[CHECKSUM_BUFMAX];
+  char dst_sum[CHECKSUM_BUFMAX];
+
+  if ((stat (src_path, &src_st) != 0) || (stat (dst_path, &dst_st) != 0))
+    return false;
+  if (src_st.st_size != dst_st.st_size)
+    return false;
+  return get_checksum (src_sum, src_path) &&
+         get_checksum (dst_sum, dst_path) &&
+         streq (src_sum, dst_sum, false);
+}
+
+static void
+move_unlink_task (void *arg)
+{
+  struct move_job *job;
+
+  job = (struct move_job *) arg;
+  if (!move_verify (job->src_path, job->dst_path))
+  {
+    x_error (0, "verification failed, not removing source -- `%s'",
+             job->src_path);
+    error_log_add (PHASE_VERIFY, 0, job->src_path, job->dst_path);
+  }
+  else
+  {
+    /* the copy itself was synced before it was queued, but its directory
+       entry has to be durable as well before the only other copy goes */
+    sync_parent_directory (job->dst_path);
+    if (unlink (job->src_path) != 0)
+    {
+      x_error (errno, "failed to remove source `%s'", job->src_path);
+      error_log_add (PHASE_REMOVE, errno, job->src_path, job->dst_path);
+    }
+  }
+  free (job->src_path);
+  free (job->dst_path);
+  free (job);
+}
+
+/* MOVE_NEEDS_COPY means the two paths are on different filesystems (or
+   DST_PATH is a non-empty directory) and the move has to be done by
+   copying. */
+int
+move_rename (const char *src_path, const char *dst_path)
+{
+  if (rename (src_path, dst_path) == 0)
+    return MOVE_RENAMED;
+  if ((errno == EXDEV) || (errno == EEXIST) || (errno == ENOTEMPTY))
+    return MOVE_NEEDS_COPY;
+  x_error (errno, "failed to move `%s' to `%s'", src_path, dst_path);
+  return MOVE_FAILED;
+}
+
+/* DST_PATH must already be synced to disk. */
+void
+move_queue_unlink (const char *src_path, const char *dst_path)
+{
+  struct move_job *job;
+
+  job = malloc (sizeof (struct move_job));
+  if (!job)
+    die (errno, "failed to allocate move job");
+  job->src_path = strdup (src_path);
+  job->dst_path = strdup (dst_path);
+  if (!job->src_path || !job->dst_path)
+    die (errno, "failed to allocate move job");
+  if (!move_pool)
+    move_pool = pool_new (MOVE_THREADS, 0);
+  pool_submit (move_pool, move_unlink_task, job);
+}
+
+/* Waits for every queued unlink to be done. */
+void
+move_finish (void)
+{
+  if (move_pool)
+  {
+    pool_wait (move_pool);
+    pool_free (move_pool);
+    move_pool = NULL;
+  }
+}
+
+/* Removes the (by now hopefully empty) directories of a moved source tree,
+   deepest first. Anything left behind keeps its parents alive. */
+void
+move_remove_directories (const char *path)
+{
+  bool err;
+  size_t n_path;
+  size_t n_name;
+  size_t n_child;
+  struct stat st;
+  DIR *dp;
+  struct dirent *ep;
+
+  dp = x_opendir (path);
+  if (!dp)
+    return;
+
+  n_path = strlen (path);
+  for (;;)
+  {
+    ep = x_readdir (dp, &err, path);
+    if (!ep)
+      break;
+    if (streq (ep->d_name, ".", false) || streq (ep->d_name, "..", false))
+      continue;
+    n_name = strlen (ep->d_name);
+    n_child = n_path + n_name + 1;
+    char child[n_child + 1];
+    memcpy (child, path, n_path);
+    child[n_path] = DIR_SEPARATOR_C;
+    memcpy (child + (n_path + 1), ep->d_name, n_name);
+    child[n_child] = '\0';
+    if ((lstat (child, &st) == 0) && S_ISDIR (st.st_mode))
+      move_remove_directories (child);
+  }
+  x_closedir (dp, path);
+
+  /* whatever kept it from being empty was either excluded on purpose or
+     has been logged already */
+  if ((rmdir (path) != 0) && (errno != ENOTEMPTY))
+  {
+    x_error (errno, "not removing source directory `%s'", path);
+    error_log_add (PHASE_REMOVE, errno, path, NULL);
+  }
+}
+
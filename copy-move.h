@@ -0,0 +1,42 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_MOVE_H__
+#define __COPY_MOVE_H__
+
+#include "copy-utils.h"
+
+/* number of workers verifying and unlinking cross-device moves */
+#define MOVE_THREADS 4
+
+/* what move_rename() did */
+enum
+{
+  MOVE_RENAMED,
+  MOVE_NEEDS_COPY,
+  MOVE_FAILED
+};
+
+int move_rename (const char *src_path, const char *dst_path);
+void move_queue_unlink (const char *src_path, const char *dst_path);
+void move_finish (void);
+void move_remove_directories (const char *path);
+
+#endif /* __COPY_MOVE_H__ */
+
@@ -0,0 +1,332 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef ENABLE_SOUND
+# include "SDL/SDL.h"
+# include "SDL/SDL_sound.h"
+#endif
+
+#include "copy-notify.h"
+#include "copy-utils.h"
+
+#ifdef ENABLE_SOUND
+# define SOUND_PATH SOUNDSDIR DIR_SEPARATOR_S SOUNDFILE
+#endif
+
+#define NOTIFY_BUFMAX 256
+
+/*
+ * Whatever is told about a finished copy must not hold it up: the sound
+ * and the command each run in a grandchild of their own, in a session of
+ * its own and with /dev/null for input and output, so neither the exit of
+ * the copy nor a script reading its output waits for them. The socket only
+ * gets a single line, sent without blocking.
+ */
+
+#ifdef ENABLE_SOUND
+struct sound_data
+{
+  Uint32 decoded_bytes;
+  SDL_AudioSpec device_format;
+  Uint8 *decoded_ptr;
+  Sound_Sample *sample;
+};
+
+static bool          playing_sound = true;
+static volatile int  sound_done    =    0;
+#endif
+static const char *  command       = NULL;
+static const char *  socket_path   = NULL;
+
+static const char *status_names[] = {"done", "failed", "cancelled"};
+
+#ifdef ENABLE_SOUND
+static void
+sound_callback (void *data, Uint8 *stream, int len)
+{
+  int size;
+  int written;
+  struct sound_data *p;
+
+  size = 0;
+  p = (struct sound_data *) data;
+
+  while (size < len)
+  {
+    if (p->decoded_bytes == 0)
+    {
+      if (((p->sample->flags & SOUND_SAMPLEFLAG_ERROR) == 0) &&
+          ((p->sample->flags & SOUND_SAMPLEFLAG_EOF) == 0))
+      {
+        p->decoded_bytes = Sound_Decode (p->sample);
+        p->decoded_ptr = p->sample->buffer;
+      }
+      if (p->decoded_bytes == 0)
+      {
+        memset (stream + size, 0, len - size);
+        sound_done = 1;
+        return;
+      }
+    }
+    written = len - size;
+    if (written > p->decoded_bytes)
+      written = p->decoded_bytes;
+    if (written > 0)
+    {
+      memcpy (stream + size, (Uint8 *) p->decoded_ptr, written);
+      size += written;
+      p->decoded_ptr += written;
+      p->decoded_bytes -= written;
+    }
+  }
+}
+
+static void
+get_sound_file_path (char *buffer)
+{
+  struct stat s;
+
+  *buffer = '\0';
+  memset (&s, 0, sizeof (struct stat));
+
+  if ((stat (SOUNDFILE, &s) == 0) && S_ISREG (s.st_mode))
+    memcpy (buffer, SOUNDFILE, strlen (SOUNDFILE) + 1);
+  else
+  {
+    memset (&s, 0, sizeof (struct stat));
+    if ((stat (SOUND_PATH, &s) == 0) && S_ISREG (s.st_mode))
+      memcpy (buffer, SOUND_PATH, strlen (SOUND_PATH) + 1);
+  }
+}
+
+static void
+play_sound (void)
+{
+  struct sound_data data;
+  char path[PATH_BUFMAX];
+
+  get_sound_file_path (path);
+  if (!*path)
+    return;
+
+  memset (&data, 0, sizeof (struct sound_data));
+  data.sample = Sound_NewSampleFromFile (path, NULL, 65536);
+
+  if (!data.sample)
+    return;
+
+  data.device_format.freq = data.sample->actual.rate;
+  data.device_format.format = data.sample->actual.format;
+  data.device_format.channels = data.sample->actual.channels;
+  data.device_format.samples = 4096;
+  data.device_format.callback = sound_callback;
+  data.device_format.userdata = &data;
+
+  if (SDL_OpenAudio (&data.device_format, NULL) < 0)
+  {
+    Sound_FreeSample (data.sample);
+    return;
+  }
+
+  SDL_PauseAudio (0);
+
+  sound_done = 0;
+  while (!sound_done)
+    SDL_Delay (10);
+
+  SDL_PauseAudio (1);
+  SDL_Delay (2 * 1000 * data.device_format.samples / data.device_format.freq);
+  Sound_FreeSample (data.sample);
+  SDL_CloseAudio ();
+}
+
+/* Nobody sees errors from here anymore, so there is no point in
+   reporting them. */
+static void
+sound_run (const struct notify_event *e)
+{
+  (void) e;
+  if (Sound_Init ())
+  {
+    play_sound ();
+    Sound_Quit ();
+  }
+  SDL_Quit ();
+}
+#endif
+
+static void
+command_run (const struct notify_event *e)
+{
+  char value[NOTIFY_BUFMAX];
+
+  setenv ("COPY_STATUS", status_names[e->status], 1);
+  snprintf (value, NOTIFY_BUFMAX, "%" PRIu64, (uint64_t) e->bytes);
+  setenv ("COPY_BYTES", value, 1);
+  snprintf (value, NOTIFY_BUFMAX, "%zu", e->files);
+  setenv ("COPY_FILES", value, 1);
+  snprintf (value, NOTIFY_BUFMAX, "%zu", e->errors);
+  setenv ("COPY_ERRORS", value, 1);
+  snprintf (value, NOTIFY_BUFMAX, "%.3f", e->seconds);
+  setenv ("COPY_SECONDS", value, 1);
+  execl ("/bin/sh", "sh", "-c", command, (char *) NULL);
+}
+
+/* Runs FUNC in a grandchild that nothing waits for. Only the child in
+   between is reaped, which exits right after forking. */
+static void
+detach (void (*func) (const struct notify_event *e),
+        const struct notify_event *e)
+{
+  int fd;
+  pid_t pid;
+
+  fflush (stdout);
+  fflush (stderr);
+  pid = fork ();
+  if (pid == -1)
+  {
+    x_error (errno, "failed to start notification");
+    return;
+  }
+  if (pid == 0)
+  {
+    if (fork () != 0)
+      _exit (0);
+    setsid ();
+    fd = open ("/dev/null", O_RDWR);
+    if (fd != -1)
+    {
+      dup2 (fd, STDIN_FILENO);
+      dup2 (fd, STDOUT_FILENO);
+      dup2 (fd, STDERR_FILENO);
+      if (fd > STDERR_FILENO)
+        close (fd);
+    }
+    func (e);
+    _exit (0);
+  }
+  while ((waitpid (pid, NULL, 0) == -1) && (errno == EINTR))
+    ;
+}
+
+static int
+socket_connect (int type, const struct sockaddr_un *addr)
+{
+  int fd;
+
+  fd = socket (AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (connect (fd, (const struct sockaddr *) addr,
+               sizeof (struct sockaddr_un)) != 0)
+  {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Sends one line to a datagram socket, or to a stream socket if that is
+   what is listening, without ever waiting for the reader. */
+static void
+socket_send (const struct notify_event *e)
+{
+  int fd;
+  int len;
+  struct sockaddr_un addr;
+  char line[NOTIFY_BUFMAX];
+
+  memset (&addr, 0, sizeof (struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+  {
+    x_error (ENAMETOOLONG, "failed to notify `%s'", socket_path);
+    return;
+  }
+  memcpy (addr.sun_path, socket_path, strlen (socket_path) + 1);
+
+  fd = socket_connect (SOCK_DGRAM, &addr);
+  if ((fd == -1) && (errno == EPROTOTYPE))
+    fd = socket_connect (SOCK_STREAM, &addr);
+  if (fd == -1)
+  {
+    x_error (errno, "failed to notify `%s'", socket_path);
+    return;
+  }
+  len = snprintf (line, NOTIFY_BUFMAX,
+                  "copy status=%s bytes=%" PRIu64 " files=%zu errors=%zu "
+                  "seconds=%.3f\n",
+                  status_names[e->status], (uint64_t) e->bytes, e->files,
+                  e->errors, e->seconds);
+  if (send (fd, line, (size_t) len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+    x_error (errno, "failed to notify `%s'", socket_path);
+  close (fd);
+}
+
+void
+notify_set_sound (bool playing)
+{
+#ifdef ENABLE_SOUND
+  playing_sound = playing;
+#else
+  (void) playing;
+#endif
+}
+
+/* COMMAND is run by /bin/sh with COPY_STATUS (done, failed or
+   cancelled), COPY_BYTES, COPY_FILES, COPY_ERRORS and COPY_SECONDS set. */
+void
+notify_set_command (const char *cmd)
+{
+  command = cmd;
+}
+
+void
+notify_set_socket (const char *path)
+{
+  socket_path = path;
+}
+
+/* Tells everyone asked to be told that the copy ended, and returns right
+   away. */
+void
+notify_send (const struct notify_event *e)
+{
+#ifdef ENABLE_SOUND
+  if (playing_sound)
+    detach (sound_run, e);
+#endif
+  if (command)
+    detach (command_run, e);
+  if (socket_path)
+    socket_send (e);
+}
@@ -0,0 +1,47 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COPY_NOTIFY_H__
+#define __COPY_NOTIFY_H__
+
+#include "copy-utils.h"
+
+enum
+{
+  NOTIFY_DONE,
+  NOTIFY_FAILED,
+  NOTIFY_CANCELLED
+};
+
+struct notify_event
+{
+  int status;
+  byte_t bytes;
+  size_t files;
+  size_t errors;
+  double seconds;
+};
+
+void notify_set_sound (bool playing);
+void notify_set_command (const char *cmd);
+void notify_set_socket (const char *path);
+void notify_send (const struct notify_event *e);
+
+#endif /* __COPY_NOTIFY_H__ */
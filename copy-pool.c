@@ -0,0 +1,188 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include "copy-pool.h"
+#include "copy-utils.h"
+
+struct pool_task
+{
+  pool_task_func func;
+  void *arg;
+  struct pool_task *next;
+};
+
+struct pool
+{
+  size_t n_threads;
+  size_t max_queued;
+  size_t n_queued;
+  size_t n_active;
+  bool stopping;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t has_work;
+  pthread_cond_t has_room;
+  pthread_cond_t idle;
+  struct pool_task *head;
+  struct pool_task *tail;
+};
+
+static void *
+pool_worker (void *data)
+{
+  struct pool *p;
+  struct pool_task *t;
+
+  p = (struct pool *) data;
+  pthread_mutex_lock (&p->lock);
+  for (;;)
+  {
+    while (!p->head && !p->stopping)
+      pthread_cond_wait (&p->has_work, &p->lock);
+    if (!p->head)
+      break;
+    t = p->head;
+    p->head = t->next;
+    if (!p->head)
+      p->tail = NULL;
+    p->n_queued--;
+    p->n_active++;
+    pthread_cond_signal (&p->has_room);
+    pthread_mutex_unlock (&p->lock);
+
+    t->func (t->arg);
+    free (t);
+
+    pthread_mutex_lock (&p->lock);
+    p->n_active--;
+    if (!p->head && (p->n_active == 0))
+      pthread_cond_broadcast (&p->idle);
+  }
+  pthread_mutex_unlock (&p->lock);
+  return NULL;
+}
+
+/* A pool with no threads runs every task synchronously in pool_submit(),
+   and a MAX_QUEUED of zero means the queue is unbounded. Tasks that submit
+   further tasks to their own pool must only be used with an unbounded
+   queue, otherwise every worker may end up waiting for room. */
+struct pool *
+pool_new (size_t n_threads, size_t max_queued)
+{
+  int err;
+  size_t x;
+  struct pool *p;
+
+  p = malloc (sizeof (struct pool));
+  if (!p)
+    die (errno, "failed to allocate worker pool");
+  memset (p, 0, sizeof (struct pool));
+  p->n_threads = n_threads;
+  p->max_queued = max_queued;
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->has_work, NULL);
+  pthread_cond_init (&p->has_room, NULL);
+  pthread_cond_init (&p->idle, NULL);
+
+  if (n_threads == 0)
+    return p;
+
+  p->threads = malloc (n_threads * sizeof (pthread_t));
+  if (!p->threads)
+    die (errno, "failed to allocate worker pool");
+  for (x = 0; (x < n_threads); ++x)
+  {
+    err = pthread_create (&p->threads[x], NULL, pool_worker, p);
+    if (err != 0)
+      die (err, "failed to start worker thread");
+  }
+  return p;
+}
+
+void
+pool_submit (struct pool *p, pool_task_func func, void *arg)
+{
+  struct pool_task *t;
+
+  if (p->n_threads == 0)
+  {
+    func (arg);
+    return;
+  }
+
+  t = malloc (sizeof (struct pool_task));
+  if (!t)
+    die (errno, "failed to allocate worker task");
+  t->func = func;
+  t->arg = arg;
+  t->next = NULL;
+
+  pthread_mutex_lock (&p->lock);
+  while (p->max_queued && (p->n_queued >= p->max_queued))
+    pthread_cond_wait (&p->has_room, &p->lock);
+  if (p->tail)
+    p->tail->next = t;
+  else
+    p->head = t;
+  p->tail = t;
+  p->n_queued++;
+  pthread_cond_signal (&p->has_work);
+  pthread_mutex_unlock (&p->lock);
+}
+
+/* Block until the queue is empty and no task is running. */
+void
+pool_wait (struct pool *p)
+{
+  if (p->n_threads == 0)
+    return;
+  pthread_mutex_lock (&p->lock);
+  while (p->head || (p->n_active > 0))
+    pthread_cond_wait (&p->idle, &p->lock);
+  pthread_mutex_unlock (&p->lock);
+}
+
+void
+pool_free (struct pool *p)
+{
+  size_t x;
+
+  if (!p)
+    return;
+  pthread_mutex_lock (&p->lock);
+  p->stopping = true;
+  pthread_cond_broadcast (&p->has_work);
+  pthread_mutex_unlock (&p->lock);
+  for (x = 0; (x < p->n_threads); ++x)
+    pthread_join (p->threads[x], NULL);
+  free (p->threads);
+  pthread_mutex_destroy (&p->lock);
+  pthread_cond_destroy (&p->has_work);
+  pthread_cond_destroy (&p->has_room);
+  pthread_cond_destroy (&p->idle);
+  free (p);
+}
+
@@ -0,0 +1,35 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_POOL_H__
+#define __COPY_POOL_H__
+
+#include "copy-utils.h"
+
+typedef void (*pool_task_func) (void *arg);
+
+struct pool;
+
+struct pool *pool_new (size_t n_threads, size_t max_queued);
+void pool_submit (struct pool *p, pool_task_func func, void *arg);
+void pool_wait (struct pool *p);
+void pool_free (struct pool *p);
+
+#endif /* __COPY_POOL_H__ */
+
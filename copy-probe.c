@@ -0,0 +1,475 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy-control.h"
+#include "copy-engine.h"
+#include "copy-probe.h"
+#include "copy-utils.h"
+
+#define PROBE_CACHE_MAGIC   "copy-engines"
+#define PROBE_CACHE_VERSION 1
+#define PROBE_CACHE_NAME    "copy" DIR_SEPARATOR_S "engines"
+
+#define PROBE_FILE_SIZE   (32 * 1000 * 1000)
+#define PROBE_FILL_SIZE   (1000 * 1000)
+#define PROBE_SCRATCH     ".copy-probe-XXXXXX"
+#define PROBE_KEY_BUFMAX  64
+#define PROBE_LINE_BUFMAX 256
+
+/* filesystem id and type of a source and destination, and what to copy
+   between them with */
+struct probe_entry
+{
+  char src_key[PROBE_KEY_BUFMAX];
+  char dst_key[PROBE_KEY_BUFMAX];
+  int engine;
+  size_t buffer_size;
+};
+
+static const size_t probe_buffer_sizes[] =
+{
+  64 * 1000,
+  256 * 1000,
+  1000 * 1000,
+  4 * 1000 * 1000
+};
+
+#define N_PROBE_BUFFER_SIZES \
+  (sizeof (probe_buffer_sizes) / sizeof (probe_buffer_sizes[0]))
+
+static bool                cache_loaded = false;
+static size_t              n_cache      = 0;
+static struct probe_entry *cache        = NULL;
+
+/* The identity of the filesystem PATH is on, which survives reboots for
+   disks (the id is derived from the device) but not always for network
+   and memory filesystems. Those are simply probed again. */
+static bool
+filesystem_key (char *buffer, const char *path)
+{
+  unsigned int id[2];
+  struct statfs sfs;
+
+  if (statfs (path, &sfs) != 0)
+    return false;
+  memcpy (id, &sfs.f_fsid, sizeof (id));
+  snprintf (buffer, PROBE_KEY_BUFMAX, "%08x%08x:%lx",
+            id[0], id[1], (unsigned long) sfs.f_type);
+  return true;
+}
+
+static bool
+cache_path (char *buffer)
+{
+  const char *dir;
+
+  dir = getenv ("XDG_CACHE_HOME");
+  if (dir && *dir)
+  {
+    snprintf (buffer, PATH_BUFMAX, "%s" DIR_SEPARATOR_S PROBE_CACHE_NAME,
+              dir);
+    return true;
+  }
+  dir = getenv ("HOME");
+  if (dir && *dir)
+  {
+    snprintf (buffer, PATH_BUFMAX,
+              "%s" DIR_SEPARATOR_S ".cache" DIR_SEPARATOR_S PROBE_CACHE_NAME,
+              dir);
+    return true;
+  }
+  return false;
+}
+
+/*
+ * The cache is a small text file, one pair of filesystems per line:
+ *
+ *   copy-engines 1
+ *   SOURCE-KEY DESTINATION-KEY ENGINE BUFFER-SIZE
+ *
+ * A missing or unreadable cache is the same as an empty one.
+ */
+static void
+cache_load (void)
+{
+  int version;
+  char name[PROBE_KEY_BUFMAX];
+  char path[PATH_BUFMAX];
+  char line[PROBE_LINE_BUFMAX];
+  struct probe_entry e;
+  FILE *fp;
+
+  cache_loaded = true;
+  if (!cache_path (path))
+    return;
+  fp = fopen (path, "r");
+  if (!fp)
+    return;
+
+  version = 0;
+  if (!fgets (line, PROBE_LINE_BUFMAX, fp) ||
+      (sscanf (line, PROBE_CACHE_MAGIC " %d", &version) != 1) ||
+      (version != PROBE_CACHE_VERSION))
+  {
+    fclose (fp);
+    return;
+  }
+
+  while (fgets (line, PROBE_LINE_BUFMAX, fp))
+  {
+    memset (&e, 0, sizeof (struct probe_entry));
+    if ((sscanf (line, "%63s %63s %63s %zu", e.src_key, e.dst_key, name,
+                 &e.buffer_size) != 4) ||
+        (e.buffer_size == 0))
+      continue;
+    e.engine = engine_find (name);
+    if (e.engine == -1)
+      continue;
+    cache = realloc (cache, (n_cache + 1) * sizeof (struct probe_entry));
+    if (!cache)
+      die (errno, "failed to read engine cache `%s'", path);
+    cache[n_cache++] = e;
+  }
+  fclose (fp);
+}
+
+static struct probe_entry *
+cache_find (const char *src_key, const char *dst_key)
+{
+  size_t x;
+
+  for (x = 0; x < n_cache; ++x)
+    if (streq (cache[x].src_key, src_key, false) &&
+        streq (cache[x].dst_key, dst_key, false))
+      return &cache[x];
+  return NULL;
+}
+
+static bool
+cache_store (const struct probe_entry *e)
+{
+  size_t x;
+  size_t n_path;
+  char path[PATH_BUFMAX];
+  char dir[PATH_BUFMAX];
+  struct probe_entry *p;
+  FILE *fp;
+
+  if (!cache_loaded)
+    cache_load ();
+  p = cache_find (e->src_key, e->dst_key);
+  if (!p)
+  {
+    cache = realloc (cache, (n_cache + 1) * sizeof (struct probe_entry));
+    if (!cache)
+      die (errno, "failed to update engine cache");
+    p = &cache[n_cache++];
+  }
+  *p = *e;
+
+  if (!cache_path (path))
+  {
+    x_error (0, "no HOME or XDG_CACHE_HOME to keep the engine cache in");
+    return false;
+  }
+  dir_name (dir, path);
+  if (!make_path (dir))
+    return false;
+
+  n_path = strlen (path);
+  char tmp_path[n_path + 5];
+  memcpy (tmp_path, path, n_path);
+  memcpy (tmp_path + n_path, ".tmp", 5);
+
+  fp = x_fopen (tmp_path, "w");
+  if (!fp)
+    return false;
+  fprintf (fp, PROBE_CACHE_MAGIC " %d\n", PROBE_CACHE_VERSION);
+  for (x = 0; x < n_cache; ++x)
+    fprintf (fp, "%s %s %s %zu\n", cache[x].src_key, cache[x].dst_key,
+             engine_name (cache[x].engine), cache[x].buffer_size);
+  if (!x_fclose (fp, tmp_path))
+  {
+    unlink (tmp_path);
+    return false;
+  }
+  if (rename (tmp_path, path) != 0)
+  {
+    x_error (errno, "failed to write engine cache `%s'", path);
+    unlink (tmp_path);
+    return false;
+  }
+  return true;
+}
+
+/* Looks up the engine and buffer size the probe found fastest for copying
+   from where SRC_PATH is to where DST_PATH is. */
+bool
+probe_lookup (const char *src_path,
+              const char *dst_path,
+              int *engine,
+              size_t *buffer_size)
+{
+  char src_key[PROBE_KEY_BUFMAX];
+  char dst_key[PROBE_KEY_BUFMAX];
+  struct probe_entry *e;
+
+  if (!cache_loaded)
+    cache_load ();
+  if ((n_cache == 0) ||
+      !filesystem_key (src_key, src_path) ||
+      !filesystem_key (dst_key, dst_path))
+    return false;
+  e = cache_find (src_key, dst_key);
+  if (!e)
+    return false;
+  *engine = e->engine;
+  *buffer_size = e->buffer_size;
+  return true;
+}
+
+static bool
+probe_chunk (struct engine_transfer *t, size_t bytes)
+{
+  (void) t;
+  (void) bytes;
+  return !control_cancel_requested ();
+}
+
+static int
+scratch_file (char *buffer, const char *dir)
+{
+  int fd;
+  struct stat st;
+
+  if ((stat (dir, &st) == 0) && !S_ISDIR (st.st_mode))
+  {
+    x_error (ENOTDIR, "cannot probe with `%s'", dir);
+    return -1;
+  }
+
+  snprintf (buffer, PATH_BUFMAX, "%s" DIR_SEPARATOR_S PROBE_SCRATCH, dir);
+  fd = mkstemp (buffer);
+  if (fd == -1)
+    x_error (errno, "failed to create scratch file in `%s'", dir);
+  return fd;
+}
+
+/* Fills the source scratch file with data that no filesystem can compress
+   or deduplicate, and gets it to the disk. */
+static bool
+fill_scratch_file (int fd, const char *path)
+{
+  size_t x;
+  size_t n;
+  uint32_t state;
+  uint32_t *fill;
+
+  fill = malloc (PROBE_FILL_SIZE);
+  if (!fill)
+    die (errno, "failed to allocate probe data");
+  state = (uint32_t) time (NULL) | 1;
+  for (x = 0; x < (PROBE_FILL_SIZE / sizeof (uint32_t)); ++x)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    fill[x] = state;
+  }
+  for (n = 0; n < PROBE_FILE_SIZE; n += PROBE_FILL_SIZE)
+  {
+    fill[0] = (uint32_t) n;
+    if (write (fd, fill, PROBE_FILL_SIZE) != PROBE_FILL_SIZE)
+    {
+      x_error (errno, "failed to write scratch file `%s'", path);
+      free (fill);
+      return false;
+    }
+  }
+  free (fill);
+  if (fsync (fd) != 0)
+  {
+    x_error (errno, "failed to sync scratch file `%s'", path);
+    return false;
+  }
+  return true;
+}
+
+/* Copies the scratch file once, and returns how long it took (including
+   getting the copy to the disk) in seconds, or a negative number. */
+static double
+probe_trial (const char *src_path,
+             const char *dst_dir,
+             int engine,
+             char *buffer,
+             size_t buffer_size)
+{
+  bool ok;
+  struct timespec s;
+  struct timespec e;
+  struct engine_transfer t;
+  char dst_path[PATH_BUFMAX];
+
+  memset (&t, 0, sizeof (struct engine_transfer));
+  t.src_fd = open (src_path, O_RDONLY);
+  if (t.src_fd == -1)
+  {
+    x_error (errno, "failed to open scratch file `%s'", src_path);
+    return -1.0;
+  }
+  t.dst_fd = scratch_file (dst_path, dst_dir);
+  if (t.dst_fd == -1)
+  {
+    close (t.src_fd);
+    return -1.0;
+  }
+
+#ifdef HAVE_POSIX_FADVISE
+  /* every trial starts from the disk, not from what the last one read */
+  posix_fadvise (t.src_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  t.size = PROBE_FILE_SIZE;
+  t.buffer = buffer;
+  t.buffer_size = buffer_size;
+  t.chunk_func = probe_chunk;
+
+  clock_gettime (CLOCK_MONOTONIC, &s);
+  ok = engine_run (engine, &t) && (fsync (t.dst_fd) == 0);
+  clock_gettime (CLOCK_MONOTONIC, &e);
+  if (!ok && (t.failed_phase != -1))
+    x_error (t.failed_errno, "%s engine failed", engine_name (engine));
+
+  close (t.src_fd);
+  close (t.dst_fd);
+  unlink (dst_path);
+  if (!ok)
+    return -1.0;
+  return (double) (e.tv_sec - s.tv_sec) +
+         ((double) (e.tv_nsec - s.tv_nsec) / 1e9);
+}
+
+/* Times a copy from SRC_DIR to DST_DIR with every engine and buffer size,
+   and caches the fastest for that pair of filesystems. */
+bool
+probe_run (const char *src_dir, const char *dst_dir)
+{
+  int fd;
+  int engine;
+  size_t x;
+  double secs;
+  double best_secs;
+  char *buffer;
+  char src_path[PATH_BUFMAX];
+  char size_buf[SIZE_BUFMAX];
+  char rate_buf[SIZE_BUFMAX];
+  struct probe_entry best;
+
+  memset (&best, 0, sizeof (struct probe_entry));
+  if (!filesystem_key (best.src_key, src_dir))
+  {
+    x_error (errno, "failed to stat filesystem of `%s'", src_dir);
+    return false;
+  }
+  if (!filesystem_key (best.dst_key, dst_dir))
+  {
+    x_error (errno, "failed to stat filesystem of `%s'", dst_dir);
+    return false;
+  }
+
+  fd = scratch_file (src_path, src_dir);
+  if (fd == -1)
+    return false;
+  control_arm (true);
+  if (!fill_scratch_file (fd, src_path))
+  {
+    close (fd);
+    unlink (src_path);
+    control_arm (false);
+    return false;
+  }
+  close (fd);
+
+  buffer = malloc (probe_buffer_sizes[N_PROBE_BUFFER_SIZES - 1]);
+  if (!buffer)
+    die (errno, "failed to allocate probe buffer");
+
+  format_size (size_buf, PROBE_FILE_SIZE, true);
+  printf ("Probing `%s' -> `%s' with %s per trial\n",
+          src_dir, dst_dir, size_buf);
+  best_secs = -1.0;
+  for (engine = 0; engine < N_ENGINES; ++engine)
+  {
+    if (!engine_automatic (engine))
+      continue;
+    for (x = 0; x < N_PROBE_BUFFER_SIZES; ++x)
+    {
+      if (control_cancel_requested ())
+        break;
+      secs = probe_trial (src_path, dst_dir, engine, buffer,
+                          probe_buffer_sizes[x]);
+      format_size (size_buf, probe_buffer_sizes[x], false);
+      if (secs < 0.0)
+      {
+        printf ("  %-16s %8s      failed\n", engine_name (engine), size_buf);
+        continue;
+      }
+      if (secs <= 0.0)
+        secs = 1e-9;
+      format_size (rate_buf, (byte_t) (PROBE_FILE_SIZE / secs), false);
+      printf ("  %-16s %8s %10s/s\n", engine_name (engine), size_buf,
+              rate_buf);
+      fflush (stdout);
+      if ((best_secs < 0.0) || (secs < best_secs))
+      {
+        best_secs = secs;
+        best.engine = engine;
+        best.buffer_size = probe_buffer_sizes[x];
+      }
+    }
+  }
+  free (buffer);
+  unlink (src_path);
+  control_arm (false);
+
+  if (control_cancel_requested ())
+  {
+    printf ("Cancelled, nothing was cached\n");
+    return false;
+  }
+  if (best_secs < 0.0)
+  {
+    x_error (0, "every engine failed");
+    return false;
+  }
+  format_size (size_buf, best.buffer_size, false);
+  printf ("Fastest: %s with %s buffers\n", engine_name (best.engine),
+          size_buf);
+  return cache_store (&best);
+}
@@ -0,0 +1,31 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_PROBE_H__
+#define __COPY_PROBE_H__
+
+#include "copy-utils.h"
+
+bool probe_run (const char *src_dir, const char *dst_dir);
+bool probe_lookup (const char *src_path,
+                   const char *dst_path,
+                   int *engine,
+                   size_t *buffer_size);
+
+#endif /* __COPY_PROBE_H__ */
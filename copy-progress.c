@@ -17,14 +17,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "copy-progress.h"
 #include "copy-utils.h"
 
 #define PROGRESS_OUT_BUFMAX 1024
 
+/* most jobs that get a line of their own */
+#define PROGRESS_LINES_MAX 64
+
 #define PROGRESS_BAR_START     '['
 #define PROGRESS_BAR_SO_FAR    '='
 #define PROGRESS_BAR_HEAD      '>'
@@ -39,6 +48,18 @@ extern byte_t    so_far_bytes;
 extern byte_t     total_bytes;
 extern double update_interval;
 
+/* a job's line in the multi-line view */
+struct progress_line
+{
+  bool active;
+  const char *path;
+  byte_t so_far_bytes;
+  byte_t total_bytes;
+  struct timeval start_time;
+  /* what the line shows on the console right now */
+  char shown[PROGRESS_OUT_BUFMAX];
+};
+
 static struct
 {
   size_t src_item;
@@ -53,29 +74,86 @@ static struct
     int fill;
     long double factor;
   } bar;
+  size_t n_lines;
+  bool lines_shown;
+  struct progress_line lines[PROGRESS_LINES_MAX];
 } pdata;
 
+/* Each frame is put together here and goes out in a single write(). */
+static struct
+{
+  size_t n;
+  char data[PROGRESS_OUT_BUFMAX * (PROGRESS_LINES_MAX + 1)];
+} frame;
+
+/* progress is updated by every thread that copies files */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+frame_append (const char *s, size_t n)
+{
+  if (n > (sizeof (frame.data) - frame.n))
+    n = sizeof (frame.data) - frame.n;
+  memcpy (frame.data + frame.n, s, n);
+  frame.n += n;
+}
+
 static void
-progress_printf (int *remaining_space, const char *fmt, ...)
+frame_printf (int *remaining_space, const char *fmt, ...)
 {
+  int n;
+  size_t room;
   va_list args;
-  char buffer[PROGRESS_OUT_BUFMAX];
 
-  /* We need to write the formatted string to a buffer first
-     in order to obtain its length so it can be subtracted from
-     the remaining space of the console */
+  /* the formatted length is subtracted from the remaining space of the
+     console */
+  room = sizeof (frame.data) - frame.n;
   va_start (args, fmt);
-  vsnprintf (buffer, PROGRESS_OUT_BUFMAX, fmt, args);
+  n = vsnprintf (frame.data + frame.n, room, fmt, args);
   va_end (args);
-  fputs (buffer, stdout);
-  *remaining_space -= (int) strlen (buffer);
+  if (n < 0)
+    return;
+  if ((size_t) n >= room)
+    n = (int) room - 1;
+  frame.n += (size_t) n;
+  if (remaining_space)
+    *remaining_space -= n;
 }
 
 static void
-progress_putchar (int *remaining_space, char c)
+frame_fill (int *remaining_space, char c, int n)
 {
-  fputc (c, stdout);
-  (*remaining_space)--;
+  if (n <= 0)
+    return;
+  if ((size_t) n > (sizeof (frame.data) - frame.n))
+    n = (int) (sizeof (frame.data) - frame.n);
+  memset (frame.data + frame.n, c, (size_t) n);
+  frame.n += (size_t) n;
+  *remaining_space -= n;
+}
+
+static void
+frame_write (void)
+{
+  ssize_t n;
+  size_t done;
+
+  /* whatever was printed before goes out first */
+  fflush (stdout);
+  for (done = 0; done < frame.n; done += (size_t) n)
+  {
+    n = write (STDOUT_FILENO, frame.data + done, frame.n - done);
+    if (n <= 0)
+    {
+      if ((n == -1) && (errno == EINTR))
+      {
+        n = 0;
+        continue;
+      }
+      break;
+    }
+  }
+  frame.n = 0;
 }
 
 static long
@@ -112,6 +190,85 @@ progress_bar_set (int remaining_space, int space_after_bar)
   pdata.bar.fill = roundl (pdata.bar.factor * pdata.bar.size);
 }
 
+/* One job's line: how far it is into which file and at what rate, cut
+   to WIDTH by leaving out the start of the path. */
+static void
+progress_line_format (char *buffer, size_t x, int width)
+{
+  int n;
+  long m;
+  size_t room;
+  size_t n_path;
+  const char *path;
+  struct timeval now;
+  struct progress_line *l;
+  char so_far[SIZE_BUFMAX];
+  char total[SIZE_BUFMAX];
+  char rate[SIZE_BUFMAX];
+
+  l = &pdata.lines[x];
+  if (!l->active)
+  {
+    snprintf (buffer, PROGRESS_OUT_BUFMAX, "  %zu: idle", x + 1);
+    return;
+  }
+  x_gettimeofday (&now);
+  m = get_milliseconds (&l->start_time, &now);
+  format_size (so_far, l->so_far_bytes, false);
+  format_size (total, l->total_bytes, false);
+  format_size (rate, (m > 0) ? ((l->so_far_bytes * 1000) / (byte_t) m)
+                             : BYTE_C (0), false);
+  n = snprintf (buffer, PROGRESS_OUT_BUFMAX, "  %zu: %s/%s %s/s ",
+                x + 1, so_far, total, rate);
+  if ((n < 0) || ((n + 3) >= width))
+    return;
+  path = l->path;
+  n_path = strlen (path);
+  room = (size_t) (width - n);
+  if (n_path > room)
+  {
+    memcpy (buffer + n, "...", 3);
+    n += 3;
+    room -= 3;
+    path += n_path - room;
+    n_path = room;
+  }
+  memcpy (buffer + n, path, n_path);
+  buffer[n + n_path] = '\0';
+}
+
+/* Puts the lines of the jobs above the progress bar into the frame. Once
+   they are on the console the cursor is moved back up to them, and only
+   the lines that changed are written again. */
+static void
+progress_lines_show (int width)
+{
+  size_t x;
+  char line[PROGRESS_OUT_BUFMAX];
+
+  if (width > PROGRESS_OUT_BUFMAX)
+    width = PROGRESS_OUT_BUFMAX;
+  else if (width < 2)
+    width = 2;
+  if (pdata.lines_shown)
+    frame_printf (NULL, "\033[%zuA", pdata.n_lines);
+  for (x = 0; x < pdata.n_lines; ++x)
+  {
+    /* one column short of the width so no line ever wraps */
+    progress_line_format (line, x, width - 1);
+    line[width - 1] = '\0';
+    if (!pdata.lines_shown || !streq (line, pdata.lines[x].shown, false))
+    {
+      frame_append ("\r", 1);
+      frame_append (line, strlen (line));
+      frame_append ("\033[K", 3);
+      memcpy (pdata.lines[x].shown, line, strlen (line) + 1);
+    }
+    frame_append ("\n", 1);
+  }
+  pdata.lines_shown = true;
+}
+
 static void
 progress_show (void)
 {
@@ -127,9 +284,12 @@ progress_show (void)
    *       100% 1.0G/1.0G (item 3/4) [===============>] total: 3.0G/4.0G 75%
    *       50% 500.0M/1.0G (item 4/4) [=======>       ] total: 3.5G/4.0G 87%
    *   Each item will get its own line and progress bar.
+   *
+   *   With a line per job, those come first:
+   *         1: 12.0M/40.0M 85.3M/s src/dir/file
+   *         2: idle
    */
 
-  int x;
   int remaining_space;
   int space_after_bar;
   char current_so_far_percent[PERCENT_BUFMAX];
@@ -143,16 +303,18 @@ progress_show (void)
                   pdata.current_total_bytes);
   format_size (current_so_far_size, pdata.current_so_far_bytes, false);
   remaining_space = console_width ();
+  if (pdata.n_lines > 0)
+    progress_lines_show (remaining_space);
 
   if (total_sources > 1)
   {
-    progress_printf (&remaining_space,
-                     "%s %s/%s (item %zu/%zu) ",
-                     current_so_far_percent,
-                     current_so_far_size,
-                     pdata.current_total_size,
-                     pdata.src_item,
-                     total_sources);
+    frame_printf (&remaining_space,
+                  "%s %s/%s (item %zu/%zu) ",
+                  current_so_far_percent,
+                  current_so_far_size,
+                  pdata.current_total_size,
+                  pdata.src_item,
+                  total_sources);
     format_percent (all_total_percent, so_far_bytes, total_bytes);
     format_size (all_so_far_size, so_far_bytes, false);
     format_size (all_total_size, total_bytes, false);
@@ -163,36 +325,46 @@ progress_show (void)
   }
   else
   {
-    progress_printf (&remaining_space,
-                     "%s/%s ",
-                     current_so_far_size,
-                     pdata.current_total_size);
+    frame_printf (&remaining_space,
+                  "%s/%s ",
+                  current_so_far_size,
+                  pdata.current_total_size);
     space_after_bar = strlen (current_so_far_percent) + 2;
   }
 
   progress_bar_set (remaining_space, space_after_bar);
   if (pdata.bar.size)
   {
-    progress_putchar (&remaining_space, PROGRESS_BAR_START);
-    for (x = 0; (x < pdata.bar.fill); ++x)
-      progress_putchar (&remaining_space, PROGRESS_BAR_SO_FAR);
-    progress_putchar (&remaining_space, PROGRESS_BAR_HEAD);
-    for (; (x < pdata.bar.size); ++x)
-      progress_putchar (&remaining_space, PROGRESS_BAR_REMAINING);
-    progress_putchar (&remaining_space, PROGRESS_BAR_END);
+    frame_fill (&remaining_space, PROGRESS_BAR_START, 1);
+    frame_fill (&remaining_space, PROGRESS_BAR_SO_FAR, pdata.bar.fill);
+    frame_fill (&remaining_space, PROGRESS_BAR_HEAD, 1);
+    frame_fill (&remaining_space, PROGRESS_BAR_REMAINING,
+                pdata.bar.size - pdata.bar.fill);
+    frame_fill (&remaining_space, PROGRESS_BAR_END, 1);
   }
 
   if (total_sources > 1)
-    progress_printf (&remaining_space,
-                     " total: %s/%s %s",
-                     all_so_far_size,
-                     all_total_size,
-                     all_total_percent);
+    frame_printf (&remaining_space,
+                  " total: %s/%s %s",
+                  all_so_far_size,
+                  all_total_size,
+                  all_total_percent);
   else
-    progress_printf (&remaining_space, " %s", current_so_far_percent);
+    frame_printf (&remaining_space, " %s", current_so_far_percent);
 
-  fputc ('\r', stdout);
-  fflush (stdout);
+  frame_append ("\r", 1);
+}
+
+/* Gives each of N_LINES jobs a line of its own above the progress bar,
+   if the output is a console that can move the cursor back up. */
+void
+progress_set_lines (size_t n_lines)
+{
+  if (!isatty (STDOUT_FILENO))
+    return;
+  if (n_lines > PROGRESS_LINES_MAX)
+    n_lines = PROGRESS_LINES_MAX;
+  pdata.n_lines = n_lines;
 }
 
 void
@@ -209,19 +381,22 @@ progress_init (byte_t current_total_bytes, size_t src_item)
   pdata.bar.size = 0;
   pdata.bar.fill = 0;
   pdata.bar.factor = 0.0;
+  pdata.lines_shown = false;
 }
 
 void
 progress_finish (void)
 {
+  pthread_mutex_lock (&lock);
   progress_show ();
-  fputc ('\n', stdout);
-  fflush (stdout);
+  frame_append ("\n", 1);
+  frame_write ();
   *pdata.current_total_size = '\0';
+  pthread_mutex_unlock (&lock);
 }
 
-void
-progress_update (byte_t bytes)
+static void
+progress_add (byte_t bytes)
 {
   long m;
 
@@ -232,7 +407,75 @@ progress_update (byte_t bytes)
   if ((m == -1) || progress_interval_has_passed (m))
   {
     progress_show ();
+    frame_write ();
     progress_interval_update (m);
   }
 }
 
+void
+progress_update (byte_t bytes)
+{
+  pthread_mutex_lock (&lock);
+  progress_add (bytes);
+  pthread_mutex_unlock (&lock);
+}
+
+/* Takes back BYTES counted for a file whose copy is being done over. */
+void
+progress_rewind (byte_t bytes)
+{
+  pthread_mutex_lock (&lock);
+  pdata.current_so_far_bytes = (pdata.current_so_far_bytes > bytes)
+                               ? (pdata.current_so_far_bytes - bytes)
+                               : BYTE_C (0);
+  so_far_bytes = (so_far_bytes > bytes) ? (so_far_bytes - bytes)
+                                        : BYTE_C (0);
+  pthread_mutex_unlock (&lock);
+}
+
+/* Takes a free line for a job that starts copying PATH (which has to stay
+   around until progress_file_finish()). Returns the line, or -1 if there
+   is none to show it on. */
+int
+progress_file_start (const char *path, byte_t size)
+{
+  size_t x;
+  struct progress_line *l;
+
+  pthread_mutex_lock (&lock);
+  for (x = 0; x < pdata.n_lines; ++x)
+  {
+    l = &pdata.lines[x];
+    if (l->active)
+      continue;
+    l->active = true;
+    l->path = path;
+    l->so_far_bytes = BYTE_C (0);
+    l->total_bytes = size;
+    x_gettimeofday (&l->start_time);
+    pthread_mutex_unlock (&lock);
+    return (int) x;
+  }
+  pthread_mutex_unlock (&lock);
+  return -1;
+}
+
+void
+progress_file_update (int line, byte_t bytes)
+{
+  pthread_mutex_lock (&lock);
+  if (line != -1)
+    pdata.lines[line].so_far_bytes += bytes;
+  progress_add (bytes);
+  pthread_mutex_unlock (&lock);
+}
+
+void
+progress_file_finish (int line)
+{
+  if (line == -1)
+    return;
+  pthread_mutex_lock (&lock);
+  pdata.lines[line].active = false;
+  pthread_mutex_unlock (&lock);
+}
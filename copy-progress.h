@@ -25,9 +25,14 @@
 /* the default value */
 #define PROGRESS_UPDATE_INTERVAL 0.5
 
+void progress_set_lines (size_t n_lines);
 void progress_init (byte_t current_total_bytes, size_t src_item);
 void progress_finish (void);
 void progress_update (byte_t bytes);
+void progress_rewind (byte_t bytes);
+int progress_file_start (const char *path, byte_t size);
+void progress_file_update (int line, byte_t bytes);
+void progress_file_finish (int line);
 
 #endif /* __COPY_PROGRESS_H__ */
 
@@ -0,0 +1,199 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copy-publish.h"
+#include "copy-utils.h"
+
+/*
+ * A staged destination is swapped with the live one by a single
+ * renameat2 (RENAME_EXCHANGE), so a reader sees either the old tree or the
+ * new one, never a mix, and nobody waits on a lock for it. Right before
+ * the swap the staging tree is flushed by one syncfs () rather than an
+ * fsync () for every file. The exchange leaves the old tree under the
+ * staging name; it is renamed aside and removed by a detached process, so
+ * the copy does not wait for that either.
+ */
+
+static size_t n_old = 0;
+
+bool
+publish_staging_path (char *buffer, const char *live_path)
+{
+  char dir[PATH_BUFMAX];
+  char base[PATH_BUFMAX];
+
+  dir_name (dir, live_path);
+  base_name (base, live_path);
+  return snprintf (buffer, PATH_BUFMAX,
+                   "%s" DIR_SEPARATOR_S ".%s" PUBLISH_STAGING,
+                   dir, base) < PATH_BUFMAX;
+}
+
+/* Gives the live path that STAGING_PATH was staged for, or false if it is
+   not a staging path at all. */
+bool
+publish_live_path (char *buffer, const char *staging_path)
+{
+  size_t n;
+  size_t n_suffix;
+  char dir[PATH_BUFMAX];
+  char base[PATH_BUFMAX];
+
+  dir_name (dir, staging_path);
+  base_name (base, staging_path);
+  n = strlen (base);
+  n_suffix = strlen (PUBLISH_STAGING);
+  if ((base[0] != '.') || (n <= (n_suffix + 1)) ||
+      !streq (base + (n - n_suffix), PUBLISH_STAGING, false))
+    return false;
+  base[n - n_suffix] = '\0';
+  return snprintf (buffer, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                   dir, base + 1) < PATH_BUFMAX;
+}
+
+static void
+remove_detached (const char *path)
+{
+  int fd;
+  pid_t pid;
+
+  fflush (stdout);
+  fflush (stderr);
+  pid = fork ();
+  if (pid == -1)
+  {
+    x_error (errno, "failed to start removing `%s'", path);
+    return;
+  }
+  if (pid == 0)
+  {
+    if (fork () != 0)
+      _exit (0);
+    setsid ();
+    fd = open ("/dev/null", O_RDWR);
+    if (fd != -1)
+    {
+      dup2 (fd, STDIN_FILENO);
+      dup2 (fd, STDOUT_FILENO);
+      dup2 (fd, STDERR_FILENO);
+      if (fd > STDERR_FILENO)
+        close (fd);
+    }
+    execl ("/bin/rm", "rm", "-rf", "--", path, (char *) NULL);
+    _exit (127);
+  }
+  while ((waitpid (pid, NULL, 0) == -1) && (errno == EINTR))
+    ;
+}
+
+/* Moves the tree at PATH, which sits next to LIVE_PATH, out of the way
+   and has it removed in the background. */
+static bool
+discard (const char *path, const char *live_path)
+{
+  char dir[PATH_BUFMAX];
+  char base[PATH_BUFMAX];
+  char old[PATH_BUFMAX];
+
+  dir_name (dir, live_path);
+  base_name (base, live_path);
+  if (snprintf (old, PATH_BUFMAX,
+                "%s" DIR_SEPARATOR_S ".%s" PUBLISH_OLD ".%ld.%zu",
+                dir, base, (long) getpid (), n_old++) >= PATH_BUFMAX)
+  {
+    x_error (ENAMETOOLONG, "failed to remove `%s'", path);
+    return false;
+  }
+  if (rename (path, old) != 0)
+  {
+    x_error (errno, "failed to remove `%s'", path);
+    return false;
+  }
+  remove_detached (old);
+  return true;
+}
+
+/* Clears STAGING_PATH for a new copy. Whatever an earlier run left there
+   is not trusted and goes away in the background. */
+bool
+publish_prepare (const char *staging_path)
+{
+  struct stat st;
+  char live[PATH_BUFMAX];
+
+  if (lstat (staging_path, &st) != 0)
+  {
+    if (errno == ENOENT)
+      return true;
+    x_error (errno, "failed to stat `%s'", staging_path);
+    return false;
+  }
+  if (!publish_live_path (live, staging_path))
+    return false;
+  return discard (staging_path, live);
+}
+
+/* Makes the finished copy at STAGING_PATH visible as LIVE_PATH in one
+   step. */
+bool
+publish (const char *staging_path, const char *live_path)
+{
+  int fd;
+
+  fd = open (staging_path, O_RDONLY | O_NOFOLLOW);
+  if (fd == -1)
+  {
+    x_error (errno, "failed to open `%s'", staging_path);
+    return false;
+  }
+  if (syncfs (fd) != 0)
+  {
+    x_error (errno, "failed to sync `%s'", staging_path);
+    close (fd);
+    return false;
+  }
+  close (fd);
+
+  if (renameat2 (AT_FDCWD, staging_path, AT_FDCWD, live_path,
+                 RENAME_EXCHANGE) == 0)
+  {
+    sync_parent_directory (live_path);
+    discard (staging_path, live_path);
+    return true;
+  }
+  if ((errno != ENOENT) ||
+      (renameat2 (AT_FDCWD, staging_path, AT_FDCWD, live_path,
+                  RENAME_NOREPLACE) != 0))
+  {
+    x_error (errno, "failed to publish `%s'", live_path);
+    return false;
+  }
+  sync_parent_directory (live_path);
+  return true;
+}
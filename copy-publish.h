@@ -0,0 +1,36 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COPY_PUBLISH_H__
+#define __COPY_PUBLISH_H__
+
+#include "copy-utils.h"
+
+/* a destination is staged as ".NAME" PUBLISH_STAGING next to NAME, and the
+   tree it replaces waits for removal as ".NAME" PUBLISH_OLD ".PID.N" */
+#define PUBLISH_STAGING ".copy-staging"
+#define PUBLISH_OLD     ".copy-old"
+
+bool publish_staging_path (char *buffer, const char *live_path);
+bool publish_live_path (char *buffer, const char *staging_path);
+bool publish_prepare (const char *staging_path);
+bool publish (const char *staging_path, const char *live_path);
+
+#endif /* __COPY_PUBLISH_H__ */
@@ -0,0 +1,232 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include "copy-pool.h"
+#include "copy-scan.h"
+#include "copy-utils.h"
+#include "copy-vfs.h"
+
+/* entries of one directory stat'ed by a single task */
+#define SCAN_BATCH 64
+
+/*
+ * On a network filesystem every stat() is a round trip, so the scan keeps
+ * many of them in flight: reading a directory is one task, and stat'ing
+ * its entries is split into tasks of SCAN_BATCH entries each, all on one
+ * pool. A directory found by a batch is queued as a task of its own. With
+ * no threads the tasks run as they are submitted, which is the same depth
+ * first walk as a plain recursive scan.
+ */
+
+struct scan
+{
+  size_t n_root;
+  const struct scan_ops *ops;
+  struct pool *pool;
+  pthread_mutex_t lock;
+};
+
+struct scan_directory
+{
+  struct scan *s;
+  char *path;
+};
+
+struct scan_batch
+{
+  struct scan *s;
+  char *dir;
+  size_t n_names;
+  char *names[SCAN_BATCH];
+};
+
+static void scan_directory_task (void *arg);
+
+static char *
+scan_strdup (const char *s)
+{
+  char *p;
+
+  p = strdup (s);
+  if (!p)
+    die (errno, "failed to allocate scan");
+  return p;
+}
+
+static void
+scan_failed (struct scan *s, const char *path, int errnum)
+{
+  pthread_mutex_lock (&s->lock);
+  s->ops->failed (path, errnum);
+  pthread_mutex_unlock (&s->lock);
+}
+
+static void
+scan_submit_directory (struct scan *s, const char *path)
+{
+  struct scan_directory *d;
+
+  d = malloc (sizeof (struct scan_directory));
+  if (!d)
+    die (errno, "failed to allocate scan");
+  d->s = s;
+  d->path = scan_strdup (path);
+  pool_submit (s->pool, scan_directory_task, d);
+}
+
+static bool
+join (char *buffer, const char *dir, const char *name)
+{
+  return snprintf (buffer, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                   dir, name) < PATH_BUFMAX;
+}
+
+static void
+scan_batch_task (void *arg)
+{
+  size_t x;
+  struct stat st;
+  struct scan_batch *b;
+  char child[PATH_BUFMAX];
+
+  b = (struct scan_batch *) arg;
+  for (x = 0; x < b->n_names; ++x)
+  {
+    join (child, b->dir, b->names[x]);
+    memset (&st, 0, sizeof (struct stat));
+    if (vfs_stat (child, &st) == 0)
+    {
+      pthread_mutex_lock (&b->s->lock);
+      b->s->ops->found (child, b->s->n_root, &st, b->s->ops->data);
+      pthread_mutex_unlock (&b->s->lock);
+      if (S_ISDIR (st.st_mode))
+        scan_submit_directory (b->s, child);
+    }
+    else if (errno != ENOENT)
+    {
+      x_error (errno, "failed to stat `%s'", child);
+      scan_failed (b->s, child, errno);
+    }
+    free (b->names[x]);
+  }
+  free (b->dir);
+  free (b);
+}
+
+static struct scan_batch *
+scan_batch_new (struct scan *s, const char *dir)
+{
+  struct scan_batch *b;
+
+  b = malloc (sizeof (struct scan_batch));
+  if (!b)
+    die (errno, "failed to allocate scan");
+  b->s = s;
+  b->dir = scan_strdup (dir);
+  b->n_names = 0;
+  return b;
+}
+
+static void
+scan_directory_task (void *arg)
+{
+  bool err;
+  struct scan_directory *d;
+  struct scan_batch *b;
+  struct dirent *ep;
+  struct vfs_dir *dp;
+  char child[PATH_BUFMAX];
+
+  d = (struct scan_directory *) arg;
+  dp = vfs_opendir (d->path);
+  if (!dp)
+  {
+    scan_failed (d->s, d->path, errno);
+    free (d->path);
+    free (d);
+    return;
+  }
+
+  b = scan_batch_new (d->s, d->path);
+  for (;;)
+  {
+    ep = vfs_readdir (dp, &err, d->path);
+    if (!ep)
+    {
+      if (err)
+        scan_failed (d->s, d->path, errno);
+      break;
+    }
+    if (streq (ep->d_name, ".", false) || streq (ep->d_name, "..", false))
+      continue;
+    if (!join (child, d->path, ep->d_name))
+    {
+      x_error (ENAMETOOLONG, "path too long in `%s'", d->path);
+      scan_failed (d->s, d->path, ENAMETOOLONG);
+      continue;
+    }
+    if (d->s->ops->excluded (child, d->s->n_root, ep))
+      continue;
+    b->names[b->n_names++] = scan_strdup (ep->d_name);
+    if (b->n_names == SCAN_BATCH)
+    {
+      pool_submit (d->s->pool, scan_batch_task, b);
+      b = scan_batch_new (d->s, d->path);
+    }
+  }
+  vfs_closedir (dp, d->path);
+
+  if (b->n_names > 0)
+    pool_submit (d->s->pool, scan_batch_task, b);
+  else
+  {
+    free (b->dir);
+    free (b);
+  }
+  free (d->path);
+  free (d);
+}
+
+/* Walks everything below ROOT (whose first N_ROOT bytes are the path of
+   the source being scanned) with N_THREADS threads, or in the calling
+   thread if there are none. */
+void
+scan_tree (const char *root,
+           size_t n_root,
+           size_t n_threads,
+           const struct scan_ops *ops)
+{
+  struct scan s;
+
+  s.n_root = n_root;
+  s.ops = ops;
+  pthread_mutex_init (&s.lock, NULL);
+  s.pool = pool_new (n_threads, 0);
+  scan_submit_directory (&s, root);
+  pool_wait (s.pool);
+  pool_free (s.pool);
+  pthread_mutex_destroy (&s.lock);
+}
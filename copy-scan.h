@@ -0,0 +1,47 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_SCAN_H__
+#define __COPY_SCAN_H__
+
+#include "copy-utils.h"
+
+#define SCAN_THREADS 8
+
+struct scan_ops
+{
+  /* whether an entry is left out (and not entered) before it is stat'ed */
+  bool (*excluded) (const char *path, size_t n_root, struct dirent *ep);
+  /* every directory and file that was stat'ed, one call at a time */
+  void (*found) (const char *path,
+                 size_t n_root,
+                 const struct stat *st,
+                 void *data);
+  /* a directory that could not be read or an entry that could not be
+     stat'ed, also one call at a time */
+  void (*failed) (const char *path, int errnum);
+  void *data;
+};
+
+void scan_tree (const char *root,
+                size_t n_root,
+                size_t n_threads,
+                const struct scan_ops *ops);
+
+#endif /* __COPY_SCAN_H__ */
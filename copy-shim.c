@@ -0,0 +1,385 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An LD_PRELOAD library that makes local storage behave like a slow
+ * network filesystem, for benchmarking copy (or anything else) against
+ * NFS or SAN latencies on any Linux machine:
+ *
+ *   make shim
+ *   COPY_SHIM_LATENCY=2000 COPY_SHIM_READ_RATE=100M \
+ *     LD_PRELOAD=./copy-shim.so copy --engine=rw SOURCE DESTINATION
+ *
+ * Every open, stat, read, write and fsync is delayed by a latency, plus a
+ * random jitter, and reads and writes are held to a bandwidth that all
+ * threads share, the way they would share a network link. Latencies
+ * overlap between threads, bandwidth does not. Everything is set through
+ * the environment:
+ *
+ *   COPY_SHIM_LATENCY   microseconds added to every call (default 0)
+ *   COPY_SHIM_OPEN, COPY_SHIM_STAT, COPY_SHIM_READ, COPY_SHIM_WRITE,
+ *   COPY_SHIM_FSYNC     microseconds for just that call, instead
+ *   COPY_SHIM_JITTER    up to this many microseconds more, at random
+ *   COPY_SHIM_SEED      seed of the jitter (default 1)
+ *   COPY_SHIM_READ_RATE, COPY_SHIM_WRITE_RATE
+ *                       bytes per second, with an optional K, M or G
+ *                       suffix (powers of 1000); unlimited by default
+ *   COPY_SHIM_PATH      only paths starting with this, and descriptors
+ *                       opened from them, are slowed down
+ *
+ * Reads, writes and fsyncs are only slowed down on descriptors that were
+ * opened through the shim, so the terminal and pipes are left alone. Data
+ * moved by the kernel (copy_file_range, splice, io_uring) and by stdio or
+ * mmap never passes through here, so benchmarks should use --engine=rw.
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHIM_MAX_FD 65536
+
+enum
+{
+  SHIM_OPEN,
+  SHIM_STAT,
+  SHIM_READ,
+  SHIM_WRITE,
+  SHIM_FSYNC,
+  N_SHIM_CALLS
+};
+
+static const char *latency_names[N_SHIM_CALLS] =
+{
+  "COPY_SHIM_OPEN",
+  "COPY_SHIM_STAT",
+  "COPY_SHIM_READ",
+  "COPY_SHIM_WRITE",
+  "COPY_SHIM_FSYNC"
+};
+
+/* the shared "link" in one direction: when it is free again */
+struct shim_rate
+{
+  double bytes_per_second;
+  double free_at;
+};
+
+static pthread_once_t   once          = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  lock          = PTHREAD_MUTEX_INITIALIZER;
+static double           latency[N_SHIM_CALLS];
+static double           jitter        = 0.0;
+static unsigned int     seed          = 1;
+static const char *     path_prefix   = NULL;
+static size_t           n_path_prefix = 0;
+static struct shim_rate read_rate;
+static struct shim_rate write_rate;
+static unsigned char    slow_fds[SHIM_MAX_FD];
+
+static int (*real_open) (const char *, int, ...);
+static int (*real_openat) (int, const char *, int, ...);
+static int (*real_stat) (const char *, struct stat *);
+static int (*real_lstat) (const char *, struct stat *);
+static int (*real_fstatat) (int, const char *, struct stat *, int);
+static int (*real_close) (int);
+static ssize_t (*real_read) (int, void *, size_t);
+static ssize_t (*real_write) (int, const void *, size_t);
+static ssize_t (*real_pread) (int, void *, size_t, off_t);
+static ssize_t (*real_pwrite) (int, const void *, size_t, off_t);
+static int (*real_fsync) (int);
+static int (*real_fdatasync) (int);
+
+static double
+env_number (const char *name, double fallback)
+{
+  char *end;
+  double value;
+  const char *s;
+
+  s = getenv (name);
+  if (!s || !*s)
+    return fallback;
+  value = strtod (s, &end);
+  switch (*end)
+  {
+    case 'G':
+    case 'g':
+      value *= 1000.0;
+      /* fall through */
+    case 'M':
+    case 'm':
+      value *= 1000.0;
+      /* fall through */
+    case 'K':
+    case 'k':
+      value *= 1000.0;
+      break;
+    default:
+      break;
+  }
+  return (value > 0.0) ? value : fallback;
+}
+
+static void
+shim_init (void)
+{
+  int x;
+  double base;
+
+  real_open = dlsym (RTLD_NEXT, "open");
+  real_openat = dlsym (RTLD_NEXT, "openat");
+  real_stat = dlsym (RTLD_NEXT, "stat");
+  real_lstat = dlsym (RTLD_NEXT, "lstat");
+  real_fstatat = dlsym (RTLD_NEXT, "fstatat");
+  real_close = dlsym (RTLD_NEXT, "close");
+  real_read = dlsym (RTLD_NEXT, "read");
+  real_write = dlsym (RTLD_NEXT, "write");
+  real_pread = dlsym (RTLD_NEXT, "pread");
+  real_pwrite = dlsym (RTLD_NEXT, "pwrite");
+  real_fsync = dlsym (RTLD_NEXT, "fsync");
+  real_fdatasync = dlsym (RTLD_NEXT, "fdatasync");
+
+  base = env_number ("COPY_SHIM_LATENCY", 0.0);
+  for (x = 0; x < N_SHIM_CALLS; ++x)
+    latency[x] = env_number (latency_names[x], base) / 1e6;
+  jitter = env_number ("COPY_SHIM_JITTER", 0.0) / 1e6;
+  seed = (unsigned int) env_number ("COPY_SHIM_SEED", 1.0);
+  read_rate.bytes_per_second = env_number ("COPY_SHIM_READ_RATE", 0.0);
+  write_rate.bytes_per_second = env_number ("COPY_SHIM_WRITE_RATE", 0.0);
+  path_prefix = getenv ("COPY_SHIM_PATH");
+  if (path_prefix && !*path_prefix)
+    path_prefix = NULL;
+  n_path_prefix = path_prefix ? strlen (path_prefix) : 0;
+}
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ((double) ts.tv_nsec / 1e9);
+}
+
+static void
+sleep_until (double when)
+{
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) when;
+  ts.tv_nsec = (long) ((when - (double) ts.tv_sec) * 1e9);
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* Holds the calling thread for the latency of CALL plus jitter, and for
+   N bytes of RATE (if there is one) after whatever the other threads have
+   queued on it. */
+static void
+shim_delay (int call, struct shim_rate *rate, size_t n)
+{
+  int saved_errno;
+  double start;
+  double until;
+
+  saved_errno = errno;
+  start = now_seconds ();
+  pthread_mutex_lock (&lock);
+  until = start + latency[call];
+  if (jitter > 0.0)
+    until += jitter * ((double) rand_r (&seed) / RAND_MAX);
+  if (rate && (rate->bytes_per_second > 0.0) && (n > 0))
+  {
+    if (rate->free_at < start)
+      rate->free_at = start;
+    rate->free_at += (double) n / rate->bytes_per_second;
+    if (rate->free_at > until)
+      until = rate->free_at;
+  }
+  pthread_mutex_unlock (&lock);
+  if (until > start)
+    sleep_until (until);
+  errno = saved_errno;
+}
+
+static int
+slow_path (const char *path)
+{
+  return !path_prefix || (strncmp (path, path_prefix, n_path_prefix) == 0);
+}
+
+static int
+slow_fd (int fd)
+{
+  return (fd >= 0) && (fd < SHIM_MAX_FD) && slow_fds[fd];
+}
+
+static int
+shim_opened (int fd, const char *path)
+{
+  if ((fd >= 0) && (fd < SHIM_MAX_FD))
+    slow_fds[fd] = (unsigned char) slow_path (path);
+  return fd;
+}
+
+int
+open (const char *path, int flags, ...)
+{
+  mode_t mode;
+  va_list args;
+
+  pthread_once (&once, shim_init);
+  mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE))
+  {
+    va_start (args, flags);
+    mode = va_arg (args, mode_t);
+    va_end (args);
+  }
+  if (slow_path (path))
+    shim_delay (SHIM_OPEN, NULL, 0);
+  return shim_opened (real_open (path, flags, mode), path);
+}
+
+int
+openat (int dir_fd, const char *path, int flags, ...)
+{
+  mode_t mode;
+  va_list args;
+
+  pthread_once (&once, shim_init);
+  mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE))
+  {
+    va_start (args, flags);
+    mode = va_arg (args, mode_t);
+    va_end (args);
+  }
+  if (slow_path (path))
+    shim_delay (SHIM_OPEN, NULL, 0);
+  return shim_opened (real_openat (dir_fd, path, flags, mode), path);
+}
+
+int
+stat (const char *path, struct stat *st)
+{
+  pthread_once (&once, shim_init);
+  if (slow_path (path))
+    shim_delay (SHIM_STAT, NULL, 0);
+  return real_stat (path, st);
+}
+
+int
+lstat (const char *path, struct stat *st)
+{
+  pthread_once (&once, shim_init);
+  if (slow_path (path))
+    shim_delay (SHIM_STAT, NULL, 0);
+  return real_lstat (path, st);
+}
+
+int
+fstatat (int dir_fd, const char *path, struct stat *st, int flags)
+{
+  pthread_once (&once, shim_init);
+  if (slow_path (path))
+    shim_delay (SHIM_STAT, NULL, 0);
+  return real_fstatat (dir_fd, path, st, flags);
+}
+
+int
+close (int fd)
+{
+  pthread_once (&once, shim_init);
+  if ((fd >= 0) && (fd < SHIM_MAX_FD))
+    slow_fds[fd] = 0;
+  return real_close (fd);
+}
+
+ssize_t
+read (int fd, void *buffer, size_t n)
+{
+  ssize_t result;
+
+  pthread_once (&once, shim_init);
+  result = real_read (fd, buffer, n);
+  if (slow_fd (fd))
+    shim_delay (SHIM_READ, &read_rate, (result > 0) ? (size_t) result : 0);
+  return result;
+}
+
+ssize_t
+pread (int fd, void *buffer, size_t n, off_t offset)
+{
+  ssize_t result;
+
+  pthread_once (&once, shim_init);
+  result = real_pread (fd, buffer, n, offset);
+  if (slow_fd (fd))
+    shim_delay (SHIM_READ, &read_rate, (result > 0) ? (size_t) result : 0);
+  return result;
+}
+
+ssize_t
+write (int fd, const void *buffer, size_t n)
+{
+  pthread_once (&once, shim_init);
+  if (slow_fd (fd))
+    shim_delay (SHIM_WRITE, &write_rate, n);
+  return real_write (fd, buffer, n);
+}
+
+ssize_t
+pwrite (int fd, const void *buffer, size_t n, off_t offset)
+{
+  pthread_once (&once, shim_init);
+  if (slow_fd (fd))
+    shim_delay (SHIM_WRITE, &write_rate, n);
+  return real_pwrite (fd, buffer, n, offset);
+}
+
+int
+fsync (int fd)
+{
+  pthread_once (&once, shim_init);
+  if (slow_fd (fd))
+    shim_delay (SHIM_FSYNC, NULL, 0);
+  return real_fsync (fd);
+}
+
+int
+fdatasync (int fd)
+{
+  pthread_once (&once, shim_init);
+  if (slow_fd (fd))
+    shim_delay (SHIM_FSYNC, NULL, 0);
+  return real_fdatasync (fd);
+}
@@ -0,0 +1,336 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy-pool.h"
+#include "copy-skeleton.h"
+#include "copy-utils.h"
+#include "copy-vfs.h"
+
+/* directories of one level created by a single task */
+#define SKELETON_BATCH 64
+
+#define NO_PARENT ((size_t) -1)
+
+/*
+ * Every directory of a source is created before any of its files is
+ * copied, so the copy itself never has to create one and can write the
+ * files in any order. The directories are created one depth level at a
+ * time, each level split into tasks on a pool. A directory is made with
+ * mkdirat() on a descriptor of its parent that was opened when the parent
+ * was made, instead of resolving the whole path again. Only directories
+ * that have subdirectories keep a descriptor, and only until the level
+ * below them is done. When one cannot be opened (for running out of
+ * descriptors, say) its subdirectories are made by path.
+ */
+
+struct skeleton_dir
+{
+  char *path;
+  const char *name;
+  size_t depth;
+  size_t parent;
+  bool has_children;
+  bool failed;
+  int fd;
+};
+
+struct skeleton
+{
+  const char *root;
+  struct skeleton_dir *dirs;
+  const struct skeleton_ops *ops;
+  pthread_mutex_t lock;
+};
+
+struct skeleton_batch
+{
+  struct skeleton *k;
+  const size_t *index;
+  size_t n;
+};
+
+static void
+skeleton_failed (struct skeleton *k, struct skeleton_dir *d, int errnum)
+{
+  d->failed = true;
+  pthread_mutex_lock (&k->lock);
+  k->ops->failed (d->path, errnum, k->ops->data);
+  pthread_mutex_unlock (&k->lock);
+}
+
+/* Like make_path(), is fine with the directory being there already. */
+static bool
+skeleton_mkdirat (int parent_fd, const char *name)
+{
+  struct stat st;
+
+  if (mkdirat (parent_fd, name, S_IRWXU) == 0)
+    return true;
+  if ((errno != EEXIST) || (fstatat (parent_fd, name, &st, 0) != 0))
+    return false;
+  if (S_ISDIR (st.st_mode))
+    return true;
+  errno = ENOTDIR;
+  return false;
+}
+
+static void
+skeleton_make (struct skeleton *k, struct skeleton_dir *d)
+{
+  int n;
+  int parent_fd;
+  char path[PATH_BUFMAX];
+
+  parent_fd = -1;
+  if (d->parent != NO_PARENT)
+  {
+    /* whatever was below a directory that failed is not reported again */
+    if (k->dirs[d->parent].failed)
+    {
+      d->failed = true;
+      return;
+    }
+    parent_fd = k->dirs[d->parent].fd;
+  }
+
+  if (*d->path)
+    n = snprintf (path, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                  k->root, d->path);
+  else
+    n = snprintf (path, PATH_BUFMAX, "%s", k->root);
+  if (n >= PATH_BUFMAX)
+  {
+    x_error (ENAMETOOLONG, "failed to create directory `%s'", d->path);
+    skeleton_failed (k, d, ENAMETOOLONG);
+    return;
+  }
+
+  if (parent_fd != -1)
+  {
+    if (!skeleton_mkdirat (parent_fd, d->name))
+    {
+      x_error (errno, "failed to create directory `%s'", path);
+      skeleton_failed (k, d, errno);
+      return;
+    }
+    if (d->has_children)
+      d->fd = openat (parent_fd, d->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  else
+  {
+    if (!vfs_make_path (path))
+    {
+      skeleton_failed (k, d, errno);
+      return;
+    }
+    /* made up trees have no descriptors, so their children go by path */
+    if (d->has_children && vfs_native ())
+      d->fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+}
+
+static void
+skeleton_batch_task (void *arg)
+{
+  size_t x;
+  struct skeleton_batch *b;
+
+  b = (struct skeleton_batch *) arg;
+  for (x = 0; x < b->n; ++x)
+    skeleton_make (b->k, &b->k->dirs[b->index[x]]);
+  free (b);
+}
+
+static int
+skeleton_path_compare (const void *key, const void *member)
+{
+  return strcmp ((const char *) key,
+                 ((const struct skeleton_dir *) member)->path);
+}
+
+/* Fills in how the directories (sorted by path, like the manifest lists
+   them) hang together. */
+static void
+skeleton_link (struct skeleton_dir *dirs, size_t n_dirs)
+{
+  size_t x;
+  size_t n;
+  char *slash;
+  const char *p;
+  struct skeleton_dir *parent;
+  char parent_path[PATH_BUFMAX];
+
+  for (x = 0; x < n_dirs; ++x)
+  {
+    dirs[x].depth = 0;
+    for (p = dirs[x].path; *dirs[x].path && p; p = strchr (p + 1, '/'))
+      dirs[x].depth++;
+    slash = strrchr (dirs[x].path, '/');
+    dirs[x].name = slash ? (slash + 1) : dirs[x].path;
+    dirs[x].parent = NO_PARENT;
+    if (!*dirs[x].path)
+      continue;
+    n = slash ? (size_t) (slash - dirs[x].path) : 0;
+    memcpy (parent_path, dirs[x].path, n);
+    parent_path[n] = '\0';
+    parent = bsearch (parent_path, dirs, n_dirs,
+                      sizeof (struct skeleton_dir), skeleton_path_compare);
+    if (parent)
+    {
+      dirs[x].parent = (size_t) (parent - dirs);
+      parent->has_children = true;
+    }
+  }
+}
+
+static size_t
+skeleton_collect (const struct manifest *m,
+                  const struct manifest_source *s,
+                  struct skeleton_dir **dirs)
+{
+  size_t x;
+  size_t n_dirs;
+  size_t n_alloc;
+  struct manifest_cursor c;
+  struct manifest_entry e;
+
+  *dirs = NULL;
+  n_dirs = 0;
+  n_alloc = 0;
+  if (!manifest_seek (m, &c, s->first_record))
+    die (0, "damaged manifest");
+  for (x = 0; x < s->n_records; ++x)
+  {
+    if (!manifest_next (&c, &e))
+      die (0, "damaged manifest");
+    if (!S_ISDIR ((mode_t) e.mode))
+      continue;
+    if (n_dirs == n_alloc)
+    {
+      n_alloc = n_alloc ? (n_alloc * 2) : 64;
+      *dirs = realloc (*dirs, n_alloc * sizeof (struct skeleton_dir));
+      if (!*dirs)
+        die (errno, "failed to allocate directory list");
+    }
+    memset (&(*dirs)[n_dirs], 0, sizeof (struct skeleton_dir));
+    (*dirs)[n_dirs].path = strdup (e.path);
+    if (!(*dirs)[n_dirs].path)
+      die (errno, "failed to allocate directory list");
+    (*dirs)[n_dirs].fd = -1;
+    n_dirs++;
+  }
+  return n_dirs;
+}
+
+/* Creates every directory the manifest M lists for source S below its
+   destination with N_THREADS threads, or in the calling thread if there
+   are none. Returns false if the destination itself could not be
+   created. */
+bool
+skeleton_create (const struct manifest *m,
+                 const struct manifest_source *s,
+                 size_t n_threads,
+                 const struct skeleton_ops *ops)
+{
+  bool ok;
+  size_t x;
+  size_t n;
+  size_t depth;
+  size_t n_dirs;
+  size_t max_depth;
+  size_t *order;
+  size_t *level;
+  struct skeleton k;
+  struct skeleton_batch *b;
+  struct pool *pool;
+
+  n_dirs = skeleton_collect (m, s, &k.dirs);
+  if (n_dirs == 0)
+    return true;
+  skeleton_link (k.dirs, n_dirs);
+
+  /* the directories ordered by depth, LEVEL[d] being where depth d starts */
+  max_depth = 0;
+  for (x = 0; x < n_dirs; ++x)
+    if (k.dirs[x].depth > max_depth)
+      max_depth = k.dirs[x].depth;
+  order = malloc (n_dirs * sizeof (size_t));
+  level = calloc (max_depth + 2, sizeof (size_t));
+  if (!order || !level)
+    die (errno, "failed to allocate directory list");
+  for (x = 0; x < n_dirs; ++x)
+    level[k.dirs[x].depth + 1]++;
+  for (depth = 1; depth <= max_depth + 1; ++depth)
+    level[depth] += level[depth - 1];
+  for (x = 0; x < n_dirs; ++x)
+    order[level[k.dirs[x].depth]++] = x;
+  for (depth = max_depth + 1; depth > 0; --depth)
+    level[depth] = level[depth - 1];
+  level[0] = 0;
+
+  k.root = s->dst_path;
+  k.ops = ops;
+  pthread_mutex_init (&k.lock, NULL);
+  pool = pool_new (n_threads, 0);
+  for (depth = 0; depth <= max_depth; ++depth)
+  {
+    for (x = level[depth]; x < level[depth + 1]; x += n)
+    {
+      n = level[depth + 1] - x;
+      if (n > SKELETON_BATCH)
+        n = SKELETON_BATCH;
+      b = malloc (sizeof (struct skeleton_batch));
+      if (!b)
+        die (errno, "failed to allocate directory list");
+      b->k = &k;
+      b->index = order + x;
+      b->n = n;
+      pool_submit (pool, skeleton_batch_task, b);
+    }
+    pool_wait (pool);
+    if (depth == 0)
+      continue;
+    for (x = level[depth - 1]; x < level[depth]; ++x)
+      if (k.dirs[order[x]].fd != -1)
+        close (k.dirs[order[x]].fd);
+  }
+  pool_free (pool);
+  pthread_mutex_destroy (&k.lock);
+
+  ok = !(!*k.dirs[0].path && k.dirs[0].failed);
+  for (x = 0; x < n_dirs; ++x)
+  {
+    if ((k.dirs[x].depth == max_depth) && (k.dirs[x].fd != -1))
+      close (k.dirs[x].fd);
+    free (k.dirs[x].path);
+  }
+  free (k.dirs);
+  free (order);
+  free (level);
+  return ok;
+}
@@ -0,0 +1,39 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_SKELETON_H__
+#define __COPY_SKELETON_H__
+
+#include "copy-manifest.h"
+#include "copy-utils.h"
+
+struct skeleton_ops
+{
+  /* a directory that could not be created, by its path relative to the
+     source (empty for the source itself), one call at a time */
+  void (*failed) (const char *path, int errnum, void *data);
+  void *data;
+};
+
+bool skeleton_create (const struct manifest *m,
+                      const struct manifest_source *s,
+                      size_t n_threads,
+                      const struct skeleton_ops *ops);
+
+#endif /* __COPY_SKELETON_H__ */
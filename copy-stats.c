@@ -0,0 +1,186 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <string.h>
+#include <sys/resource.h>
+
+#include "copy-stats.h"
+#include "copy-utils.h"
+
+/*
+ * What the copy cost the host between stats_start() and stats_show():
+ * CPU time, context switches and page faults from getrusage(), the bytes
+ * that went through read() and write() against those that actually hit
+ * storage from /proc/self/io (the difference being the page cache), and
+ * how much the page cache and its dirty pages grew from /proc/meminfo.
+ * The /proc parts are left out where there is no /proc.
+ */
+
+enum
+{
+  IO_RCHAR,
+  IO_WCHAR,
+  IO_READ_BYTES,
+  IO_WRITE_BYTES,
+  N_IO
+};
+
+enum
+{
+  MEM_CACHED,
+  MEM_DIRTY,
+  MEM_WRITEBACK,
+  N_MEM
+};
+
+static const char *io_keys[N_IO] =
+{
+  "rchar",
+  "wchar",
+  "read_bytes",
+  "write_bytes"
+};
+
+static const char *mem_keys[N_MEM] =
+{
+  "Cached",
+  "Dirty",
+  "Writeback"
+};
+
+static struct
+{
+  struct rusage usage;
+  bool have_io;
+  byte_t io[N_IO];
+  bool have_mem;
+  byte_t mem[N_MEM];
+} start;
+
+/* Reads the "KEY: VALUE" lines of a /proc file into VALUES, in units of
+   FACTOR bytes. False unless every key was there. */
+static bool
+proc_read (const char *path,
+           const char **keys,
+           size_t n_keys,
+           byte_t factor,
+           byte_t *values)
+{
+  size_t x;
+  size_t found;
+  size_t n_key;
+  unsigned long long value;
+  FILE *fp;
+  char line[256];
+
+  fp = fopen (path, "r");
+  if (!fp)
+    return false;
+  found = 0;
+  while (fgets (line, sizeof (line), fp))
+  {
+    for (x = 0; x < n_keys; ++x)
+    {
+      n_key = strlen (keys[x]);
+      if ((strncmp (line, keys[x], n_key) == 0) && (line[n_key] == ':') &&
+          (sscanf (line + n_key + 1, "%llu", &value) == 1))
+      {
+        values[x] = (byte_t) value * factor;
+        found++;
+        break;
+      }
+    }
+  }
+  fclose (fp);
+  return found == n_keys;
+}
+
+void
+stats_start (void)
+{
+  getrusage (RUSAGE_SELF, &start.usage);
+  start.have_io = proc_read ("/proc/self/io", io_keys, N_IO, 1, start.io);
+  start.have_mem = proc_read ("/proc/meminfo", mem_keys, N_MEM, 1024,
+                              start.mem);
+}
+
+static double
+cpu_seconds (const struct timeval *end, const struct timeval *begin)
+{
+  return ((double) (end->tv_sec - begin->tv_sec)) +
+         (((double) (end->tv_usec - begin->tv_usec)) / 1000000.0);
+}
+
+/* A size that may have shrunk, with its sign. */
+static void
+format_change (char *buffer, byte_t before, byte_t after)
+{
+  buffer[0] = (after < before) ? '-' : '+';
+  format_size (buffer + 1,
+               (after < before) ? (before - after) : (after - before),
+               false);
+}
+
+void
+stats_show (void)
+{
+  int x;
+  struct rusage usage;
+  byte_t io[N_IO];
+  byte_t mem[N_MEM];
+  char size[N_IO][SIZE_BUFMAX];
+  char change[N_MEM][SIZE_BUFMAX + 1];
+
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("CPU: %.2f seconds user, %.2f seconds system\n",
+          cpu_seconds (&usage.ru_utime, &start.usage.ru_utime),
+          cpu_seconds (&usage.ru_stime, &start.usage.ru_stime));
+  printf ("Context switches: %ld voluntary, %ld involuntary\n",
+          usage.ru_nvcsw - start.usage.ru_nvcsw,
+          usage.ru_nivcsw - start.usage.ru_nivcsw);
+  printf ("Page faults: %ld major, %ld minor\n",
+          usage.ru_majflt - start.usage.ru_majflt,
+          usage.ru_minflt - start.usage.ru_minflt);
+  /* ru_maxrss is in kilobytes */
+  format_size (size[0], (byte_t) usage.ru_maxrss * 1024, true);
+  printf ("Peak memory: %s\n", size[0]);
+
+  if (start.have_io && proc_read ("/proc/self/io", io_keys, N_IO, 1, io))
+  {
+    for (x = 0; x < N_IO; ++x)
+      format_size (size[x], io[x] - start.io[x], true);
+    printf ("Read %s (%s of it from storage)\n",
+            size[IO_RCHAR], size[IO_READ_BYTES]);
+    printf ("Wrote %s (%s of it to storage so far)\n",
+            size[IO_WCHAR], size[IO_WRITE_BYTES]);
+  }
+
+  if (start.have_mem &&
+      proc_read ("/proc/meminfo", mem_keys, N_MEM, 1024, mem))
+  {
+    for (x = 0; x < N_MEM; ++x)
+      format_change (change[x], start.mem[x], mem[x]);
+    printf ("Page cache: %s cached, %s dirty, %s under writeback\n",
+            change[MEM_CACHED], change[MEM_DIRTY], change[MEM_WRITEBACK]);
+  }
+}
@@ -0,0 +1,484 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
+#include "copy-uring.h"
+#include "copy-utils.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * Every small file is copied by one chain of linked requests, each step
+ * only starting once the one before it succeeded:
+ *
+ *   openat source -> statx source -> openat destination -> read ->
+ *   statx source -> write -> close -> close
+ *
+ * The two descriptors are opened straight into slots of the ring's fixed
+ * file table (which is what lets the read and write of the same chain use
+ * them), two slots per file. A whole batch of chains goes to the kernel
+ * with one io_uring_enter() that also waits for all of them, instead of
+ * the six or more system calls per file of the regular path.
+ *
+ * A chain that fails anywhere (or reads less than the size the scan saw)
+ * is left for the regular path to copy again, which also reports the error
+ * properly. So is one whose first statx finds another size than the scan
+ * did, or whose second statx finds the source changed since the first.
+ * statx has no fixed file form, so both look the source up by its path.
+ * Sources are opened with O_NOATIME until one refuses it with EPERM, after
+ * which the ring opens them without it, counted the way open_source()
+ * counts its own. A kernel without direct descriptors (before 5.15) rejects the
+ * first openat with EINVAL, after which the ring is not used anymore.
+ */
+
+enum
+{
+  STEP_OPEN_SRC,
+  STEP_STAT_BEFORE,
+  STEP_OPEN_DST,
+  STEP_READ,
+  STEP_STAT_AFTER,
+  STEP_WRITE,
+  STEP_CLOSE_SRC,
+  STEP_CLOSE_DST,
+  N_STEPS
+};
+
+#define URING_ENTRIES (URING_FILES * N_STEPS)
+#define URING_SLOTS   (URING_FILES * 2)
+
+/* a step that has not completed (yet) */
+#define STEP_PENDING 1
+
+struct uring
+{
+  int fd;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t n_sq_map;
+  void *cq_map;
+  size_t n_cq_map;
+  size_t n_sqes_map;
+  char *buffers;
+  /* loses O_NOATIME once a source refuses it */
+  int src_flags;
+  unsigned int tail;
+  int results[URING_FILES][N_STEPS];
+  struct statx before[URING_FILES];
+  struct statx after[URING_FILES];
+};
+
+static int
+uring_setup (unsigned int entries, struct io_uring_params *p)
+{
+  return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter (int fd, unsigned int to_submit, unsigned int min_complete)
+{
+  return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int
+uring_register (int fd, unsigned int op, void *arg, unsigned int n)
+{
+  return (int) syscall (__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* Sets up a ring, or returns NULL if the kernel has no (usable) io_uring,
+   in which case everything goes through the regular path. */
+struct uring *
+uring_new (void)
+{
+  int x;
+  int fds[URING_SLOTS];
+  struct io_uring_params p;
+  struct uring *u;
+  char *sq;
+  char *cq;
+
+  u = calloc (1, sizeof (struct uring));
+  if (!u)
+    die (errno, "failed to allocate io_uring");
+  memset (&p, 0, sizeof (struct io_uring_params));
+  u->fd = uring_setup (URING_ENTRIES, &p);
+  if (u->fd < 0)
+  {
+    free (u);
+    return NULL;
+  }
+
+  u->n_sq_map = p.sq_off.array + (p.sq_entries * sizeof (unsigned int));
+  u->n_cq_map = p.cq_off.cqes + (p.cq_entries * sizeof (struct io_uring_cqe));
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (u->n_cq_map > u->n_sq_map)
+      u->n_sq_map = u->n_cq_map;
+    u->n_cq_map = 0;
+  }
+  u->n_sqes_map = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  u->sq_map = mmap (NULL, u->n_sq_map, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_map == MAP_FAILED)
+    goto fail_sq;
+  u->cq_map = u->sq_map;
+  if (u->n_cq_map)
+  {
+    u->cq_map = mmap (NULL, u->n_cq_map, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_map == MAP_FAILED)
+      goto fail_cq;
+  }
+  u->sqes = mmap (NULL, u->n_sqes_map, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  sq = (char *) u->sq_map;
+  cq = (char *) u->cq_map;
+  u->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *) (sq + p.sq_off.array);
+  u->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  u->tail = *u->sq_tail;
+  u->src_flags = O_RDONLY | O_NOATIME;
+
+  /* an empty fixed file table for the chains to open into */
+  for (x = 0; x < URING_SLOTS; ++x)
+    fds[x] = -1;
+  if (uring_register (u->fd, IORING_REGISTER_FILES, fds, URING_SLOTS) != 0)
+    goto fail_register;
+
+  u->buffers = malloc ((size_t) URING_FILES * URING_MAX_FILE);
+  if (!u->buffers)
+    die (errno, "failed to allocate io_uring buffers");
+  return u;
+
+fail_register:
+  munmap (u->sqes, u->n_sqes_map);
+fail_sqes:
+  if (u->n_cq_map)
+    munmap (u->cq_map, u->n_cq_map);
+fail_cq:
+  munmap (u->sq_map, u->n_sq_map);
+fail_sq:
+  close (u->fd);
+  free (u);
+  return NULL;
+}
+
+static struct io_uring_sqe *
+uring_sqe (struct uring *u, uint64_t user_data, uint8_t opcode)
+{
+  unsigned int index;
+  struct io_uring_sqe *sqe;
+
+  index = u->tail & u->sq_mask;
+  sqe = &u->sqes[index];
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+  u->sq_array[index] = index;
+  u->tail++;
+  return sqe;
+}
+
+/* Hands the N requests queued since the last call to the kernel and waits
+   until they have all completed. */
+static bool
+uring_submit_and_wait (struct uring *u, unsigned int n)
+{
+  int r;
+  unsigned int head;
+  unsigned int submitted;
+  unsigned int completed;
+  struct io_uring_cqe *cqe;
+
+  __atomic_store_n (u->sq_tail, u->tail, __ATOMIC_RELEASE);
+  submitted = 0;
+  completed = 0;
+  while (completed < n)
+  {
+    r = uring_enter (u->fd, n - submitted, 1);
+    if (r < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    submitted += (unsigned int) r;
+
+    head = *u->cq_head;
+    while (head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      cqe = &u->cqes[head & u->cq_mask];
+      u->results[cqe->user_data / N_STEPS][cqe->user_data % N_STEPS] =
+        cqe->res;
+      head++;
+      completed++;
+    }
+    __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+static void
+uring_queue_statx (struct uring *u,
+                   size_t file,
+                   int step,
+                   const char *path,
+                   struct statx *stx)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe (u, (file * N_STEPS) + step, IORING_OP_STATX);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) (uintptr_t) path;
+  sqe->addr2 = (uint64_t) (uintptr_t) stx;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->flags = IOSQE_IO_LINK;
+}
+
+static bool
+same_statx (const struct statx *a, const struct statx *b)
+{
+  return (a->stx_size == b->stx_size) &&
+         (a->stx_mtime.tv_sec == b->stx_mtime.tv_sec) &&
+         (a->stx_mtime.tv_nsec == b->stx_mtime.tv_nsec) &&
+         (a->stx_ctime.tv_sec == b->stx_ctime.tv_sec) &&
+         (a->stx_ctime.tv_nsec == b->stx_ctime.tv_nsec);
+}
+
+static void
+statx_to_stat (struct stat *st, const struct statx *stx)
+{
+  memset (st, 0, sizeof (struct stat));
+  st->st_mode = stx->stx_mode;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_size = (off_t) stx->stx_size;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void
+uring_queue_close (struct uring *u, size_t file, int step, unsigned int slot)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_sqe (u, (file * N_STEPS) + step, IORING_OP_CLOSE);
+  sqe->file_index = slot + 1;
+}
+
+/* Copies the N (at most URING_FILES) files, setting the result of each.
+   Returns false if the ring cannot do this at all, with every file left
+   for the regular path. */
+bool
+uring_copy (struct uring *u, struct uring_file *files, size_t n)
+{
+  int step;
+  int err;
+  int src_flags;
+  bool unsupported;
+  size_t x;
+  unsigned int n_cleanup;
+  char *buffer;
+  struct io_uring_sqe *sqe;
+
+  src_flags = u->src_flags;
+  for (x = 0; x < n; ++x)
+  {
+    for (step = 0; step < N_STEPS; ++step)
+      u->results[x][step] = STEP_PENDING;
+    buffer = u->buffers + (x * URING_MAX_FILE);
+
+    sqe = uring_sqe (u, (x * N_STEPS) + STEP_OPEN_SRC, IORING_OP_OPENAT);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) files[x].src_path;
+    sqe->open_flags = (uint32_t) u->src_flags;
+    sqe->file_index = (2 * x) + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    uring_queue_statx (u, x, STEP_STAT_BEFORE, files[x].src_path,
+                       &u->before[x]);
+
+    sqe = uring_sqe (u, (x * N_STEPS) + STEP_OPEN_DST, IORING_OP_OPENAT);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) files[x].dst_path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = (2 * x) + 2;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_sqe (u, (x * N_STEPS) + STEP_READ, IORING_OP_READ);
+    sqe->fd = (int) (2 * x);
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = (uint32_t) files[x].size;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    uring_queue_statx (u, x, STEP_STAT_AFTER, files[x].src_path,
+                       &u->after[x]);
+
+    sqe = uring_sqe (u, (x * N_STEPS) + STEP_WRITE, IORING_OP_WRITE);
+    sqe->fd = (int) ((2 * x) + 1);
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = (uint32_t) files[x].size;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    uring_queue_close (u, x, STEP_CLOSE_SRC, (unsigned int) (2 * x));
+    u->sqes[(u->tail - 1) & u->sq_mask].flags = IOSQE_IO_LINK;
+    uring_queue_close (u, x, STEP_CLOSE_DST, (unsigned int) ((2 * x) + 1));
+  }
+  if (!uring_submit_and_wait (u, (unsigned int) (n * N_STEPS)))
+  {
+    for (x = 0; x < n; ++x)
+      files[x].result = EIO;
+    return false;
+  }
+
+  unsupported = false;
+  n_cleanup = 0;
+  for (x = 0; x < n; ++x)
+  {
+    files[x].result = 0;
+    files[x].changed = false;
+    for (step = 0; step < N_STEPS; ++step)
+    {
+      err = u->results[x][step];
+      if ((step == STEP_READ) || (step == STEP_WRITE))
+      {
+        /* a short read means the file changed since the scan */
+        if ((err >= 0) && ((size_t) err != files[x].size))
+          err = -EAGAIN;
+      }
+      if (err < 0)
+      {
+        if ((step == STEP_OPEN_SRC) && (err == -EINVAL))
+          unsupported = true;
+        /* only the owner of a file may open it with O_NOATIME; this one
+           fails over to transfer_file(), and the ring stops asking */
+        if ((step == STEP_OPEN_SRC) && (err == -EPERM))
+          u->src_flags &= ~O_NOATIME;
+        files[x].result = (err == -ECANCELED) ? EIO : -err;
+        break;
+      }
+    }
+    if ((u->results[x][STEP_OPEN_SRC] >= 0) && !(src_flags & O_NOATIME))
+      count_atime_open ();
+    if (files[x].result == 0)
+    {
+      /* the scan may be older than the source the chain found */
+      if (u->before[x].stx_size != files[x].size)
+        files[x].result = EAGAIN;
+      else if (!same_statx (&u->before[x], &u->after[x]))
+      {
+        files[x].result = EAGAIN;
+        files[x].changed = true;
+      }
+      else
+        statx_to_stat (&files[x].st, &u->before[x]);
+    }
+    /* the closes of a broken chain were cancelled along with it */
+    if ((u->results[x][STEP_OPEN_SRC] >= 0) &&
+        (u->results[x][STEP_CLOSE_SRC] != 0))
+    {
+      uring_queue_close (u, x, STEP_CLOSE_SRC, (unsigned int) (2 * x));
+      n_cleanup++;
+    }
+    if ((u->results[x][STEP_OPEN_DST] >= 0) &&
+        (u->results[x][STEP_CLOSE_DST] != 0))
+    {
+      uring_queue_close (u, x, STEP_CLOSE_DST,
+                         (unsigned int) ((2 * x) + 1));
+      n_cleanup++;
+    }
+  }
+  if (n_cleanup > 0)
+    uring_submit_and_wait (u, n_cleanup);
+  return !unsupported;
+}
+
+void
+uring_free (struct uring *u)
+{
+  if (!u)
+    return;
+  free (u->buffers);
+  munmap (u->sqes, u->n_sqes_map);
+  if (u->n_cq_map)
+    munmap (u->cq_map, u->n_cq_map);
+  munmap (u->sq_map, u->n_sq_map);
+  close (u->fd);
+  free (u);
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+struct uring *
+uring_new (void)
+{
+  return NULL;
+}
+
+bool
+uring_copy (struct uring *u, struct uring_file *files, size_t n)
+{
+  (void) u;
+  (void) files;
+  (void) n;
+  return false;
+}
+
+void
+uring_free (struct uring *u)
+{
+  (void) u;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
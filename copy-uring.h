@@ -0,0 +1,48 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COPY_URING_H__
+#define __COPY_URING_H__
+
+#include "copy-utils.h"
+
+/* files copied per batch, and the largest file that goes into one */
+#define URING_FILES    32
+#define URING_MAX_FILE 65536
+
+struct uring;
+
+struct uring_file
+{
+  const char *src_path;
+  const char *dst_path;
+  size_t size;
+  /* 0 once copied, or the (positive) error of the first step that failed */
+  int result;
+  /* whether the source changed while the chain read it */
+  bool changed;
+  /* the source as the chain found it, once copied */
+  struct stat st;
+};
+
+struct uring *uring_new (void);
+bool uring_copy (struct uring *u, struct uring_file *files, size_t n);
+void uring_free (struct uring *u);
+
+#endif /* __COPY_URING_H__ */
@@ -17,10 +17,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
 #include <ctype.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #ifndef _WIN32
 # include <unistd.h>
 #endif
@@ -31,6 +38,10 @@
 
 #include "copy-utils.h"
 
+#ifndef O_NOATIME
+# define O_NOATIME 0
+#endif
+
 #define B_SHORT  "B"
 #define KB_SHORT "K"
 #define MB_SHORT "M"
@@ -126,7 +137,7 @@ is_absolute_path (const char *path)
   return false;
 }
 
-static void
+static bool
 absolute_path (char *buffer, const char *path)
 {
   size_t n_path;
@@ -135,7 +146,10 @@ absolute_path (char *buffer, const char *path)
   {
     n_path = strlen (path);
     if (n_path >= (PATH_BUFMAX - 1))
-      die (0, "preventing buffer overflow");
+    {
+      errno = ENAMETOOLONG;
+      return false;
+    }
     if (!is_absolute_path (path))
     {
       size_t n;
@@ -146,7 +160,10 @@ absolute_path (char *buffer, const char *path)
       n_cwd = strlen (cwd);
       n = n_cwd + n_path + 1;
       if (n >= (PATH_BUFMAX - 1))
-        die (0, "preventing buffer overflow");
+      {
+        errno = ENAMETOOLONG;
+        return false;
+      }
       memcpy (buffer, cwd, n_cwd);
       buffer[n_cwd] = DIR_SEPARATOR_C;
       memcpy (buffer + (n_cwd + 1), path, n_path);
@@ -154,9 +171,10 @@ absolute_path (char *buffer, const char *path)
     }
     else
       memcpy (buffer, path, n_path + 1);
-    return;
+    return true;
   }
   buffer[0] = '\0';
+  return true;
 }
 
 #ifdef DEBUGGING
@@ -176,11 +194,45 @@ __debug (const char *tag, const char *fmt, ...)
 }
 #endif
 
+static pthread_t main_thread;
+static bool main_thread_set = false;
+
+/* Remembers the calling thread as the one that may exit() the program. */
+void
+set_main_thread (void)
+{
+  main_thread = pthread_self ();
+  main_thread_set = true;
+}
+
+bool
+on_main_thread (void)
+{
+  return !main_thread_set || pthread_equal (pthread_self (), main_thread);
+}
+
+/* Ends the program after a fatal error. A worker thread cannot run the
+   exit handlers while the others are still working with what they free
+   (or race another worker doing the same), so it ends the process at
+   once instead. */
+void
+die_exit (void)
+{
+  if (on_main_thread ())
+    exit (EXIT_FAILURE);
+  fflush (stdout);
+  fflush (stderr);
+  _exit (EXIT_FAILURE);
+}
+
+/* Leaves errno alone so callers can still record it afterwards. */
 void
 x_error (int errnum, const char *fmt, ...)
 {
+  int saved_errno;
   va_list args;
 
+  saved_errno = errno;
   fputs (program_name, stderr);
   fputs (": error: ", stderr);
 
@@ -194,6 +246,7 @@ x_error (int errnum, const char *fmt, ...)
     fputs (strerror (errnum), stderr);
   }
   fputc ('\n', stderr);
+  errno = saved_errno;
 }
 
 FILE *
@@ -218,12 +271,84 @@ x_fclose (FILE *fp, const char *path)
   return true;
 }
 
+static size_t atime_opens = 0;
+
+/* Opens the source PATH for reading with O_NOATIME, so that reading it
+   does not write its access time back. Only the owner of a file (or a
+   process with CAP_FOWNER) may ask for that, so when it is refused the
+   file is opened the regular way, and counted. */
+int
+open_source (const char *path, int flags)
+{
+  int fd;
+
+  if (O_NOATIME == 0)
+    return open (path, flags);
+  fd = open (path, flags | O_NOATIME);
+  if ((fd != -1) || (errno != EPERM))
+    return fd;
+  fd = open (path, flags);
+  if (fd != -1)
+    __atomic_add_fetch (&atime_opens, 1, __ATOMIC_RELAXED);
+  return fd;
+}
+
+/* Like pread(), but only stops short where the file ends. */
+ssize_t
+pread_full (int fd, void *buffer, size_t n, off_t offset)
+{
+  ssize_t r;
+  size_t done;
+
+  for (done = 0; done < n; done += (size_t) r)
+  {
+    r = pread (fd, (char *) buffer + done, n - done, offset + (off_t) done);
+    if (r == 0)
+      break;
+    if (r == -1)
+    {
+      if (errno != EINTR)
+        return -1;
+      r = 0;
+    }
+  }
+  return (ssize_t) done;
+}
+
+/* Counts a source opened without O_NOATIME other than by open_source(). */
+void
+count_atime_open (void)
+{
+  __atomic_add_fetch (&atime_opens, 1, __ATOMIC_RELAXED);
+}
+
+/* How many sources had to be opened without O_NOATIME. */
+size_t
+source_atime_opens (void)
+{
+  return __atomic_load_n (&atime_opens, __ATOMIC_RELAXED);
+}
+
+/* Directories are read without touching their access times either. */
 DIR *
 x_opendir (const char *path)
 {
+  int fd;
+  int saved_errno;
   DIR *dp;
 
-  dp = opendir (path);
+  dp = NULL;
+  fd = open_source (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd != -1)
+  {
+    dp = fdopendir (fd);
+    if (!dp)
+    {
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+    }
+  }
   if (!dp)
     x_error (errno, "failed to open directory `%s'", path);
   return dp;
@@ -246,6 +371,7 @@ x_readdir (DIR *dp, bool *error, const char *path)
   struct dirent *e;
 
   *error = false;
+  errno = 0;
   e = readdir (dp);
   if (!e && ((errno != 0) && (errno != ENOENT) && (errno != EEXIST)))
   {
@@ -270,18 +396,26 @@ x_utime (const char *path, const struct utimbuf *times)
     x_error (errno, "failed to set timestamp for `%s'", path);
 }
 
-void
+bool
 x_chown (const char *path, uid_t uid, gid_t gid)
 {
   if (chown (path, uid, gid) != 0)
+  {
     x_error (errno, "failed to set ownership for `%s'", path);
+    return false;
+  }
+  return true;
 }
 
-void
+bool
 x_chmod (const char *path, mode_t mode)
 {
   if (chmod (path, mode) != 0)
+  {
     x_error (errno, "failed to set permissions for `%s'", path);
+    return false;
+  }
+  return true;
 }
 
 bool
@@ -306,7 +440,7 @@ streq (const char *s1, const char *s2, bool ignore_case)
 
 /* Path basename routine from glib-2.0 (but without mallocing anything). */
 void
-basename (char *buffer, const char *path)
+base_name (char *buffer, const char *path)
 {
   size_t n;
   ssize_t base;
@@ -356,7 +490,7 @@ basename (char *buffer, const char *path)
 
 /* Path dirname routine from glib-2.0 (but without mallocing anything). */
 void
-dirname (char *buffer, const char *path)
+dir_name (char *buffer, const char *path)
 {
   size_t n;
   char *base;
@@ -431,14 +565,41 @@ dirname (char *buffer, const char *path)
   buffer[0] = '\0';
 }
 
-void
+/* Puts PATH with its first N_ROOT bytes replaced by NEW_ROOT in BUFFER.
+   Returns false if that does not fit. */
+bool
+rebase_path (char *buffer,
+             const char *path,
+             size_t n_root,
+             const char *new_root)
+{
+  size_t n_path;
+  size_t n_new_root;
+  size_t n_result;
+
+  n_path = strlen (path);
+  n_new_root = strlen (new_root);
+  n_result = (n_path - n_root) + n_new_root;
+  if (n_result >= (PATH_BUFMAX - 1))
+    return false;
+  memcpy (buffer, new_root, n_new_root);
+  memcpy (buffer + n_new_root, path + n_root, n_path - n_root);
+  buffer[n_result] = '\0';
+  return true;
+}
+
+bool
 make_path (const char *path)
 {
   char c;
   char *p;
   char abs[PATH_BUFMAX];
 
-  absolute_path (abs, path);
+  if (!absolute_path (abs, path))
+  {
+    x_error (errno, "failed to create directory `%s'", path);
+    return false;
+  }
   p = abs;
 
   while (*p)
@@ -449,9 +610,13 @@ make_path (const char *path)
     c = *p;
     *p = '\0';
     if (!make_dir (abs) && (errno != EEXIST))
-      die (errno, "failed to create directory `%s'", abs);
+    {
+      x_error (errno, "failed to create directory `%s'", abs);
+      return false;
+    }
     *p = c;
   }
+  return true;
 }
 
 bool
@@ -596,7 +761,7 @@ console_width (void)
   return FALLBACK_CONSOLE_WIDTH;
 }
 
-void
+bool
 preserve_timestamp (const char *path, time_t atime, time_t mtime)
 {
   struct utimbuf timestamp;
@@ -604,6 +769,110 @@ preserve_timestamp (const char *path, time_t atime, time_t mtime)
   timestamp.actime = atime;
   timestamp.modtime = mtime;
   if (utime (path, &timestamp) != 0)
+  {
     x_error (errno, "failed to set timestamp for `%s'", path);
+    return false;
+  }
+  return true;
+}
+
+void
+sync_parent_directory (const char *path)
+{
+  int fd;
+  char parent[PATH_BUFMAX];
+
+  dir_name (parent, path);
+  fd = open (parent, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return;
+  if (fsync (fd) != 0)
+    x_error (errno, "failed to sync directory `%s'", parent);
+  close (fd);
+}
+
+/* Parses a byte count with an optional K, M, G, T, P or E suffix, using the
+   same powers of 1000 as format_size(). */
+bool
+parse_size (const char *s, byte_t *bytes)
+{
+  char *end;
+  long double n;
+  long double factor;
+
+  errno = 0;
+  n = strtold (s, &end);
+  if ((end == s) || (errno != 0) || (n < 0.0) || isnan (n))
+    return false;
+
+  switch (toupper (*end))
+  {
+    case '\0': factor = 1.0; break;
+    case 'B': factor = 1.0; break;
+    case 'K': factor = BYTE_TO_LDBL (KB_FACTOR); break;
+    case 'M': factor = BYTE_TO_LDBL (MB_FACTOR); break;
+    case 'G': factor = BYTE_TO_LDBL (GB_FACTOR); break;
+    case 'T': factor = BYTE_TO_LDBL (TB_FACTOR); break;
+    case 'P': factor = BYTE_TO_LDBL (PB_FACTOR); break;
+    case 'E': factor = BYTE_TO_LDBL (EB_FACTOR); break;
+    default:
+      return false;
+  }
+  if (*end && end[1] && !(streq (end + 1, "B", true) && (*end != 'B')))
+    return false;
+  if ((n * factor) >= BYTE_TO_LDBL (UINT64_MAX))
+    return false;
+  *bytes = (byte_t) (n * factor);
+  return true;
+}
+
+/* Parses either a date (YYYY-MM-DD, optionally followed by HH:MM[:SS]) or
+   an age relative to NOW with an optional s, m, h, d or w suffix (seconds
+   if there is none) into an absolute time. */
+bool
+parse_time_point (const char *s, time_t now, time_t *t)
+{
+  char *end;
+  char *rest;
+  double n;
+  double factor;
+  struct tm tm;
+
+  memset (&tm, 0, sizeof (struct tm));
+  end = strptime (s, "%Y-%m-%d", &tm);
+  if (end)
+  {
+    if (*end)
+    {
+      rest = strptime (end, " %H:%M:%S", &tm);
+      if (!rest)
+        rest = strptime (end, " %H:%M", &tm);
+      if (!rest || *rest)
+        return false;
+    }
+    tm.tm_isdst = -1;
+    *t = mktime (&tm);
+    return *t != (time_t) -1;
+  }
+
+  errno = 0;
+  n = strtod (s, &end);
+  if ((end == s) || (errno != 0) || (n < 0.0) || isnan (n) || isinf (n))
+    return false;
+  switch (tolower (*end))
+  {
+    case '\0': factor = 1.0; break;
+    case 's': factor = 1.0; break;
+    case 'm': factor = SECONDS_PER_MINUTE; break;
+    case 'h': factor = SECONDS_PER_HOUR; break;
+    case 'd': factor = SECONDS_PER_DAY; break;
+    case 'w': factor = 7 * SECONDS_PER_DAY; break;
+    default:
+      return false;
+  }
+  if (*end && end[1])
+    return false;
+  *t = now - (time_t) (n * factor);
+  return true;
 }
 
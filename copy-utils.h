@@ -35,7 +35,7 @@
   do \
   { \
     x_error ((errnum), __VA_ARGS__); \
-    exit (EXIT_FAILURE); \
+    die_exit (); \
   } while (0)
 
 #ifdef DEBUGGING
@@ -58,6 +58,7 @@
 #define PATH_BUFMAX     1024
 
 #define MILLISECONDS_PER_SECOND 1000
+#define SECONDS_PER_DAY        86400
 #define SECONDS_PER_HOUR        3600
 #define SECONDS_PER_MINUTE        60
 
@@ -86,18 +87,29 @@ typedef uint64_t byte_t;
 void __debug (const char *tag, const char *fmt, ...);
 #endif
 void x_error (int errnum, const char *fmt, ...);
+void set_main_thread (void);
+bool on_main_thread (void);
+void die_exit (void) __attribute__ ((noreturn));
 FILE *x_fopen (const char *path, const char *mode);
 bool x_fclose (FILE *fp, const char *path);
+int open_source (const char *path, int flags);
+ssize_t pread_full (int fd, void *buffer, size_t n, off_t offset);
+void count_atime_open (void);
+size_t source_atime_opens (void);
 DIR *x_opendir (const char *path);
 bool x_closedir (DIR *dp, const char *path);
 struct dirent *x_readdir (DIR *dp, bool *error, const char *path);
 void x_gettimeofday (struct timeval *tv);
-void x_chown (const char *path, uid_t uid, gid_t gid);
-void x_chmod (const char *path, mode_t mode);
+bool x_chown (const char *path, uid_t uid, gid_t gid);
+bool x_chmod (const char *path, mode_t mode);
 bool streq (const char *s1, const char *s2, bool ignore_case);
-void basename (char *buffer, const char *path);
-void dirname (char *buffer, const char *path);
-void make_path (const char *path);
+void base_name (char *buffer, const char *path);
+void dir_name (char *buffer, const char *path);
+bool rebase_path (char *buffer,
+                  const char *path,
+                  size_t n_root,
+                  const char *new_root);
+bool make_path (const char *path);
 bool get_overwrite_permission (const char *path);
 long get_milliseconds (const struct timeval *s, const struct timeval *e);
 void format_time (char *buffer,
@@ -106,7 +118,10 @@ void format_time (char *buffer,
 void format_size (char *buffer, byte_t bytes, bool long_format);
 void format_percent (char *buffer, byte_t so_far, byte_t total);
 int console_width (void);
-void preserve_timestamp (const char *path, time_t atime, time_t mtime);
+bool preserve_timestamp (const char *path, time_t atime, time_t mtime);
+void sync_parent_directory (const char *path);
+bool parse_size (const char *s, byte_t *bytes);
+bool parse_time_point (const char *s, time_t now, time_t *t);
 
 #endif /* __COPY_UTILS_H__ */
 
@@ -0,0 +1,695 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy-checksum.h"
+#include "copy-pool.h"
+#include "copy-utils.h"
+#include "copy-verify.h"
+
+/* files queued per verifying thread */
+#define VERIFY_QUEUE 4
+
+/* the least a thread comparing part of a file is given */
+#define VERIFY_SPLIT_SIZE 67108864
+
+/*
+ * The source tree is walked the way the copy walked it (with the same
+ * filters), and every file found is checked against its copy by a pool
+ * of threads. Comparing reads both files with pread() into buffers of
+ * VERIFY_BUFFER_SIZE bytes, after asking the kernel to read ahead on
+ * both of them, so both devices are busy while the last stretch is being
+ * compared. Mapping the files would save a copy, but a file truncated
+ * underneath the mapping kills the process with SIGBUS. A file too big for
+ * one thread to get through quickly is split into stretches compared by
+ * threads of their own, and so are the leaves of tree checksums.
+ *
+ * Sampling only compares some blocks of VERIFY_SAMPLE_BLOCK bytes, each
+ * picked on its own with the same chance, which is set so that a copy
+ * with VERIFY_SAMPLE_DAMAGE of its blocks damaged is caught with the
+ * requested probability. So big files get more samples than small ones,
+ * most small files none at all, and every file is at least checked for
+ * being there with the right size. The blocks of a file follow from the
+ * seed and its path alone, whichever thread gets to it.
+ */
+
+struct verify
+{
+  struct verify_config config;
+  /* the chance of each block to be sampled */
+  double rate;
+  size_t n_root;
+  const struct verify_ops *ops;
+  struct verify_totals *totals;
+  struct pool *pool;
+  pthread_mutex_t lock;
+};
+
+struct verify_job
+{
+  struct verify *v;
+  char *src_path;
+  char *dst_path;
+  off_t size;
+};
+
+static const char *mode_names[] = {"md5", "compare", "tree"};
+
+/* Takes `md5', `compare', `tree' or `sample:P[:SEED]', where P is a
+   probability as a fraction or a percentage. */
+bool
+verify_parse (const char *spec, struct verify_config *config)
+{
+  int x;
+  char *end;
+  double probability;
+  uint64_t seed;
+
+  for (x = 0; x < (int) (sizeof (mode_names) / sizeof (mode_names[0])); ++x)
+  {
+    if (streq (spec, mode_names[x], false))
+    {
+      config->mode = x;
+      return true;
+    }
+  }
+  if (strncmp (spec, "sample:", 7) != 0)
+    return false;
+
+  probability = strtod (spec + 7, &end);
+  if (end == (spec + 7))
+    return false;
+  if (*end == '%')
+  {
+    probability /= 100.0;
+    end++;
+  }
+  if (!(probability > 0.0) || !(probability <= 1.0))
+    return false;
+  seed = 0;
+  if (*end == ':')
+  {
+    if ((end[1] < '0') || (end[1] > '9'))
+      return false;
+    errno = 0;
+    seed = (uint64_t) strtoull (end + 1, &end, 10);
+    if (errno != 0)
+      return false;
+  }
+  if (*end)
+    return false;
+  config->mode = VERIFY_SAMPLE;
+  config->probability = probability;
+  config->seed = seed;
+  return true;
+}
+
+static size_t
+first_difference (const unsigned char *a, const unsigned char *b, size_t n)
+{
+  size_t x;
+  size_t block;
+
+  for (x = 0; x < n; x += block)
+  {
+    block = ((n - x) < 64) ? (n - x) : 64;
+    if (memcmp (a + x, b + x, block) != 0)
+      break;
+  }
+  while ((x < n) && (a[x] == b[x]))
+    x++;
+  return x;
+}
+
+struct compare_range
+{
+  int src_fd;
+  int dst_fd;
+  off_t start;
+  off_t end;
+  /* the first difference any range has found, shared by all of them */
+  off_t *mismatch;
+  int errnum;
+};
+
+static void
+mismatch_at (off_t *mismatch, off_t offset)
+{
+  off_t seen;
+
+  seen = __atomic_load_n (mismatch, __ATOMIC_RELAXED);
+  while ((offset < seen) &&
+         !__atomic_compare_exchange_n (mismatch, &seen, offset, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void
+compare_range_task (void *arg)
+{
+  off_t pos;
+  size_t len;
+  ssize_t n_src;
+  ssize_t n_dst;
+  struct compare_range *r;
+  unsigned char *src_buffer;
+  unsigned char *dst_buffer;
+
+  r = (struct compare_range *) arg;
+  src_buffer = malloc (2 * VERIFY_BUFFER_SIZE);
+  if (!src_buffer)
+  {
+    r->errnum = errno;
+    return;
+  }
+  dst_buffer = src_buffer + VERIFY_BUFFER_SIZE;
+
+  for (pos = r->start; pos < r->end; pos += (off_t) len)
+  {
+    /* a difference before this stretch already settles it */
+    if (__atomic_load_n (r->mismatch, __ATOMIC_RELAXED) <= pos)
+      break;
+    len = ((r->end - pos) < VERIFY_BUFFER_SIZE)
+          ? (size_t) (r->end - pos) : VERIFY_BUFFER_SIZE;
+    (void) posix_fadvise (r->src_fd, pos, 2 * VERIFY_BUFFER_SIZE,
+                          POSIX_FADV_WILLNEED);
+    (void) posix_fadvise (r->dst_fd, pos, 2 * VERIFY_BUFFER_SIZE,
+                          POSIX_FADV_WILLNEED);
+    n_src = pread_full (r->src_fd, src_buffer, len, pos);
+    n_dst = (n_src == -1) ? -1
+                          : pread_full (r->dst_fd, dst_buffer, len, pos);
+    if ((n_src == -1) || (n_dst == -1))
+    {
+      r->errnum = errno;
+      break;
+    }
+    /* either file got shorter since it was stat'ed */
+    if (n_dst < n_src)
+      n_src = n_dst;
+    if (memcmp (src_buffer, dst_buffer, (size_t) n_src) != 0)
+    {
+      mismatch_at (r->mismatch,
+                   pos + (off_t) first_difference (src_buffer, dst_buffer,
+                                                   (size_t) n_src));
+      break;
+    }
+    if ((size_t) n_src < len)
+    {
+      mismatch_at (r->mismatch, pos + (off_t) n_src);
+      break;
+    }
+  }
+  free (src_buffer);
+}
+
+/* Returns true if both files have the same bytes. Otherwise OFFSET is the
+   first byte where they differ (or where the shorter one ends), or ERRNUM
+   why they could not be read. A big file is split into up to N_THREADS
+   stretches of at least VERIFY_SPLIT_SIZE bytes, compared at once. */
+bool
+verify_compare (const char *src_path,
+                const char *dst_path,
+                size_t n_threads,
+                off_t *offset,
+                int *errnum)
+{
+  int src_fd;
+  int dst_fd;
+  size_t x;
+  size_t n_ranges;
+  off_t size;
+  off_t mismatch;
+  struct stat src_st;
+  struct stat dst_st;
+  struct pool *pool;
+
+  *offset = -1;
+  *errnum = 0;
+  src_fd = open_source (src_path, O_RDONLY);
+  if (src_fd == -1)
+  {
+    *errnum = errno;
+    return false;
+  }
+  dst_fd = open_source (dst_path, O_RDONLY);
+  if ((dst_fd == -1) ||
+      (fstat (src_fd, &src_st) != 0) || (fstat (dst_fd, &dst_st) != 0))
+  {
+    *errnum = errno;
+    if (dst_fd != -1)
+      close (dst_fd);
+    close (src_fd);
+    return false;
+  }
+
+  size = (src_st.st_size < dst_st.st_size) ? src_st.st_size
+                                           : dst_st.st_size;
+  mismatch = size;
+  n_ranges = (size_t) (size / VERIFY_SPLIT_SIZE);
+  if (n_ranges > n_threads)
+    n_ranges = n_threads;
+  if (n_ranges == 0)
+    n_ranges = 1;
+  (void) posix_fadvise (src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  (void) posix_fadvise (dst_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  struct compare_range ranges[n_ranges];
+  pool = pool_new ((n_ranges > 1) ? n_ranges : 0, 0);
+  for (x = 0; x < n_ranges; ++x)
+  {
+    ranges[x].src_fd = src_fd;
+    ranges[x].dst_fd = dst_fd;
+    ranges[x].start = ((size * (off_t) x) / (off_t) n_ranges /
+                       VERIFY_BUFFER_SIZE) * VERIFY_BUFFER_SIZE;
+    ranges[x].end = size;
+    if (x > 0)
+      ranges[x - 1].end = ranges[x].start;
+    ranges[x].mismatch = &mismatch;
+    ranges[x].errnum = 0;
+  }
+  for (x = 0; x < n_ranges; ++x)
+    pool_submit (pool, compare_range_task, &ranges[x]);
+  pool_wait (pool);
+  pool_free (pool);
+  close (src_fd);
+  close (dst_fd);
+
+  for (x = 0; x < n_ranges; ++x)
+  {
+    if (ranges[x].errnum != 0)
+    {
+      *errnum = ranges[x].errnum;
+      return false;
+    }
+  }
+  if ((mismatch < size) || (src_st.st_size != dst_st.st_size))
+  {
+    *offset = mismatch;
+    return false;
+  }
+  return true;
+}
+
+/* Compares the tree checksums of both files, each worked out with up to
+   N_THREADS threads. OFFSET is where the first leaf that differs starts. */
+static bool
+verify_tree_checksums (const char *src_path,
+                       const char *dst_path,
+                       size_t n_threads,
+                       off_t *offset,
+                       int *errnum)
+{
+  bool same;
+  size_t leaf;
+  size_t n_leaves;
+  struct tree_checksum src_sum;
+  struct tree_checksum dst_sum;
+
+  *offset = -1;
+  *errnum = 0;
+  if (!get_tree_checksum (&src_sum, src_path, n_threads))
+  {
+    *errnum = errno;
+    return false;
+  }
+  if (!get_tree_checksum (&dst_sum, dst_path, n_threads))
+  {
+    *errnum = errno;
+    tree_checksum_free (&src_sum);
+    return false;
+  }
+  same = memcmp (src_sum.root, dst_sum.root, MD5_DIGEST_SIZE) == 0;
+  if (!same)
+  {
+    n_leaves = (src_sum.n_leaves < dst_sum.n_leaves) ? src_sum.n_leaves
+                                                     : dst_sum.n_leaves;
+    for (leaf = 0; leaf < n_leaves; ++leaf)
+      if (memcmp (src_sum.leaves[leaf], dst_sum.leaves[leaf],
+                  MD5_DIGEST_SIZE) != 0)
+        break;
+    *offset = (off_t) leaf * TREE_LEAF_SIZE;
+  }
+  tree_checksum_free (&src_sum);
+  tree_checksum_free (&dst_sum);
+  return same;
+}
+
+static uint64_t
+sample_next (uint64_t *state)
+{
+  uint64_t z;
+
+  /* splitmix64 */
+  *state += UINT64_C (0x9e3779b97f4a7c15);
+  z = *state;
+  z = (z ^ (z >> 30)) * UINT64_C (0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C (0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+/* How many blocks to pass over before the next one that is picked, with
+   every block picked at RATE on its own. */
+static uint64_t
+sample_skip (uint64_t *state, double rate)
+{
+  double u;
+  double skip;
+
+  if (rate >= 1.0)
+    return 0;
+  u = ((double) (sample_next (state) >> 11) + 1.0) / 9007199254740992.0;
+  skip = floor (log (u) / log1p (-rate));
+  return (skip < 1.8e19) ? (uint64_t) skip : UINT64_MAX;
+}
+
+static uint64_t
+sample_seed (uint64_t seed, const char *path)
+{
+  uint64_t h;
+
+  /* FNV-1a */
+  h = UINT64_C (0xcbf29ce484222325);
+  for (; *path; ++path)
+    h = (h ^ (unsigned char) *path) * UINT64_C (0x100000001b3);
+  return seed ^ h;
+}
+
+/* Compares the blocks of a file picked for REL_PATH (its path below the
+   root), like verify_compare() does the whole file. */
+static bool
+verify_sample (const struct verify *v,
+               const char *src_path,
+               const char *dst_path,
+               const char *rel_path,
+               off_t *offset,
+               int *errnum,
+               size_t *n_blocks,
+               byte_t *bytes)
+{
+  bool same;
+  int src_fd;
+  int dst_fd;
+  off_t pos;
+  size_t len;
+  uint64_t b;
+  uint64_t n;
+  uint64_t skip;
+  uint64_t state;
+  ssize_t n_src;
+  ssize_t n_dst;
+  struct stat src_st;
+  struct stat dst_st;
+  unsigned char *src_buffer;
+  unsigned char *dst_buffer;
+
+  *offset = -1;
+  *errnum = 0;
+  src_fd = open_source (src_path, O_RDONLY);
+  if (src_fd == -1)
+  {
+    *errnum = errno;
+    return false;
+  }
+  dst_fd = open_source (dst_path, O_RDONLY);
+  if ((dst_fd == -1) ||
+      (fstat (src_fd, &src_st) != 0) || (fstat (dst_fd, &dst_st) != 0))
+  {
+    *errnum = errno;
+    if (dst_fd != -1)
+      close (dst_fd);
+    close (src_fd);
+    return false;
+  }
+  if (src_st.st_size != dst_st.st_size)
+  {
+    *offset = (src_st.st_size < dst_st.st_size) ? src_st.st_size
+                                                : dst_st.st_size;
+    close (src_fd);
+    close (dst_fd);
+    return false;
+  }
+
+  src_buffer = malloc (2 * VERIFY_SAMPLE_BLOCK);
+  if (!src_buffer)
+  {
+    *errnum = errno;
+    close (src_fd);
+    close (dst_fd);
+    return false;
+  }
+  dst_buffer = src_buffer + VERIFY_SAMPLE_BLOCK;
+  (void) posix_fadvise (src_fd, 0, 0, POSIX_FADV_RANDOM);
+  (void) posix_fadvise (dst_fd, 0, 0, POSIX_FADV_RANDOM);
+
+  same = true;
+  n = ((uint64_t) src_st.st_size + VERIFY_SAMPLE_BLOCK - 1) /
+      VERIFY_SAMPLE_BLOCK;
+  state = sample_seed (v->config.seed, rel_path);
+  for (b = sample_skip (&state, v->rate); b < n; b += skip + 1)
+  {
+    pos = (off_t) (b * VERIFY_SAMPLE_BLOCK);
+    len = ((src_st.st_size - pos) < VERIFY_SAMPLE_BLOCK)
+          ? (size_t) (src_st.st_size - pos) : VERIFY_SAMPLE_BLOCK;
+    n_src = pread_full (src_fd, src_buffer, len, pos);
+    n_dst = (n_src == -1) ? -1 : pread_full (dst_fd, dst_buffer, len, pos);
+    if ((n_src == -1) || (n_dst == -1))
+    {
+      *errnum = errno;
+      same = false;
+      break;
+    }
+    (*n_blocks)++;
+    *bytes += (byte_t) len;
+    if ((n_src != n_dst) ||
+        (memcmp (src_buffer, dst_buffer, (size_t) n_src) != 0))
+    {
+      *offset = pos + (off_t) first_difference (src_buffer, dst_buffer,
+                                                (size_t) ((n_src < n_dst)
+                                                          ? n_src : n_dst));
+      same = false;
+      break;
+    }
+    skip = sample_skip (&state, v->rate);
+    if (skip >= (n - b - 1))
+      break;
+  }
+
+  free (src_buffer);
+  close (src_fd);
+  close (dst_fd);
+  return same;
+}
+
+static void
+verify_failed (struct verify *v,
+               const char *src_path,
+               const char *dst_path,
+               int errnum,
+               off_t offset)
+{
+  pthread_mutex_lock (&v->lock);
+  v->totals->n_failed++;
+  v->ops->failed (src_path, dst_path, errnum, offset);
+  pthread_mutex_unlock (&v->lock);
+}
+
+static void
+verify_job_task (void *arg)
+{
+  bool same;
+  int errnum;
+  off_t offset;
+  size_t n_blocks;
+  byte_t bytes;
+  struct verify_job *job;
+  char src_sum[CHECKSUM_BUFMAX];
+  char dst_sum[CHECKSUM_BUFMAX];
+
+  job = (struct verify_job *) arg;
+  errnum = 0;
+  offset = -1;
+  n_blocks = 0;
+  bytes = (byte_t) job->size;
+  errno = 0;
+  if (job->v->config.mode == VERIFY_SAMPLE)
+  {
+    bytes = BYTE_C (0);
+    same = verify_sample (job->v, job->src_path, job->dst_path,
+                          job->src_path + job->v->n_root, &offset, &errnum,
+                          &n_blocks, &bytes);
+  }
+  else if (job->v->config.mode == VERIFY_COMPARE)
+    same = verify_compare (job->src_path, job->dst_path,
+                           job->v->config.n_threads, &offset, &errnum);
+  else if (job->v->config.mode == VERIFY_TREE)
+    same = verify_tree_checksums (job->src_path, job->dst_path,
+                                  job->v->config.n_threads, &offset,
+                                  &errnum);
+  else if (get_checksum (src_sum, job->src_path) &&
+           get_checksum (dst_sum, job->dst_path))
+    same = streq (src_sum, dst_sum, false);
+  else
+  {
+    errnum = (errno != 0) ? errno : EIO;
+    same = false;
+  }
+
+  pthread_mutex_lock (&job->v->lock);
+  job->v->totals->n_files++;
+  job->v->totals->bytes += bytes;
+  job->v->totals->n_blocks += n_blocks;
+  pthread_mutex_unlock (&job->v->lock);
+  if (!same)
+    verify_failed (job->v, job->src_path, job->dst_path, errnum, offset);
+
+  free (job->src_path);
+  free (job->dst_path);
+  free (job);
+}
+
+static void
+verify_submit (struct verify *v,
+               const char *src_path,
+               const char *dst_path,
+               off_t size)
+{
+  struct verify_job *job;
+
+  job = malloc (sizeof (struct verify_job));
+  if (!job)
+    die (errno, "failed to allocate verification");
+  job->v = v;
+  job->src_path = strdup (src_path);
+  job->dst_path = strdup (dst_path);
+  if (!job->src_path || !job->dst_path)
+    die (errno, "failed to allocate verification");
+  job->size = size;
+  pool_submit (v->pool, verify_job_task, job);
+}
+
+static void
+verify_directory (struct verify *v, const char *src_dir, const char *dst_dir)
+{
+  bool err;
+  struct stat st;
+  struct dirent *ep;
+  DIR *dp;
+  char src_path[PATH_BUFMAX];
+  char dst_path[PATH_BUFMAX];
+
+  dp = x_opendir (src_dir);
+  if (!dp)
+  {
+    verify_failed (v, src_dir, dst_dir, errno, -1);
+    return;
+  }
+  for (;;)
+  {
+    ep = x_readdir (dp, &err, src_dir);
+    if (!ep)
+    {
+      if (err)
+        verify_failed (v, src_dir, dst_dir, errno, -1);
+      break;
+    }
+    if (streq (ep->d_name, ".", false) || streq (ep->d_name, "..", false))
+      continue;
+    if ((snprintf (src_path, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                   src_dir, ep->d_name) >= PATH_BUFMAX) ||
+        (snprintf (dst_path, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                   dst_dir, ep->d_name) >= PATH_BUFMAX))
+    {
+      verify_failed (v, src_dir, dst_dir, ENAMETOOLONG, -1);
+      continue;
+    }
+    if (v->ops->excluded (src_path, v->n_root, ep))
+      continue;
+    if (stat (src_path, &st) != 0)
+    {
+      if (errno != ENOENT)
+        verify_failed (v, src_path, dst_path, errno, -1);
+    }
+    else if (S_ISDIR (st.st_mode))
+      verify_directory (v, src_path, dst_path);
+    else if (S_ISREG (st.st_mode) && !v->ops->skipped (&st))
+      verify_submit (v, src_path, dst_path, st.st_size);
+  }
+  x_closedir (dp, src_dir);
+}
+
+/* Checks the copy DST_PATH of the file or directory SRC_PATH with
+   N_THREADS threads (or in the calling thread if there are none), adding
+   up what was checked in TOTALS. */
+void
+verify_tree (const struct verify_config *config,
+             const char *src_path,
+             const char *dst_path,
+             size_t n_threads,
+             const struct verify_ops *ops,
+             struct verify_totals *totals)
+{
+  double n_total;
+  double n_damaged;
+  double picked;
+  struct stat st;
+  struct verify v;
+
+  v.config = *config;
+  n_total = ceil ((double) config->total_bytes / VERIFY_SAMPLE_BLOCK);
+  if (n_total < 1.0)
+    n_total = 1.0;
+  n_damaged = n_total * VERIFY_SAMPLE_DAMAGE;
+  if (n_damaged < 1.0)
+    n_damaged = 1.0;
+  if (config->probability >= 1.0)
+    v.rate = 1.0;
+  else
+    v.rate = -expm1 (log1p (-config->probability) / n_damaged);
+  v.n_root = strlen (src_path);
+  v.ops = ops;
+  v.totals = totals;
+  pthread_mutex_init (&v.lock, NULL);
+  v.pool = pool_new (n_threads, n_threads * VERIFY_QUEUE);
+
+  if (stat (src_path, &st) != 0)
+    verify_failed (&v, src_path, dst_path, errno, -1);
+  else if (S_ISDIR (st.st_mode))
+    verify_directory (&v, src_path, dst_path);
+  else
+    verify_submit (&v, src_path, dst_path, st.st_size);
+
+  pool_wait (v.pool);
+  pool_free (v.pool);
+  pthread_mutex_destroy (&v.lock);
+
+  /* the chance that no block picked was one of the damaged ones */
+  picked = (double) totals->n_blocks / n_total;
+  totals->confidence = (picked >= 1.0) ? 1.0
+                       : 1.0 - pow (1.0 - picked, n_damaged);
+}
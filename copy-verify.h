@@ -0,0 +1,96 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COPY_VERIFY_H__
+#define __COPY_VERIFY_H__
+
+#include "copy-utils.h"
+
+/* bytes of each side compared at a time */
+#define VERIFY_BUFFER_SIZE 1048576
+
+/* what sampling compares at a time, and the share of damaged blocks it
+   has to find a copy with to the requested probability */
+#define VERIFY_SAMPLE_BLOCK  65536
+#define VERIFY_SAMPLE_DAMAGE 0.001
+
+enum
+{
+  VERIFY_MD5,
+  VERIFY_COMPARE,
+  VERIFY_TREE,
+  VERIFY_SAMPLE,
+  N_VERIFY_MODES
+};
+
+struct verify_config
+{
+  int mode;
+  /* threads reading each file, for VERIFY_COMPARE and VERIFY_TREE */
+  size_t n_threads;
+  /* for VERIFY_SAMPLE: the chance of catching a damaged copy, the seed
+     the blocks are picked with, and how many bytes there are to pick them
+     from */
+  double probability;
+  uint64_t seed;
+  byte_t total_bytes;
+};
+
+struct verify_ops
+{
+  /* whether an entry of a source directory was left out of the copy */
+  bool (*excluded) (const char *path, size_t n_root, struct dirent *ep);
+  /* whether a file was skipped by the size and time filters */
+  bool (*skipped) (const struct stat *st);
+  /* a pair of files that differs, from byte OFFSET on if that is known
+     (-1 if not), or that could not be read (ERRNUM is not 0); one call at
+     a time */
+  void (*failed) (const char *src_path,
+                  const char *dst_path,
+                  int errnum,
+                  off_t offset);
+};
+
+struct verify_totals
+{
+  size_t n_files;
+  size_t n_failed;
+  /* bytes read from each side */
+  byte_t bytes;
+  /* for VERIFY_SAMPLE: blocks compared, and the chance that a copy with
+     VERIFY_SAMPLE_DAMAGE of its blocks damaged would have been caught */
+  size_t n_blocks;
+  double confidence;
+};
+
+bool verify_parse (const char *spec, struct verify_config *config);
+bool verify_compare (const char *src_path,
+                     const char *dst_path,
+                     size_t n_threads,
+                     off_t *offset,
+                     int *errnum);
+void verify_tree (const struct verify_config *config,
+                  const char *src_path,
+                  const char *dst_path,
+                  size_t n_threads,
+                  const struct verify_ops *ops,
+                  struct verify_totals *totals);
+
+#endif /* __COPY_VERIFY_H__ */
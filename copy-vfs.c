@@ -0,0 +1,624 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copy-utils.h"
+#include "copy-vfs.h"
+
+/*
+ * The mem backend numbers its directories like a heap: the root of a
+ * mounted tree is directory 0, and the subdirectories of directory B are
+ * B * MEM_FANOUT + 1 up to B * MEM_FANOUT + MEM_FANOUT, as far as there
+ * are directories. The files are spread evenly over all directories. A
+ * directory is called d<number> and a file f<number within its
+ * directory>, so any path can be looked up from its names alone, and
+ * sizes and times are hashed from the seed and the numbers. Nothing is
+ * kept in memory but the mount points.
+ */
+
+#define MEM_FANOUT        8
+#define MEM_FILES_PER_DIR 24
+#define MEM_EPOCH         1400000000
+#define MEM_TIME_SPAN     31536000
+
+struct vfs_dir
+{
+  DIR *dp;
+  size_t index;
+  size_t next;
+  struct dirent ent;
+};
+
+struct vfs_backend
+{
+  const char *name;
+  struct vfs_dir *(*opendir) (const char *path);
+  struct dirent *(*readdir) (struct vfs_dir *d,
+                             bool *error,
+                             const char *path);
+  void (*closedir) (struct vfs_dir *d, const char *path);
+  int (*stat) (const char *path, struct stat *st);
+  int (*fstat) (int fd, const char *path, struct stat *st);
+  int (*open) (const char *path, int flags, mode_t mode);
+  int (*unlink) (const char *path);
+  bool (*make_path) (const char *path);
+};
+
+struct mem_node
+{
+  bool is_dir;
+  size_t index;
+  size_t file;
+};
+
+struct mem_mount
+{
+  char *root;
+  size_t n_root;
+};
+
+static uint64_t mem_seed = 0;
+static size_t mem_n_dirs = 1;
+static size_t mem_n_files = 0;
+static size_t mem_max_file_size = VFS_MEM_MAX_FILE_SIZE;
+static size_t n_mounts = 0;
+static struct mem_mount *mounts = NULL;
+
+static struct vfs_dir *
+vfs_dir_new (void)
+{
+  struct vfs_dir *d;
+
+  d = calloc (1, sizeof (struct vfs_dir));
+  if (!d)
+    die (errno, "failed to allocate directory");
+  return d;
+}
+
+static struct vfs_dir *
+posix_opendir (const char *path)
+{
+  DIR *dp;
+  struct vfs_dir *d;
+
+  dp = x_opendir (path);
+  if (!dp)
+    return NULL;
+  d = vfs_dir_new ();
+  d->dp = dp;
+  return d;
+}
+
+static struct dirent *
+posix_readdir (struct vfs_dir *d, bool *error, const char *path)
+{
+  return x_readdir (d->dp, error, path);
+}
+
+static void
+posix_closedir (struct vfs_dir *d, const char *path)
+{
+  x_closedir (d->dp, path);
+  free (d);
+}
+
+static int
+posix_stat (const char *path, struct stat *st)
+{
+  return stat (path, st);
+}
+
+static int
+posix_fstat (int fd, const char *path, struct stat *st)
+{
+  (void) path;
+  return fstat (fd, st);
+}
+
+static int
+posix_open (const char *path, int flags, mode_t mode)
+{
+  if ((flags & O_ACCMODE) == O_RDONLY)
+    return open_source (path, flags);
+  return open (path, flags, mode);
+}
+
+static const struct vfs_backend posix_backend =
+{
+  "posix",
+  posix_opendir,
+  posix_readdir,
+  posix_closedir,
+  posix_stat,
+  posix_fstat,
+  posix_open,
+  unlink,
+  make_path
+};
+
+static uint64_t
+mem_hash (size_t index, size_t file)
+{
+  uint64_t h;
+
+  /* splitmix64 */
+  h = mem_seed + ((uint64_t) index * UINT64_C (0x9e3779b97f4a7c15)) +
+      ((uint64_t) file << 32) + (uint64_t) file;
+  h = (h ^ (h >> 30)) * UINT64_C (0xbf58476d1ce4e5b9);
+  h = (h ^ (h >> 27)) * UINT64_C (0x94d049bb133111eb);
+  return h ^ (h >> 31);
+}
+
+static size_t
+mem_files_in (size_t index)
+{
+  return (mem_n_files / mem_n_dirs) +
+         ((index < (mem_n_files % mem_n_dirs)) ? 1 : 0);
+}
+
+static size_t
+mem_first_file (size_t index)
+{
+  size_t extra;
+
+  extra = mem_n_files % mem_n_dirs;
+  return (index * (mem_n_files / mem_n_dirs)) +
+         ((index < extra) ? index : extra);
+}
+
+static void
+mem_fill_stat (const struct mem_node *n, struct stat *st)
+{
+  uint64_t h;
+
+  memset (st, 0, sizeof (struct stat));
+  h = mem_hash (n->index, n->is_dir ? SIZE_MAX : n->file);
+  st->st_dev = (dev_t) 0x6d656d;
+  st->st_uid = getuid ();
+  st->st_gid = getgid ();
+  st->st_blksize = 4096;
+  st->st_mtime = (time_t) (MEM_EPOCH + (h % MEM_TIME_SPAN));
+  st->st_atime = st->st_mtime;
+  st->st_ctime = st->st_mtime;
+  if (n->is_dir)
+  {
+    st->st_ino = (ino_t) (n->index + 1);
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    st->st_size = 4096;
+  }
+  else
+  {
+    st->st_ino = (ino_t) (mem_n_dirs + mem_first_file (n->index) + n->file +
+                          1);
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = (off_t) ((mem_max_file_size > 0)
+                           ? (h >> 8) % (mem_max_file_size + 1) : 0);
+  }
+  st->st_blocks = (blkcnt_t) ((st->st_size + 511) / 512);
+}
+
+/* Reads the number of a d<number> or f<number> name at P, which has to be
+   written the way vfs_readdir() writes it. */
+static const char *
+mem_parse_name (const char *p, size_t *number)
+{
+  size_t n;
+
+  if ((*p < '0') || (*p > '9') || ((*p == '0') && (p[1] >= '0') &&
+                                   (p[1] <= '9')))
+    return NULL;
+  for (n = 0; (*p >= '0') && (*p <= '9'); ++p)
+  {
+    if (n > ((SIZE_MAX - 9) / 10))
+      return NULL;
+    n = (n * 10) + (size_t) (*p - '0');
+  }
+  if (*p && !is_dir_separator (*p))
+    return NULL;
+  *number = n;
+  return p;
+}
+
+/* Returns 1 with N filled in if PATH is in a mounted tree, 0 if it is not
+   below any mount point, and -1 (with errno set) if it is below one but
+   names nothing there. */
+static int
+mem_lookup (const char *path, struct mem_node *n)
+{
+  size_t x;
+  size_t number;
+  const char *p;
+
+  p = NULL;
+  for (x = 0; (x < n_mounts) && !p; ++x)
+    if ((strncmp (path, mounts[x].root, mounts[x].n_root) == 0) &&
+        (!path[mounts[x].n_root] ||
+         is_dir_separator (path[mounts[x].n_root])))
+      p = path + mounts[x].n_root;
+  if (!p)
+    return 0;
+
+  n->is_dir = true;
+  n->index = 0;
+  n->file = 0;
+  for (;;)
+  {
+    while (is_dir_separator (*p))
+      p++;
+    if (!*p)
+      return 1;
+    if (!n->is_dir)
+      break;
+    if (*p == 'd')
+    {
+      p = mem_parse_name (p + 1, &number);
+      if (!p || (number == 0) || (number >= mem_n_dirs) ||
+          (((number - 1) / MEM_FANOUT) != n->index))
+        break;
+      n->index = number;
+    }
+    else if (*p == 'f')
+    {
+      p = mem_parse_name (p + 1, &number);
+      if (!p || (number >= mem_files_in (n->index)))
+        break;
+      n->is_dir = false;
+      n->file = number;
+    }
+    else
+      break;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+static struct vfs_dir *
+mem_opendir (const char *path)
+{
+  struct mem_node n;
+  struct vfs_dir *d;
+
+  if (mem_lookup (path, &n) != 1)
+    errno = ENOENT;
+  else if (!n.is_dir)
+    errno = ENOTDIR;
+  else
+  {
+    d = vfs_dir_new ();
+    d->index = n.index;
+    return d;
+  }
+  x_error (errno, "failed to open directory `%s'", path);
+  return NULL;
+}
+
+/* The subdirectories come first, then the files. */
+static struct dirent *
+mem_readdir (struct vfs_dir *d, bool *error, const char *path)
+{
+  size_t child;
+  size_t n_subdirs;
+
+  (void) path;
+  *error = false;
+  child = (d->index * MEM_FANOUT) + 1;
+  if (child >= mem_n_dirs)
+    n_subdirs = 0;
+  else if ((mem_n_dirs - child) < MEM_FANOUT)
+    n_subdirs = mem_n_dirs - child;
+  else
+    n_subdirs = MEM_FANOUT;
+
+  if (d->next < n_subdirs)
+  {
+    d->ent.d_ino = (ino_t) (child + d->next + 1);
+    d->ent.d_type = DT_DIR;
+    snprintf (d->ent.d_name, sizeof (d->ent.d_name), "d%zu",
+              child + d->next);
+  }
+  else if ((d->next - n_subdirs) < mem_files_in (d->index))
+  {
+    d->ent.d_ino = (ino_t) (mem_n_dirs + mem_first_file (d->index) +
+                            (d->next - n_subdirs) + 1);
+    d->ent.d_type = DT_REG;
+    snprintf (d->ent.d_name, sizeof (d->ent.d_name), "f%zu",
+              d->next - n_subdirs);
+  }
+  else
+    return NULL;
+  d->next++;
+  return &d->ent;
+}
+
+static void
+mem_closedir (struct vfs_dir *d, const char *path)
+{
+  (void) path;
+  free (d);
+}
+
+/* Outside the mounted trees there is nothing to find. */
+static int
+mem_stat (const char *path, struct stat *st)
+{
+  struct mem_node n;
+
+  if (mem_lookup (path, &n) != 1)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  mem_fill_stat (&n, st);
+  return 0;
+}
+
+static int
+mem_fstat (int fd, const char *path, struct stat *st)
+{
+  struct mem_node n;
+
+  if (mem_lookup (path, &n) == 1)
+  {
+    mem_fill_stat (&n, st);
+    return 0;
+  }
+  return fstat (fd, st);
+}
+
+/* An empty memfd of the file's size reads as the right number of zeros
+   without taking up any memory, and /dev/null as no bytes at all. */
+static int
+mem_open_file (const struct mem_node *n)
+{
+  int fd;
+  int saved_errno;
+  struct stat st;
+
+  mem_fill_stat (n, &st);
+  if (st.st_size == 0)
+    return open ("/dev/null", O_RDONLY | O_CLOEXEC);
+  fd = memfd_create ("copy-vfs", MFD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  if (ftruncate (fd, st.st_size) != 0)
+  {
+    saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* A file of a mounted tree reads as zeros and cannot be written, and
+   anything opened for writing outside of them is a sink. */
+static int
+mem_open (const char *path, int flags, mode_t mode)
+{
+  int found;
+  bool writing;
+  struct mem_node n;
+
+  (void) mode;
+  found = mem_lookup (path, &n);
+  writing = (flags & O_ACCMODE) != O_RDONLY;
+  if (found == 1)
+  {
+    if (n.is_dir)
+      errno = EISDIR;
+    else if (writing)
+      errno = EROFS;
+    else
+      return mem_open_file (&n);
+  }
+  else if ((found == 0) && writing)
+    return open ("/dev/null", O_WRONLY | O_CLOEXEC);
+  else if (found == 0)
+    errno = ENOENT;
+  else if (writing)
+    errno = EROFS;
+  return -1;
+}
+
+static int
+mem_unlink (const char *path)
+{
+  struct mem_node n;
+
+  if (mem_lookup (path, &n) == 0)
+    return 0;
+  errno = EROFS;
+  return -1;
+}
+
+static bool
+mem_make_path (const char *path)
+{
+  struct mem_node n;
+
+  if (mem_lookup (path, &n) == 0)
+    return true;
+  errno = EROFS;
+  x_error (errno, "failed to create directory `%s'", path);
+  return false;
+}
+
+static const struct vfs_backend mem_backend =
+{
+  "mem",
+  mem_opendir,
+  mem_readdir,
+  mem_closedir,
+  mem_stat,
+  mem_fstat,
+  mem_open,
+  mem_unlink,
+  mem_make_path
+};
+
+static const struct vfs_backend *backend = &posix_backend;
+
+static bool
+parse_field (const char **p, uint64_t *value)
+{
+  char *end;
+
+  if (!**p)
+    return true;
+  if (**p != ':')
+    return false;
+  (*p)++;
+  if ((**p < '0') || (**p > '9'))
+    return false;
+  errno = 0;
+  *value = (uint64_t) strtoull (*p, &end, 10);
+  if (errno != 0)
+    return false;
+  *p = end;
+  return true;
+}
+
+/* Takes `posix' or `mem[:SEED[:ENTRIES[:MAX_FILE_SIZE]]]'. */
+bool
+vfs_select (const char *spec)
+{
+  uint64_t entries;
+  uint64_t max_file_size;
+  const char *p;
+
+  if (streq (spec, "posix", false))
+  {
+    backend = &posix_backend;
+    return true;
+  }
+  if (strncmp (spec, "mem", 3) != 0)
+    return false;
+
+  p = spec + 3;
+  mem_seed = 0;
+  entries = VFS_MEM_ENTRIES;
+  max_file_size = VFS_MEM_MAX_FILE_SIZE;
+  if (!parse_field (&p, &mem_seed) ||
+      !parse_field (&p, &entries) ||
+      !parse_field (&p, &max_file_size) ||
+      *p || (entries > (SIZE_MAX / 2)) || (max_file_size > SIZE_MAX))
+    return false;
+
+  /* the root of a tree is a directory, but not one of its entries */
+  mem_n_dirs = (size_t) (entries / (MEM_FILES_PER_DIR + 1));
+  if (mem_n_dirs == 0)
+    mem_n_dirs = 1;
+  mem_n_files = (size_t) entries - (mem_n_dirs - 1);
+  mem_max_file_size = (size_t) max_file_size;
+  backend = &mem_backend;
+  return true;
+}
+
+/* Makes ROOT the root of a made up tree when the mem backend is used. */
+void
+vfs_mount (const char *root)
+{
+  size_t n;
+  struct mem_mount *m;
+
+  if (backend != &mem_backend)
+    return;
+  n = strlen (root);
+  while ((n > 1) && is_dir_separator (root[n - 1]))
+    n--;
+  m = realloc (mounts, (n_mounts + 1) * sizeof (struct mem_mount));
+  if (!m)
+    die (errno, "failed to allocate mount point");
+  mounts = m;
+  mounts[n_mounts].root = strndup (root, n);
+  if (!mounts[n_mounts].root)
+    die (errno, "failed to allocate mount point");
+  mounts[n_mounts].n_root = n;
+  n_mounts++;
+}
+
+/* Whether the paths are real, so that descriptors of directories and the
+   kernel's own copy calls can be used on them. */
+bool
+vfs_native (void)
+{
+  return backend == &posix_backend;
+}
+
+/* Reports a failure to open PATH the way x_opendir() does. */
+struct vfs_dir *
+vfs_opendir (const char *path)
+{
+  return backend->opendir (path);
+}
+
+struct dirent *
+vfs_readdir (struct vfs_dir *d, bool *error, const char *path)
+{
+  return backend->readdir (d, error, path);
+}
+
+void
+vfs_closedir (struct vfs_dir *d, const char *path)
+{
+  backend->closedir (d, path);
+}
+
+int
+vfs_stat (const char *path, struct stat *st)
+{
+  return backend->stat (path, st);
+}
+
+/* Like fstat(), but the mem backend answers for PATH, which FD was
+   opened from. */
+int
+vfs_fstat (int fd, const char *path, struct stat *st)
+{
+  return backend->fstat (fd, path, st);
+}
+
+int
+vfs_open (const char *path, int flags, mode_t mode)
+{
+  return backend->open (path, flags, mode);
+}
+
+int
+vfs_unlink (const char *path)
+{
+  return backend->unlink (path);
+}
+
+bool
+vfs_make_path (const char *path)
+{
+  return backend->make_path (path);
+}
@@ -0,0 +1,52 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COPY_VFS_H__
+#define __COPY_VFS_H__
+
+#include "copy-utils.h"
+
+/*
+ * The calls the scan, the directory walk and the file transfer make on
+ * the filesystem. The posix backend is the real thing; the mem backend
+ * (mem:SEED[:ENTRIES[:MAX_FILE_SIZE]]) makes up a tree of ENTRIES entries
+ * below every mounted source as it is walked, and throws away whatever is
+ * written anywhere else, so that traversal and bookkeeping can be measured
+ * on trees far bigger than any disk at hand.
+ */
+
+#define VFS_MEM_ENTRIES       1000000
+#define VFS_MEM_MAX_FILE_SIZE 4096
+
+struct vfs_dir;
+
+bool vfs_select (const char *spec);
+void vfs_mount (const char *root);
+bool vfs_native (void);
+struct vfs_dir *vfs_opendir (const char *path);
+struct dirent *vfs_readdir (struct vfs_dir *d, bool *error, const char *path);
+void vfs_closedir (struct vfs_dir *d, const char *path);
+int vfs_stat (const char *path, struct stat *st);
+int vfs_fstat (int fd, const char *path, struct stat *st);
+int vfs_open (const char *path, int flags, mode_t mode);
+int vfs_unlink (const char *path);
+bool vfs_make_path (const char *path);
+
+#endif /* __COPY_VFS_H__ */
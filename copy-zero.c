@@ -0,0 +1,142 @@
+/*
+ * copy - Copy files and directories
+ *
+ * Copyright (C) 2014 Nathan Forbes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "copy-config.h"
+#endif
+
+#include <string.h>
+
+#if defined (__x86_64__) || (defined (__i386__) && defined (__SSE2__))
+# define ZERO_X86 1
+# include <immintrin.h>
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+# define ZERO_NEON 1
+# include <arm_neon.h>
+#endif
+
+#include "copy-utils.h"
+#include "copy-zero.h"
+
+/* bytes looked at per iteration of the vector loops, which OR several
+   registers together before testing so the branch is taken rarely */
+#define ZERO_STRIDE 64
+
+typedef bool (*zero_block_func) (const char *p, size_t n);
+
+/* Whatever the vector loops leave over. The first byte being zero and
+   every byte being equal to the one after it means all of them are. */
+static bool
+zero_tail (const char *p, size_t n)
+{
+  return (n == 0) || ((*p == 0) && (memcmp (p, p + 1, n - 1) == 0));
+}
+
+#ifdef ZERO_X86
+static bool
+zero_block_sse2 (const char *p, size_t n)
+{
+  size_t x;
+  __m128i acc;
+
+  for (x = 0; (x + ZERO_STRIDE) <= n; x += ZERO_STRIDE)
+  {
+    acc = _mm_or_si128 (
+        _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) (p + x)),
+                      _mm_loadu_si128 ((const __m128i *) (p + x + 16))),
+        _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) (p + x + 32)),
+                      _mm_loadu_si128 ((const __m128i *) (p + x + 48))));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (acc, _mm_setzero_si128 ())) !=
+        0xffff)
+      return false;
+  }
+  return zero_tail (p + x, n - x);
+}
+
+__attribute__ ((target ("avx2")))
+static bool
+zero_block_avx2 (const char *p, size_t n)
+{
+  size_t x;
+  __m256i acc;
+
+  for (x = 0; (x + (ZERO_STRIDE * 2)) <= n; x += (ZERO_STRIDE * 2))
+  {
+    acc = _mm256_or_si256 (
+        _mm256_or_si256 (
+            _mm256_loadu_si256 ((const __m256i *) (p + x)),
+            _mm256_loadu_si256 ((const __m256i *) (p + x + 32))),
+        _mm256_or_si256 (
+            _mm256_loadu_si256 ((const __m256i *) (p + x + 64)),
+            _mm256_loadu_si256 ((const __m256i *) (p + x + 96))));
+    if (!_mm256_testz_si256 (acc, acc))
+      return false;
+  }
+  return zero_block_sse2 (p + x, n - x);
+}
+#endif
+
+#ifdef ZERO_NEON
+static bool
+zero_block_neon (const char *p, size_t n)
+{
+  size_t x;
+  uint8x16_t acc;
+
+  for (x = 0; (x + ZERO_STRIDE) <= n; x += ZERO_STRIDE)
+  {
+    acc = vorrq_u8 (
+        vorrq_u8 (vld1q_u8 ((const uint8_t *) (p + x)),
+                  vld1q_u8 ((const uint8_t *) (p + x + 16))),
+        vorrq_u8 (vld1q_u8 ((const uint8_t *) (p + x + 32)),
+                  vld1q_u8 ((const uint8_t *) (p + x + 48))));
+    if (vmaxvq_u8 (acc) != 0)
+      return false;
+  }
+  return zero_tail (p + x, n - x);
+}
+#endif
+
+static zero_block_func
+zero_block_select (void)
+{
+#ifdef ZERO_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return zero_block_avx2;
+  return zero_block_sse2;
+#elif defined (ZERO_NEON)
+  return zero_block_neon;
+#else
+  return zero_tail;
+#endif
+}
+
+/* Returns true if all N bytes at P are zero, using the widest vectors the
+   CPU has. */
+bool
+zero_block (const char *p, size_t n)
+{
+  static zero_block_func func = NULL;
+
+  /* every thread would pick the same one, so the race is harmless */
+  if (!func)
+    func = zero_block_select ();
+  return func (p, n);
+}
@@ -21,25 +21,58 @@
 # include "copy-config.h"
 #endif
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
-
-#ifdef ENABLE_SOUND
-# include "SDL/SDL.h"
-# include "SDL/SDL_sound.h"
-#endif
+#include <time.h>
+#include <unistd.h>
 
 #include "copy-checksum.h"
+#include "copy-control.h"
+#include "copy-engine.h"
+#include "copy-errors.h"
+#include "copy-filter.h"
+#include "copy-journal.h"
+#include "copy-manifest.h"
+#include "copy-metrics.h"
+#include "copy-move.h"
+#include "copy-notify.h"
+#include "copy-pool.h"
+#include "copy-probe.h"
+#include "copy-scan.h"
+#include "copy-skeleton.h"
+#include "copy-stats.h"
+#include "copy-uring.h"
 #include "copy-progress.h"
+#include "copy-publish.h"
 #include "copy-utils.h"
+#include "copy-verify.h"
+#include "copy-vfs.h"
 
 #define CHUNK_SIZE 4000
 
-#ifdef ENABLE_SOUND
-# define SOUND_PATH SOUNDSDIR DIR_SEPARATOR_S SOUNDFILE
-#endif
+/* files waiting for a worker, per worker */
+#define JOB_QUEUE 4
+
+/* a cancelled file with no more than this left is finished, not undone */
+#define CANCEL_FINISH_BYTES BYTE_C (16000000)
+
+/* times a file that changed while it was copied is copied again, and the
+   pause (in milliseconds) before the first of those, doubled each time */
+#define CHANGE_RETRIES     3
+#define CHANGE_RETRY_DELAY 100
+
+/* how a single transfer ended */
+enum
+{
+  TRANSFER_DONE,
+  TRANSFER_FAILED,
+  TRANSFER_CANCELLED,
+  TRANSFER_CHANGED
+};
 
 enum
 {
@@ -54,22 +87,41 @@ enum
 enum
 {
   NO_PROGRESS_OPTION = CHAR_MAX + 1,
-  NO_REPORT_OPTION
+  NO_REPORT_OPTION,
+  EXCLUDE_OPTION,
+  INCLUDE_OPTION,
+  FILTER_FILE_OPTION,
+  MIN_SIZE_OPTION,
+  MAX_SIZE_OPTION,
+  NEWER_THAN_OPTION,
+  OLDER_THAN_OPTION,
+  JOURNAL_OPTION,
+  RESUME_OPTION,
+  ERROR_LOG_OPTION,
+  RETRY_OPTION,
+  ENGINE_OPTION,
+  PROBE_OPTION,
+  SPARSE_OPTION,
+  WRITE_MANIFEST_OPTION,
+  MANIFEST_OPTION,
+  SCAN_THREADS_OPTION,
+  URING_OPTION,
+  PROGRESS_LINES_OPTION,
+  METRICS_FILE_OPTION,
+  METRICS_INTERVAL_OPTION,
+  JOB_NAME_OPTION,
+  STATS_OPTION,
+  VFS_OPTION,
+  VERIFY_THREADS_OPTION,
+  NOTIFY_CMD_OPTION,
+  NOTIFY_SOCKET_OPTION,
+  PUBLISH_ATOMIC_OPTION,
+  CHANGE_RETRIES_OPTION
 #ifdef ENABLE_SOUND
   , NO_SOUND_OPTION
 #endif
 };
 
-#ifdef ENABLE_SOUND
-struct sound_data
-{
-  Uint32 decoded_bytes;
-  SDL_AudioSpec device_format;
-  Uint8 *decoded_ptr;
-  Sound_Sample *sample;
-};
-#endif
-
 /* global variables */
 const char *          program_name;
 size_t                total_sources          =                        0;
@@ -78,33 +130,109 @@ byte_t                so_far_bytes           =               BYTE_C (0);
 double                update_interval        = PROGRESS_UPDATE_INTERVAL;
 
 /* local variables */
-#ifdef ENABLE_SOUND
-static bool           playing_sound          =                     true;
-static volatile int   sound_done             =                        0;
-#endif
 static bool           showing_progress       =                     true;
+static bool           showing_lines          =                    false;
 static bool           showing_report         =                     true;
+static bool           showing_stats          =                    false;
 static bool           preserving_ownership   =                    false;
 static bool           preserving_permissions =                    false;
 static bool           preserving_timestamp   =                    false;
 static bool           verifying_checksums    =                    false;
+static struct verify_config verify_config;
+static bool           moving_sources         =                    false;
+static bool           keeping_going          =                    false;
+static bool           failing                =                    false;
+static const char *   error_log_path         =                     NULL;
 static size_t         chunk_size             =               CHUNK_SIZE;
-static void *         chunk                  =                     NULL;
+static bool           chunk_size_given       =                    false;
+static pthread_key_t  chunk_key;
+static size_t         n_chunk                =                        0;
+static int            transfer_engine        =                       -1;
+static int            current_engine         =             ENGINE_STDIO;
+static bool           writing_sparse         =                    false;
+static byte_t         sparsified_bytes       =               BYTE_C (0);
+static const char *   manifest_out_path      =                     NULL;
+static size_t         manifest_out_source    =                        0;
+static struct manifest_writer *manifest_out  =                     NULL;
+static size_t         scan_threads           =             SCAN_THREADS;
+static size_t         jobs                   =                        1;
+static bool           using_uring            =                    false;
+static bool           publishing_atomic      =                    false;
+static unsigned int   change_retries         =           CHANGE_RETRIES;
+static struct uring * ring                   =                     NULL;
+static size_t         n_ring_batch           =                        0;
+static struct uring_file ring_batch[URING_FILES];
+static struct stat    ring_batch_st[URING_FILES];
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct timeval start_time;
+static struct timeval notify_begun;
+static bool           notify_pending         =                    false;
+static byte_t         transferred_bytes      =               BYTE_C (0);
+static size_t         transferred_files      =                        0;
+static byte_t         skipped_bytes          =               BYTE_C (0);
+static size_t         retried_entries        =                        0;
+static size_t         changed_recopies       =                        0;
+static size_t         changing_files         =                        0;
+static size_t         files_in_flight        =                        0;
+static size_t         queued_jobs            =                        0;
+static const char *   metrics_path           =                     NULL;
+static double         metrics_interval       =         METRICS_INTERVAL;
+static const char *   job_name               =                   "copy";
+static const char *   journal_path           =                     NULL;
+static const char *   resume_path            =                     NULL;
+static bool           journal_written        =                    false;
+static const char **  journal_src_paths      =                     NULL;
+static const char **  journal_rpaths         =                     NULL;
+static size_t         current_item           =                        0;
+static bool           resuming_item          =                    false;
+static char           default_journal_path[PATH_BUFMAX];
 static char           directory_transfer_source_root[PATH_BUFMAX];
+static size_t         directory_transfer_source_root_length;
 static char           directory_transfer_destination_root[PATH_BUFMAX];
 
 static struct option const options[] =
 {
   {"chunk-size", required_argument, NULL, 'c'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"keep-going", no_argument, NULL, 'k'},
+  {"move", no_argument, NULL, 'm'},
   {"preserve-ownership", no_argument, NULL, 'o'},
   {"preserve-permissions", no_argument, NULL, 'p'},
   {"preserve-all", no_argument, NULL, 'P'},
   {"preserve-timestamp", no_argument, NULL, 't'},
   {"update-interval", required_argument, NULL, 'u'},
-  {"verify", no_argument, NULL, 'V'},
+  {"verify", optional_argument, NULL, 'V'},
   {"no-progress", no_argument, NULL, NO_PROGRESS_OPTION},
   {"no-report", no_argument, NULL, NO_REPORT_OPTION},
+  {"exclude", required_argument, NULL, EXCLUDE_OPTION},
+  {"include", required_argument, NULL, INCLUDE_OPTION},
+  {"filter-file", required_argument, NULL, FILTER_FILE_OPTION},
+  {"min-size", required_argument, NULL, MIN_SIZE_OPTION},
+  {"max-size", required_argument, NULL, MAX_SIZE_OPTION},
+  {"newer-than", required_argument, NULL, NEWER_THAN_OPTION},
+  {"older-than", required_argument, NULL, OLDER_THAN_OPTION},
+  {"journal", required_argument, NULL, JOURNAL_OPTION},
+  {"resume", required_argument, NULL, RESUME_OPTION},
+  {"error-log", required_argument, NULL, ERROR_LOG_OPTION},
+  {"retry", required_argument, NULL, RETRY_OPTION},
+  {"engine", required_argument, NULL, ENGINE_OPTION},
+  {"probe", no_argument, NULL, PROBE_OPTION},
+  {"sparse", required_argument, NULL, SPARSE_OPTION},
+  {"write-manifest", required_argument, NULL, WRITE_MANIFEST_OPTION},
+  {"manifest", required_argument, NULL, MANIFEST_OPTION},
+  {"scan-threads", required_argument, NULL, SCAN_THREADS_OPTION},
+  {"uring", no_argument, NULL, URING_OPTION},
+  {"progress-lines", no_argument, NULL, PROGRESS_LINES_OPTION},
+  {"metrics-file", required_argument, NULL, METRICS_FILE_OPTION},
+  {"metrics-interval", required_argument, NULL, METRICS_INTERVAL_OPTION},
+  {"job-name", required_argument, NULL, JOB_NAME_OPTION},
+  {"stats", no_argument, NULL, STATS_OPTION},
+  {"vfs", required_argument, NULL, VFS_OPTION},
+  {"verify-threads", required_argument, NULL, VERIFY_THREADS_OPTION},
+  {"notify-cmd", required_argument, NULL, NOTIFY_CMD_OPTION},
+  {"notify-socket", required_argument, NULL, NOTIFY_SOCKET_OPTION},
+  {"publish-atomic", no_argument, NULL, PUBLISH_ATOMIC_OPTION},
+  {"change-retries", required_argument, NULL, CHANGE_RETRIES_OPTION},
 #ifdef ENABLE_SOUND
   {"no-sound", no_argument, NULL, NO_SOUND_OPTION},
 #endif
@@ -128,6 +256,25 @@ help_display_opts[] =
     "written during copy operations to SIZE bytes. The default for this "
     "value is 4000 bytes (4kB)."
   },
+  {
+    'j', "jobs", "N",
+    "Copy up to N files of a source directory at once, each in a thread of "
+    "its own. All directories are created before any file is copied, so "
+    "the files may finish in any order. Moves (-m) and --resume copy one "
+    "file at a time. The default is 1."
+  },
+  {
+    'k', "keep-going", NULL,
+    "Keep copying everything else when a file or directory cannot be "
+    "copied instead of stopping at the first error. All errors are listed "
+    "at the end and the exit status is non-zero."
+  },
+  {
+    'm', "move", NULL,
+    "Move the sources instead of copying them. Sources on the same "
+    "filesystem as the destination are simply renamed. Otherwise they are "
+    "copied, synced to disk and verified before they are removed."
+  },
   {
     'o', "preserve-ownership", NULL, "Preserve ownership."
   },
@@ -150,17 +297,210 @@ help_display_opts[] =
     'V', "verify", NULL,
     "Perform an MD5 checksum verification after all copy operations are "
     "finished to ensure integrity of the files. Note that using this option "
-    "may take considerably more time to complete."
+    "may take considerably more time to complete. With --verify=compare "
+    "the bytes of every file and its copy are compared directly instead, "
+    "which is cheaper when both are local, and the first byte that differs "
+    "is reported. Directories are verified file by file, with up to N "
+    "files at once with -j. With --verify=sample:P[:SEED] only blocks "
+    "picked at random (but the same for the same SEED) are compared, "
+    "enough of them to catch a copy with 0.1% of its blocks damaged with "
+    "probability P (like 0.99 or 99%), and every file is checked for its "
+    "size. The report gives the confidence that was reached. With "
+    "--verify=tree every file and its copy get a tree checksum: the MD5 of "
+    "the MD5s of each megabyte, which several threads work out at once."
+  },
+  {
+    0, "verify-threads", "N",
+    "Read each file with up to N threads when verifying with "
+    "--verify=compare or --verify=tree, so that huge files are verified as "
+    "fast as the cores and the storage allow. The default is the number of "
+    "CPUs."
+  },
+  {
+    0, "vfs", "BACKEND",
+    "Where the files come from. `posix' (the default) is the real "
+    "filesystem. `mem[:SEED[:ENTRIES[:MAX_FILE_SIZE]]]' makes up a tree of "
+    "ENTRIES files and directories (a million by default) below each "
+    "SOURCE as it is walked, with file sizes of up to MAX_FILE_SIZE bytes "
+    "(4096 by default) picked from SEED, and writes nothing at all, for "
+    "measuring the cost of walking and bookkeeping on huge trees."
   },
   {
     0, "no-progress", NULL,
     "Do not show any progress updates during copy operations."
   },
+  {
+    0, "progress-lines", NULL,
+    "Show a line for each job above the progress bar with the file it is "
+    "copying and how fast. Only when the output is a terminal."
+  },
+  {
+    0, "metrics-file", "FILE",
+    "Write metrics of the copy to FILE for the textfile collector of the "
+    "Prometheus node_exporter: bytes and files copied, bytes skipped, "
+    "errors, retries, throughput, files in flight, queue depths and the "
+    "time spent in each phase. FILE is replaced atomically every interval "
+    "and once more at the end."
+  },
+  {
+    0, "metrics-interval", "SECONDS",
+    "Rewrite the metrics file every SECONDS seconds. The default is 10."
+  },
+  {
+    0, "job-name", "NAME",
+    "Label the metrics with job_name=\"NAME\". The default is `copy'."
+  },
   {
     0, "no-report", NULL,
     "Do not show completion report after all copy operations are "
     "finished."
   },
+  {
+    0, "stats", NULL,
+    "Add what the copy cost the system to the completion report: CPU "
+    "time, context switches, page faults and peak memory, how much was "
+    "read and written against how much of that went to storage rather "
+    "than the page cache, and how much the page cache grew."
+  },
+  {
+    0, "exclude", "PATTERN",
+    "Do not copy files or directories inside a source directory that match "
+    "PATTERN. Patterns follow .gitignore rules: `*' does not match `/', "
+    "`**' does, a trailing `/' only matches directories, and a pattern "
+    "containing any other `/' is matched against the whole path relative "
+    "to the source directory instead of just the name. Excluded directories "
+    "are never entered. When several patterns match, the last one given "
+    "wins."
+  },
+  {
+    0, "include", "PATTERN",
+    "Copy whatever matches PATTERN even if an earlier --exclude pattern "
+    "matched it."
+  },
+  {
+    0, "filter-file", "FILE",
+    "Read exclude patterns from FILE, one per line, like a .gitignore file. "
+    "Lines starting with `!' are include patterns and lines starting with "
+    "`#' are ignored."
+  },
+  {
+    0, "min-size", "SIZE",
+    "Only copy files inside a source directory that are at least SIZE "
+    "bytes. SIZE may end in K, M, G, T, P or E (powers of 1000)."
+  },
+  {
+    0, "max-size", "SIZE",
+    "Only copy files inside a source directory that are at most SIZE "
+    "bytes."
+  },
+  {
+    0, "newer-than", "TIME",
+    "Only copy files inside a source directory that were modified after "
+    "TIME. TIME is either a date (YYYY-MM-DD [HH:MM[:SS]]) or an age such "
+    "as 30m, 12h, 1d or 2w (seconds if there is no suffix)."
+  },
+  {
+    0, "older-than", "TIME",
+    "Only copy files inside a source directory that were modified before "
+    "TIME."
+  },
+  {
+    0, "journal", "FILE",
+    "Write the resume journal to FILE instead of next to the destination "
+    "(DESTINATION.copy-journal). The journal is written when the copy is "
+    "paused with SIGTSTP (Ctrl-Z) or cancelled with SIGINT (Ctrl-C) or "
+    "SIGTERM, after the file in flight has been flushed, or finished or "
+    "rolled back."
+  },
+  {
+    0, "resume", "FILE",
+    "Resume the copy recorded in the journal FILE, skipping whatever was "
+    "already finished. No SOURCE or DESTINATION may be given."
+  },
+  {
+    0, "error-log", "FILE",
+    "Write every error (the step it happened in, the error number and the "
+    "source and destination paths) to FILE, to be used with --retry."
+  },
+  {
+    0, "retry", "FILE",
+    "Copy again only the entries that failed in the error log FILE, "
+    "without scanning the rest of the sources. No SOURCE or DESTINATION may "
+    "be given."
+  },
+  {
+    0, "engine", "NAME",
+    "Copy the data of files with the NAME engine: stdio, rw, "
+    "copy_file_range, splice, mmap or direct (O_DIRECT). The default, auto, "
+    "uses whatever --probe found fastest for the filesystems involved and "
+    "stdio otherwise."
+  },
+  {
+    0, "probe", NULL,
+    "Time every engine and buffer size copying a scratch file from the "
+    "SOURCE directory to the DESTINATION directory, and cache the fastest "
+    "for that pair of filesystems in ~/.cache/copy/engines. mmap is left "
+    "out, since a source truncated while mapped kills the copy."
+  },
+  {
+    0, "sparse", "WHEN",
+    "With `always', blocks of zeros in the files are not written but left "
+    "as holes in the copies, even if the sources are stored dense. With "
+    "`never' (the default) everything is written."
+  },
+  {
+    0, "write-manifest", "FILE",
+    "Only scan the sources and write what would be copied (with sizes, "
+    "times, modes and owners) to the binary manifest FILE, without copying "
+    "anything."
+  },
+  {
+    0, "manifest", "FILE",
+    "Copy what the manifest FILE lists without scanning the sources again. "
+    "No SOURCE or DESTINATION may be given."
+  },
+  {
+    0, "scan-threads", "N",
+    "Scan the source directories with N threads, which keeps many stat "
+    "calls in flight on network filesystems. With 0 the scan runs in the "
+    "main thread. The default is 8."
+  },
+  {
+    0, "uring", NULL,
+    "Copy small files in batches through io_uring, opening, reading, "
+    "writing and closing dozens of them with a single system call. Kernels "
+    "without it (or older than 5.15) use the regular path."
+  },
+  {
+    0, "change-retries", "N",
+    "Copy a file again, up to N times, when its size, modification time or "
+    "change time differ after its copy from before it, pausing 0.1 "
+    "seconds before the first retry and twice as long before each next "
+    "one. A file still changing after that is kept as copied and recorded "
+    "in the error log. The default is 3; 0 only records it."
+  },
+  {
+    0, "publish-atomic", NULL,
+    "Copy each destination into a hidden sibling first and swap it with "
+    "the live one in a single rename once everything is copied (and "
+    "verified), so readers see the old tree or the new one but never a "
+    "mix. The old tree is removed in the background. Nothing is published "
+    "if the copy fails or is cancelled; --resume publishes a cancelled one "
+    "when it completes."
+  },
+  {
+    0, "notify-cmd", "COMMAND",
+    "Run COMMAND with the shell when the copy finishes, is cancelled or "
+    "fails, with COPY_STATUS (done, failed or cancelled), COPY_BYTES, "
+    "COPY_FILES, COPY_ERRORS and COPY_SECONDS in its environment. The "
+    "command runs detached, so the program does not wait for it."
+  },
+  {
+    0, "notify-socket", "PATH",
+    "Send one line describing the outcome (status, bytes, files, errors "
+    "and seconds) to the unix socket at PATH when the copy ends. If no "
+    "one is listening, a warning is printed and the copy is unaffected."
+  },
 #ifdef ENABLE_SOUND
   {
     0, "no-sound", NULL,
@@ -325,225 +665,485 @@ version (void)
   exit (EXIT_SUCCESS);
 }
 
-#ifdef ENABLE_SOUND
 static void
-sound_callback (void *data, Uint8 *stream, int len)
+set_directory_transfer_source_root (const char *src)
 {
-  int size;
-  int written;
-  struct sound_data *p;
+  directory_transfer_source_root[0] = '\0';
+  directory_transfer_source_root_length = strlen (src);
+  memcpy (directory_transfer_source_root, src,
+          directory_transfer_source_root_length + 1);
+}
 
-  size = 0;
-  p = (struct sound_data *) data;
+static void
+set_directory_transfer_destination_root (const char *dst)
+{
+  directory_transfer_destination_root[0] = '\0';
+  memcpy (directory_transfer_destination_root, dst, strlen (dst) + 1);
+}
 
-  while (size < len)
-  {
-    if (p->decoded_bytes == 0)
-    {
-      if (((p->sample->flags & SOUND_SAMPLEFLAG_ERROR) == 0) &&
-          ((p->sample->flags & SOUND_SAMPLEFLAG_EOF) == 0))
-      {
-        p->decoded_bytes = Sound_Decode (p->sample);
-        p->decoded_ptr = p->sample->buffer;
-      }
-      if (p->decoded_bytes == 0)
-      {
-        memset (stream + size, 0, len - size);
-        sound_done = 1;
-        return;
-      }
-    }
-    written = len - size;
-    if (written > p->decoded_bytes)
-      written = p->decoded_bytes;
-    if (written > 0)
-    {
-      memcpy (stream + size, (Uint8 *) p->decoded_ptr, written);
-      size += written;
-      p->decoded_ptr += written;
-      p->decoded_bytes -= written;
-    }
-  }
+/* Records a failure in the error log. Without --keep-going that is where
+   the copy ends: right away on the main thread, while a worker only marks
+   it, so that the others stop taking work and the main thread exits once
+   they are done (see stop_if_failing()). */
+static void
+record_failure (int phase,
+                int errnum,
+                const char *src_path,
+                const char *dst_path)
+{
+  error_log_add (phase, errnum, src_path, dst_path);
+  if (keeping_going)
+    return;
+  if (on_main_thread ())
+    exit (EXIT_FAILURE);
+  __atomic_store_n (&failing, true, __ATOMIC_RELAXED);
+}
+
+static bool
+failure_recorded (void)
+{
+  return __atomic_load_n (&failing, __ATOMIC_RELAXED);
 }
 
+/* Exits on the main thread after the workers, one of which recorded a
+   failure without --keep-going, have all finished. */
 static void
-get_sound_file_path (char *buffer)
+stop_if_failing (void)
 {
-  struct stat s;
+  if (failure_recorded ())
+    exit (EXIT_FAILURE);
+}
 
-  *buffer = '\0';
-  memset (&s, 0, sizeof (struct stat));
+/* Checks a directory entry against the include/exclude filters before it
+   is opened, and before it is even stat'ed when the directory entry tells
+   whether it is a directory. */
+static bool
+entry_excluded (const char *child_path, size_t n_root, struct dirent *ep)
+{
+  bool is_dir;
+  struct stat st;
 
-  if ((stat (SOUNDFILE, &s) == 0) && S_ISREG (s.st_mode))
-    memcpy (buffer, SOUNDFILE, strlen (SOUNDFILE) + 1);
+  if (!filter_active ())
+    return false;
+  if (ep->d_type == DT_DIR)
+    is_dir = true;
+  else if (ep->d_type == DT_REG)
+    is_dir = false;
   else
+    is_dir = (vfs_stat (child_path, &st) == 0) && S_ISDIR (st.st_mode);
+  return filter_excluded (child_path + n_root + 1, is_dir);
+}
+
+static void
+scan_found (const char *path,
+            size_t n_root,
+            const struct stat *st,
+            void *data)
+{
+  byte_t *size;
+
+  size = (byte_t *) data;
+  if (S_ISDIR (st->st_mode))
   {
-    memset (&s, 0, sizeof (struct stat));
-    if ((stat (SOUND_PATH, &s) == 0) && S_ISREG (s.st_mode))
-      memcpy (buffer, SOUND_PATH, strlen (SOUND_PATH) + 1);
+    if (manifest_out)
+      manifest_writer_add (manifest_out, manifest_out_source,
+                           path + n_root + 1, st);
   }
+  else if (!filter_skipped (st))
+  {
+    *size += (byte_t) st->st_size;
+    if (manifest_out && S_ISREG (st->st_mode))
+      manifest_writer_add (manifest_out, manifest_out_source,
+                           path + n_root + 1, st);
+  }
+  else if (S_ISREG (st->st_mode))
+    __atomic_add_fetch (&skipped_bytes, (byte_t) st->st_size,
+                        __ATOMIC_RELAXED);
 }
 
 static void
-play_sound (void)
+scan_failed (const char *path, int errnum)
 {
-  struct sound_data data;
-  char path[PATH_BUFMAX];
+  record_failure (PHASE_SCAN, errnum, path, NULL);
+}
 
-  get_sound_file_path (path);
-  if (!*path)
-    return;
+/* Adds the sizes of the files below PATH to SIZE (and them to the
+   manifest being written, if any). */
+static void
+directory_content_size (const char *path, size_t n_root, byte_t *size)
+{
+  struct scan_ops ops;
+
+  ops.excluded = entry_excluded;
+  ops.found = scan_found;
+  ops.failed = scan_failed;
+  ops.data = size;
+  scan_tree (path, n_root, scan_threads, &ops);
+  stop_if_failing ();
+}
 
-  memset (&data, 0, sizeof (struct sound_data));
-  data.sample = Sound_NewSampleFromFile (path, NULL, 65536);
+static void
+write_journal (void)
+{
+  if (journal_write (journal_path, journal_src_paths, journal_rpaths,
+                     total_sources, current_item))
+    journal_written = true;
+}
 
-  if (!data.sample)
-    return;
+/* Called between chunks of a transfer. A pause request is honored right
+   here, once what was written so far is on disk and the journal reflects
+   it. Returns false if the copy has been cancelled. */
+static bool
+transfer_checkpoint (struct engine_transfer *t, const char *dst_path)
+{
+  if (control_pause_requested ())
+  {
+    /* with several jobs, the first one to get here does the pausing */
+    pthread_mutex_lock (&pause_lock);
+    if (control_pause_requested ())
+    {
+      if (!engine_sync (t))
+        x_error (errno, "failed to sync `%s'", dst_path);
+      write_journal ();
+      if (showing_progress)
+        fputc ('\n', stdout);
+      printf ("Paused -- continue with SIGCONT (or `fg')\n");
+      fflush (stdout);
+      control_pause ();
+      printf ("Resumed\n");
+      fflush (stdout);
+    }
+    pthread_mutex_unlock (&pause_lock);
+  }
+  return !control_cancel_requested ();
+}
+
+/* When resuming, a destination file with the full size of its source was
+   finished before the interruption. */
+static bool
+already_transferred (const char *src_path, const char *dst_path)
+{
+  struct stat src_st;
+  struct stat dst_st;
 
-  data.device_format.freq = data.sample->actual.rate;
-  data.device_format.format = data.sample->actual.format;
-  data.device_format.channels = data.sample->actual.channels;
-  data.device_format.samples = 4096;
-  data.device_format.callback = sound_callback;
-  data.device_format.userdata = &data;
+  if (!resuming_item ||
+      (vfs_stat (src_path, &src_st) != 0) ||
+      (vfs_stat (dst_path, &dst_st) != 0) ||
+      !S_ISREG (dst_st.st_mode) ||
+      (src_st.st_size != dst_st.st_size))
+    return false;
+  __atomic_add_fetch (&skipped_bytes, (byte_t) src_st.st_size,
+                      __ATOMIC_RELAXED);
+  if (showing_progress)
+    progress_update ((byte_t) src_st.st_size);
+  return true;
+}
 
-  if (SDL_OpenAudio (&data.device_format, NULL) < 0)
+/* Picks the engine and buffer size for copying SRC_PATH to DST_PATH. */
+static void
+select_engine (const char *src_path, const char *dst_path)
+{
+  int engine;
+  size_t buffer_size;
+  size_t cached_size;
+  char dst_dir[PATH_BUFMAX];
+
+  current_engine = transfer_engine;
+  buffer_size = chunk_size;
+  if (transfer_engine == -1)
   {
-    Sound_FreeSample (data.sample);
-    return;
+    current_engine = ENGINE_STDIO;
+    dir_name (dst_dir, dst_path);
+    if (vfs_native () &&
+        probe_lookup (src_path, dst_dir, &engine, &cached_size) &&
+        engine_automatic (engine))
+    {
+      current_engine = engine;
+      if (!chunk_size_given)
+        buffer_size = cached_size;
+    }
   }
 
-  SDL_PauseAudio (0);
+  n_chunk = buffer_size;
+}
+
+struct chunk
+{
+  void *data;
+  size_t size;
+};
 
-  sound_done = 0;
-  while (!sound_done)
-    SDL_Delay (10);
+static void
+chunk_free (void *data)
+{
+  struct chunk *c;
 
-  SDL_PauseAudio (1);
-  SDL_Delay (2 * 1000 * data.device_format.samples / data.device_format.freq);
-  Sound_FreeSample (data.sample);
-  SDL_CloseAudio ();
+  c = (struct chunk *) data;
+  free (c->data);
+  free (c);
 }
-#endif
 
-static void
-set_directory_transfer_source_root (const char *src)
+/* Every thread that copies files has a data chunk of its own, of the size
+   picked for the current source. Returns NULL if it cannot be allocated. */
+static struct chunk *
+thread_chunk (void)
 {
-  directory_transfer_source_root[0] = '\0';
-  memcpy (directory_transfer_source_root, src, strlen (src) + 1);
+  struct chunk *c;
+
+  c = (struct chunk *) pthread_getspecific (chunk_key);
+  if (!c)
+  {
+    c = calloc (1, sizeof (struct chunk));
+    if (!c)
+      return NULL;
+    pthread_setspecific (chunk_key, c);
+  }
+  if (c->size != n_chunk)
+  {
+    free (c->data);
+    c->size = 0;
+    c->data = malloc (n_chunk);
+    if (!c->data)
+      return NULL;
+    c->size = n_chunk;
+  }
+  return c;
 }
 
-static void
-set_directory_transfer_destination_root (const char *dst)
+struct file_transfer
 {
-  directory_transfer_destination_root[0] = '\0';
-  memcpy (directory_transfer_destination_root, dst, strlen (dst) + 1);
+  const char *dst_path;
+  int line;
+  bool finishing;
+  byte_t bytes_done;
+};
+
+static bool
+transfer_chunk (struct engine_transfer *t, size_t bytes)
+{
+  struct file_transfer *ft;
+
+  ft = (struct file_transfer *) t->data;
+  ft->bytes_done += bytes;
+  __atomic_add_fetch (&transferred_bytes, bytes, __ATOMIC_RELAXED);
+  if (showing_progress)
+    progress_file_update (ft->line, bytes);
+  if (ft->finishing || transfer_checkpoint (t, ft->dst_path))
+    return true;
+  if ((t->size > ft->bytes_done) &&
+      ((t->size - ft->bytes_done) > CANCEL_FINISH_BYTES))
+    return false;
+  ft->finishing = true;
+  return true;
 }
 
-static void
-directory_content_size (const char *path, byte_t *size)
+/* Whether the source is still the same version it was when its copy
+   began. */
+static bool
+same_version (const struct stat *before, const struct stat *after)
 {
-  bool err;
-  size_t n_child;
-  size_t n_path;
-  size_t n_name;
-  struct stat st;
-  DIR *dp;
-  struct dirent *ep;
+  return (before->st_size == after->st_size) &&
+         (before->st_mtim.tv_sec == after->st_mtim.tv_sec) &&
+         (before->st_mtim.tv_nsec == after->st_mtim.tv_nsec) &&
+         (before->st_ctim.tv_sec == after->st_ctim.tv_sec) &&
+         (before->st_ctim.tv_nsec == after->st_ctim.tv_nsec);
+}
 
-  dp = opendir (path);
-  if (!dp)
-    die (errno, "failed to open directory -- `%s'", path);
+/* A file that could not be copied is recorded in the error log, which does
+   not stop anything with --keep-going. When the copy is cancelled DST_PATH
+   is rolled back unless it was nearly done. A source that changed while it
+   was copied gives TRANSFER_CHANGED, unless this is the LAST try, which
+   keeps the copy and records it as changing. */
+static int
+transfer_file_once (const char *src_path,
+                    const char *dst_path,
+                    bool last)
+{
+  bool copied;
+  bool watching;
+  bool changed;
+  int failed_phase;
+  int failed_errno;
+  int src_fd;
+  int dst_fd;
+  struct stat src_st;
+  struct stat end_st;
+  struct chunk *c;
+  struct engine_transfer t;
+  struct file_transfer ft;
+
+  src_fd = vfs_open (src_path, O_RDONLY, 0);
+  if (src_fd == -1)
+  {
+    x_error (errno, "failed to open file `%s'", src_path);
+    record_failure (PHASE_OPEN, errno, src_path, dst_path);
+    return TRANSFER_FAILED;
+  }
 
-  n_path = strlen (path);
-  for (;;)
+  dst_fd = vfs_open (dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (dst_fd == -1)
   {
-    ep = x_readdir (dp, &err, path);
-    if (!ep)
-    {
-      if (err)
-      {
-        x_closedir (dp, path);
-        exit (EXIT_FAILURE);
-      }
-      break;
-    }
-    if (streq (ep->d_name, ".", true) || streq (ep->d_name, "..", true))
-      continue;
-    n_name = strlen (ep->d_name);
-    n_child = n_path + n_name + 1;
-    char child[n_child + 1];
-    memcpy (child, path, n_path);
-    child[n_path] = DIR_SEPARATOR_C;
-    memcpy (child + (n_path + 1), ep->d_name, n_name);
-    child[n_child] = '\0';
-    memset (&st, 0, sizeof (struct stat));
-    if (stat (child, &st) == 0)
+    failed_errno = errno;
+    x_error (failed_errno, "failed to open file `%s'", dst_path);
+    close (src_fd);
+    record_failure (PHASE_OPEN, failed_errno, src_path, dst_path);
+    return TRANSFER_FAILED;
+  }
+
+  c = thread_chunk ();
+  if (!c)
+  {
+    failed_errno = errno;
+    x_error (failed_errno, "failed to initialize data chunk for transfers");
+    close (src_fd);
+    close (dst_fd);
+    (void) vfs_unlink (dst_path);
+    record_failure (PHASE_READ, failed_errno, src_path, dst_path);
+    return TRANSFER_FAILED;
+  }
+
+  memset (&src_st, 0, sizeof (struct stat));
+  watching = (vfs_fstat (src_fd, src_path, &src_st) == 0);
+
+  ft.dst_path = dst_path;
+  ft.finishing = false;
+  ft.bytes_done = BYTE_C (0);
+  memset (&t, 0, sizeof (struct engine_transfer));
+  t.src_fd = src_fd;
+  t.dst_fd = dst_fd;
+  t.size = (byte_t) src_st.st_size;
+  t.buffer = c->data;
+  t.buffer_size = c->size;
+  t.chunk_func = transfer_chunk;
+  t.data = &ft;
+  t.sparse = writing_sparse;
+
+  failed_phase = -1;
+  failed_errno = 0;
+  ft.line = showing_progress ? progress_file_start (src_path, t.size) : -1;
+  __atomic_add_fetch (&files_in_flight, 1, __ATOMIC_RELAXED);
+  copied = engine_run (current_engine, &t);
+  __atomic_sub_fetch (&files_in_flight, 1, __ATOMIC_RELAXED);
+  progress_file_finish (ft.line);
+  if (!copied)
+  {
+    if (t.failed_phase == -1)
     {
-      if (S_ISDIR (st.st_mode))
-        directory_content_size (child, size);
-      else
-        *size += (byte_t) st.st_size;
+      close (src_fd);
+      close (dst_fd);
+      if (vfs_unlink (dst_path) != 0)
+        x_error (errno, "failed to remove partial copy `%s'", dst_path);
+      __atomic_sub_fetch (&transferred_bytes, ft.bytes_done,
+                          __ATOMIC_RELAXED);
+      return TRANSFER_CANCELLED;
     }
+    failed_phase = t.failed_phase;
+    failed_errno = t.failed_errno;
+    if (failed_phase == PHASE_READ)
+      x_error (failed_errno, "failed to read `%s'", src_path);
+    else
+      x_error (failed_errno, "failed to write `%s'", dst_path);
   }
-  x_closedir (dp, path);
-}
 
-static void
-transfer_file (const char *src_path,
-               const char *dst_path)
-{
-  size_t bytes_read;
-  FILE *src_fp;
-  FILE *dst_fp;
+  changed = false;
+  if (watching && (failed_phase == -1))
+  {
+    memset (&end_st, 0, sizeof (struct stat));
+    changed = (vfs_fstat (src_fd, src_path, &end_st) == 0) &&
+              !same_version (&src_st, &end_st);
+  }
 
-  src_fp = x_fopen (src_path, "rb");
-  if (!src_fp)
-    exit (EXIT_FAILURE);
+  if (moving_sources && !changed && (failed_phase == -1) &&
+      (fsync (dst_fd) != 0))
+  {
+    x_error (errno, "failed to sync `%s'", dst_path);
+    failed_phase = PHASE_WRITE;
+    failed_errno = errno;
+  }
 
-  dst_fp = x_fopen (dst_path, "wb");
-  if (!dst_fp)
+  close (src_fd);
+  if ((close (dst_fd) != 0) && (failed_phase == -1))
   {
-    x_fclose (src_fp, src_path);
-    exit (EXIT_FAILURE);
+    x_error (errno, "failed to properly close file `%s'", dst_path);
+    failed_phase = PHASE_CLOSE;
+    failed_errno = errno;
   }
 
-  memset (chunk, 0, sizeof (chunk));
-  for (;;)
+  if (failed_phase != -1)
+  {
+    /* a truncated copy must not pass for a finished one later */
+    (void) vfs_unlink (dst_path);
+    __atomic_sub_fetch (&transferred_bytes, ft.bytes_done,
+                        __ATOMIC_RELAXED);
+    record_failure (failed_phase, failed_errno, src_path, dst_path);
+    return TRANSFER_FAILED;
+  }
+
+  if (changed && !last)
   {
-    bytes_read = fread (chunk, 1, chunk_size, src_fp);
-    fwrite (chunk, 1, bytes_read, dst_fp);
+    __atomic_sub_fetch (&transferred_bytes, ft.bytes_done,
+                        __ATOMIC_RELAXED);
     if (showing_progress)
-      progress_update (bytes_read);
-    if (ferror (src_fp) || feof (src_fp))
-      break;
+      progress_rewind (ft.bytes_done);
+    return TRANSFER_CHANGED;
   }
 
-  x_fclose (src_fp, src_path);
-  x_fclose (dst_fp, dst_path);
+  __atomic_add_fetch (&sparsified_bytes, t.sparse_bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&transferred_files, 1, __ATOMIC_RELAXED);
+  if (changed)
+  {
+    /* the copy is the best there is, but it may be torn, so the source
+       is not removed either */
+    x_error (0, "`%s' changed while it was copied", src_path);
+    __atomic_add_fetch (&changing_files, 1, __ATOMIC_RELAXED);
+    error_log_add (PHASE_CHANGED, 0, src_path, dst_path);
+  }
+  else if (moving_sources)
+    move_queue_unlink (src_path, dst_path);
+  return TRANSFER_DONE;
 }
 
-static void
-get_directory_transfer_destination_path (char *buffer, const char *src_path)
+/* Copies SRC_PATH to DST_PATH, and copies it again while the source keeps
+   changing under the copy, up to change_retries times with a pause that
+   doubles each time. */
+static int
+transfer_file (const char *src_path,
+               const char *dst_path)
 {
-  size_t n_src_path;
-  size_t n_src_root;
-  size_t n_dst_root;
-  size_t n_result;
+  int result;
+  long delay;
+  unsigned int attempt;
+  struct timespec pause;
 
-  n_src_path = strlen (src_path);
-  n_src_root = strlen (directory_transfer_source_root);
-  n_dst_root = strlen (directory_transfer_destination_root);
-  n_result = (n_src_path - n_src_root) + n_dst_root;
+  if (already_transferred (src_path, dst_path))
+    return TRANSFER_DONE;
 
-  if (n_result >= (PATH_BUFMAX - 1))
-    die (0, "preventing buffer overflow");
+  for (attempt = 0; ; ++attempt)
+  {
+    result = transfer_file_once (src_path, dst_path,
+                                 (attempt >= change_retries) ||
+                                 control_cancel_requested ());
+    if (result != TRANSFER_CHANGED)
+      return result;
+    __atomic_add_fetch (&changed_recopies, 1, __ATOMIC_RELAXED);
+    delay = CHANGE_RETRY_DELAY << ((attempt < 10) ? attempt : 10);
+    pause.tv_sec = delay / 1000;
+    pause.tv_nsec = (delay % 1000) * 1000000L;
+    while ((nanosleep (&pause, &pause) != 0) && (errno == EINTR) &&
+           !control_cancel_requested ())
+      ;
+  }
+}
 
-  memcpy (buffer, directory_transfer_destination_root, n_dst_root);
-  memcpy (buffer + n_dst_root,
-          src_path + n_src_root,
-          n_src_path - n_src_root);
-  buffer[n_result] = '\0';
+static bool
+get_directory_transfer_destination_path (char *buffer, const char *src_path)
+{
+  if (rebase_path (buffer, src_path, directory_transfer_source_root_length,
+                   directory_transfer_destination_root))
+    return true;
+  x_error (ENAMETOOLONG, "destination path too long for `%s'", src_path);
+  errno = ENAMETOOLONG;
+  return false;
 }
 
 static void
@@ -551,42 +1151,128 @@ preserve_attributes (const char *src_path,
                      const char *dst_path,
                      struct stat *src_st)
 {
-  if (preserving_timestamp)
-    preserve_timestamp (dst_path, src_st->st_atime, src_st->st_mtime);
+  bool ok;
+
+  ok = true;
+  if (preserving_timestamp &&
+      !preserve_timestamp (dst_path, src_st->st_atime, src_st->st_mtime))
+    ok = false;
 
-  if (preserving_ownership)
-    x_chown (dst_path, src_st->st_uid, src_st->st_gid);
+  if (preserving_ownership &&
+      !x_chown (dst_path, src_st->st_uid, src_st->st_gid))
+    ok = false;
 
-  if (preserving_permissions)
-    x_chmod (dst_path, src_st->st_mode);
+  if (preserving_permissions && !x_chmod (dst_path, src_st->st_mode))
+    ok = false;
+
+  /* the data made it, so this is never a reason to stop */
+  if (!ok)
+    error_log_add (PHASE_ATTRIBUTES, errno, src_path, dst_path);
 }
 
+/* Copies the small files queued for io_uring. Whatever the ring could not
+   copy goes through transfer_file(), which also reports why. So does a
+   file that changed while its chain ran, or whose size is not the one the
+   scan saw anymore, where transfer_file() copies it again for as long as
+   --change-retries allows. */
 static void
-transfer_directory (const char *root_path)
+ring_flush (void)
 {
-  bool err;
-  size_t n_child_path;
-  size_t n_root_path;
-  size_t n_name;
-  struct stat child_st;
-  DIR *dp;
-  struct dirent *ep;
-
-  dp = x_opendir (root_path);
-  if (!dp)
-    exit (EXIT_FAILURE);
+  size_t x;
+  struct uring_file *f;
 
-  n_root_path = strlen (root_path);
-  for (;;)
+  if (n_ring_batch == 0)
+    return;
+  if (!uring_copy (ring, ring_batch, n_ring_batch))
   {
-    ep = x_readdir (dp, &err, root_path);
-    if (!ep)
+    uring_free (ring);
+    ring = NULL;
+  }
+  for (x = 0; x < n_ring_batch; ++x)
+  {
+    f = &ring_batch[x];
+    if (f->changed)
+      __atomic_add_fetch (&changed_recopies, 1, __ATOMIC_RELAXED);
+    if (f->result == 0)
+    {
+      __atomic_add_fetch (&transferred_bytes, f->size, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&transferred_files, 1, __ATOMIC_RELAXED);
+      if (showing_progress)
+        progress_update (f->size);
+      preserve_attributes (f->src_path, f->dst_path, &f->st);
+    }
+    else if (!control_cancel_requested () &&
+             (transfer_file (f->src_path, f->dst_path) == TRANSFER_DONE))
+      preserve_attributes (f->src_path, f->dst_path, &ring_batch_st[x]);
+    free ((char *) f->src_path);
+    free ((char *) f->dst_path);
+  }
+  n_ring_batch = 0;
+}
+
+/* Queues a small file to be copied through io_uring with the next batch.
+   Returns false if it has to be copied the regular way. */
+static bool
+ring_queue (const char *src_path, const char *dst_path, struct stat *st)
+{
+  struct uring_file *f;
+
+  if (!ring || moving_sources || writing_sparse || resuming_item ||
+      (st->st_size > URING_MAX_FILE))
+    return false;
+  f = &ring_batch[n_ring_batch];
+  f->src_path = strdup (src_path);
+  f->dst_path = strdup (dst_path);
+  if (!f->src_path || !f->dst_path)
+    die (errno, "failed to allocate io_uring batch");
+  f->size = (size_t) st->st_size;
+  f->result = 0;
+  ring_batch_st[n_ring_batch++] = *st;
+  if (n_ring_batch == URING_FILES)
+    ring_flush ();
+  return true;
+}
+
+static void
+record_directory_failure (const char *path)
+{
+  int errnum;
+  char dst_path[PATH_BUFMAX];
+
+  errnum = errno;
+  if (!get_directory_transfer_destination_path (dst_path, path))
+    *dst_path = '\0';
+  record_failure (PHASE_DIRECTORY, errnum, path, dst_path);
+}
+
+/* Returns false if the copy was cancelled. */
+static bool
+transfer_directory (const char *root_path)
+{
+  int result;
+  bool err;
+  size_t n_child_path;
+  size_t n_root_path;
+  size_t n_name;
+  struct stat child_st;
+  struct vfs_dir *dp;
+  struct dirent *ep;
+
+  dp = vfs_opendir (root_path);
+  if (!dp)
+  {
+    record_directory_failure (root_path);
+    return true;
+  }
+
+  n_root_path = strlen (root_path);
+  for (;;)
+  {
+    ep = vfs_readdir (dp, &err, root_path);
+    if (!ep)
     {
       if (err)
-      {
-        x_closedir (dp, root_path);
-        exit (EXIT_FAILURE);
-      }
+        record_directory_failure (root_path);
       break;
     }
     if (streq (ep->d_name, ".", false) || streq (ep->d_name, "..", false))
@@ -598,22 +1284,56 @@ transfer_directory (const char *root_path)
     child_path[n_root_path] = DIR_SEPARATOR_C;
     memcpy (child_path + (n_root_path + 1), ep->d_name, n_name);
     child_path[n_child_path] = '\0';
+    if (entry_excluded (child_path,
+                        directory_transfer_source_root_length, ep))
+      continue;
     char dst_path[PATH_BUFMAX];
-    get_directory_transfer_destination_path (dst_path, child_path);
+    if (!get_directory_transfer_destination_path (dst_path, child_path))
+    {
+      record_failure (PHASE_OPEN, ENAMETOOLONG, child_path, NULL);
+      continue;
+    }
     memset (&child_st, 0, sizeof (struct stat));
-    if (stat (child_path, &child_st) == 0)
+    if (vfs_stat (child_path, &child_st) != 0)
+    {
+      if (errno != ENOENT)
+      {
+        x_error (errno, "failed to stat `%s'", child_path);
+        record_failure (PHASE_STAT, errno, child_path, dst_path);
+      }
+    }
+    else if (!filter_skipped (&child_st))
     {
       if (S_ISDIR (child_st.st_mode))
       {
-        make_path (dst_path);
-        transfer_directory (child_path);
+        if (!vfs_make_path (dst_path))
+        {
+          record_failure (PHASE_MKDIR, errno, child_path, dst_path);
+          continue;
+        }
+        if (moving_sources)
+          sync_parent_directory (dst_path);
+        if (!transfer_directory (child_path))
+          break;
+        preserve_attributes (child_path, dst_path, &child_st);
+      }
+      else if (S_ISREG (child_st.st_mode) &&
+               !ring_queue (child_path, dst_path, &child_st))
+      {
+        result = transfer_file (child_path, dst_path);
+        if (result == TRANSFER_CANCELLED)
+          break;
+        if (result == TRANSFER_DONE)
+          preserve_attributes (child_path, dst_path, &child_st);
       }
-      else if (S_ISREG (child_st.st_mode))
-        transfer_file (child_path, dst_path);
-      preserve_attributes (child_path, dst_path, &child_st);
     }
+    if (control_cancel_requested ())
+      break;
   }
-  x_closedir (dp, root_path);
+  vfs_closedir (dp, root_path);
+  /* before the caller sets the attributes of this directory */
+  ring_flush ();
+  return !control_cancel_requested ();
 }
 
 static void
@@ -621,28 +1341,70 @@ do_copy (const char *src_path,
          int src_type,
          byte_t src_size,
          size_t src_item_count,
-         const char *dst_path,
-         int dst_type)
+         const char *dst_path)
 {
+  int result;
+  struct stat src_st;
+
   if (showing_progress)
     progress_init (src_size, src_item_count);
 
+  select_engine (src_path, dst_path);
+  /* a rename would take along whatever the filters leave out */
+  result = (moving_sources && !filter_active () &&
+            !filter_predicates_active ())
+           ? move_rename (src_path, dst_path) : MOVE_NEEDS_COPY;
+  if (result != MOVE_NEEDS_COPY)
+  {
+    if (result == MOVE_FAILED)
+      record_failure (PHASE_REMOVE, errno, src_path, dst_path);
+    else
+    {
+      __atomic_add_fetch (&transferred_bytes, src_size, __ATOMIC_RELAXED);
+      if (showing_progress)
+        progress_update (src_size);
+    }
+    if (showing_progress)
+      progress_finish ();
+    return;
+  }
+
+  memset (&src_st, 0, sizeof (struct stat));
+  (void) vfs_stat (src_path, &src_st);
+
   if (src_type == TYPE_DIRECTORY)
   {
     set_directory_transfer_source_root (src_path);
     set_directory_transfer_destination_root (dst_path);
-    make_path (directory_transfer_destination_root);
-    transfer_directory (directory_transfer_source_root);
+    if (!vfs_make_path (directory_transfer_destination_root))
+    {
+      record_failure (PHASE_MKDIR, errno, src_path, dst_path);
+      if (showing_progress)
+        progress_finish ();
+      return;
+    }
+    if (moving_sources)
+      sync_parent_directory (directory_transfer_destination_root);
+    control_arm (true);
+    result = transfer_directory (directory_transfer_source_root)
+             ? TRANSFER_DONE : TRANSFER_CANCELLED;
   }
   else
-    transfer_file (src_path, dst_path);
-
-  if (preserving_ownership || preserving_permissions || preserving_timestamp)
   {
-    struct stat src_st;
-    memset (&src_st, 0, sizeof (struct stat));
-    (void) stat (src_path, &src_st);
+    control_arm (true);
+    result = transfer_file (src_path, dst_path);
+  }
+  control_arm (false);
+
+  if ((result == TRANSFER_DONE) &&
+      (preserving_ownership || preserving_permissions || preserving_timestamp))
     preserve_attributes (src_path, dst_path, &src_st);
+
+  if (moving_sources)
+  {
+    move_finish ();
+    if ((result == TRANSFER_DONE) && (src_type == TYPE_DIRECTORY))
+      move_remove_directories (src_path);
   }
 
   if (showing_progress)
@@ -666,7 +1428,7 @@ get_real_destination_path (char *buffer,
     return;
   }
 
-  basename (src_base, src_path);
+  base_name (src_base, src_path);
   n_src_base = strlen (src_base);
   memcpy (buffer, dst_path, n_dst_path);
   buffer[n_dst_path] = DIR_SEPARATOR_C;
@@ -697,20 +1459,21 @@ check_real_destination_path (const char *rpath)
 static void
 verify_checksums (const char *src_path, const char *dst_path)
 {
-  int x;
   char src_sum[CHECKSUM_BUFMAX];
   char dst_sum[CHECKSUM_BUFMAX];
 
-  for (x = console_width (); (x > 0); --x)
-    fputc ('-', stdout);
-  fputc ('\n', stdout);
   fputs ("Verifying MD5 checksums... ", stdout);
 
-  get_checksum (src_sum, src_path);
-  get_checksum (dst_sum, dst_path);
+  if (!get_checksum (src_sum, src_path) || !get_checksum (dst_sum, dst_path))
+  {
+    fputs ("FAILED\n", stdout);
+    error_log_add (PHASE_VERIFY, errno, src_path, dst_path);
+    return;
+  }
   if (!streq (src_sum, dst_sum, false))
   {
     fputs ("FAILED\n", stdout);
+    error_log_add (PHASE_VERIFY, 0, src_path, dst_path);
     fprintf (stderr,
              "  Source:\n"
              "    %s\n"
@@ -733,15 +1496,102 @@ verify_checksums (const char *src_path, const char *dst_path)
   }
 }
 
+static void
+verify_failed (const char *src_path,
+               const char *dst_path,
+               int errnum,
+               off_t offset)
+{
+  /* checksums have already said why they could not read a file */
+  if ((errnum != 0) && (verify_config.mode != VERIFY_MD5) &&
+      (verify_config.mode != VERIFY_TREE))
+    x_error (errnum, "failed to verify `%s'", src_path);
+  else if (errnum == 0)
+  {
+    fprintf (stderr,
+             "  Source:\n"
+             "    %s\n"
+             "  Destination (CORRUPT):\n"
+             "    %s\n",
+             src_path, dst_path);
+    if ((offset >= 0) && (verify_config.mode == VERIFY_TREE))
+      fprintf (stderr, "    differs in the %d bytes from byte %jd on\n",
+               TREE_LEAF_SIZE, (intmax_t) offset);
+    else if (offset >= 0)
+      fprintf (stderr, "    differs from byte %jd on\n", (intmax_t) offset);
+  }
+  error_log_add (PHASE_VERIFY, errnum, src_path, dst_path);
+}
+
+/* A single file is verified with the details shown, like it always was;
+   anything else is summed up. SRC_SIZE is what there was to copy. */
+static void
+verify_copy (const char *src_path, const char *dst_path, byte_t src_size)
+{
+  int x;
+  struct stat st;
+  struct verify_ops ops;
+  struct verify_totals totals;
+  char size[SIZE_BUFMAX];
+
+  for (x = console_width (); (x > 0); --x)
+    fputc ('-', stdout);
+  fputc ('\n', stdout);
+  if ((verify_config.mode == VERIFY_MD5) &&
+      (stat (src_path, &st) == 0) && S_ISREG (st.st_mode))
+  {
+    verify_checksums (src_path, dst_path);
+    return;
+  }
+
+  if (verify_config.mode == VERIFY_COMPARE)
+    printf ("Comparing bytes of `%s'...\n", src_path);
+  else if (verify_config.mode == VERIFY_TREE)
+    printf ("Verifying MD5 tree checksums of `%s'...\n", src_path);
+  else if (verify_config.mode == VERIFY_SAMPLE)
+    printf ("Comparing sampled blocks of `%s' (seed %" PRIu64 ")...\n",
+            src_path, verify_config.seed);
+  else
+    printf ("Verifying MD5 checksums of `%s'...\n", src_path);
+  fflush (stdout);
+  ops.excluded = entry_excluded;
+  ops.skipped = filter_skipped;
+  ops.failed = verify_failed;
+  memset (&totals, 0, sizeof (struct verify_totals));
+  verify_config.total_bytes = src_size;
+  verify_tree (&verify_config, src_path, dst_path, (jobs > 1) ? jobs : 0,
+               &ops, &totals);
+  format_size (size, totals.bytes, true);
+  if (verify_config.mode == VERIFY_SAMPLE)
+    printf ("%s -- %zu block%s (%s) of %zu file%s; a copy with %g%% of its "
+            "blocks damaged would have been caught with %.2f%% "
+            "probability\n",
+            (totals.n_failed > 0) ? "FAILED" : "PASSED",
+            totals.n_blocks, (totals.n_blocks == 1) ? "" : "s", size,
+            totals.n_files, (totals.n_files == 1) ? "" : "s",
+            VERIFY_SAMPLE_DAMAGE * 100.0, totals.confidence * 100.0);
+  else if (totals.n_failed > 0)
+    printf ("FAILED -- %zu problem%s in %zu file%s (%s)\n",
+            totals.n_failed, (totals.n_failed == 1) ? "" : "s",
+            totals.n_files, (totals.n_files == 1) ? "" : "s", size);
+  else
+    printf ("PASSED -- %zu file%s (%s)\n",
+            totals.n_files, (totals.n_files == 1) ? "" : "s", size);
+}
+
 static void
 report_init (void)
 {
   x_gettimeofday (&start_time);
+  if (showing_stats)
+    stats_start ();
 }
 
 static void
 report_show (void)
 {
+  size_t n_failed;
+  size_t n_atime_opens;
   struct timeval end_time;
   char time_taken[TIME_BUFMAX];
   char total_copied[SIZE_BUFMAX];
@@ -749,29 +1599,486 @@ report_show (void)
   format_size (total_copied, total_bytes, true);
   x_gettimeofday (&end_time);
   format_time (time_taken, &start_time, &end_time);
-  printf ("Copied %s in %s\n", total_copied, time_taken);
+  if (control_cancel_requested ())
+  {
+    char so_far_copied[SIZE_BUFMAX];
+    format_size (so_far_copied, transferred_bytes, true);
+    printf ("Cancelled after copying %s of %s in %s\n",
+            so_far_copied, total_copied, time_taken);
+  }
+  else
+  {
+    char copied[SIZE_BUFMAX];
+    format_size (copied, transferred_bytes, true);
+    printf ("Copied %s in %s\n", copied, time_taken);
+    n_failed = error_log_count ();
+    if (n_failed > 0)
+      printf ("%zu entr%s failed\n", n_failed, (n_failed == 1) ? "y" : "ies");
+    if (sparsified_bytes > 0)
+    {
+      char sparsified[SIZE_BUFMAX];
+      format_size (sparsified, sparsified_bytes, true);
+      printf ("Left %s of zeros as holes\n", sparsified);
+    }
+  }
+  if (changed_recopies > 0)
+    printf ("Copied %zu time%s again because the source changed during "
+            "the copy\n",
+            changed_recopies, (changed_recopies == 1) ? "" : "s");
+  if (changing_files > 0)
+    printf ("Still changing after %u retr%s: %zu file%s (in the error log)\n",
+            change_retries, (change_retries == 1) ? "y" : "ies",
+            changing_files, (changing_files == 1) ? "" : "s");
+  n_atime_opens = source_atime_opens ();
+  if (n_atime_opens > 0)
+    printf ("Opened sources without O_NOATIME %zu time%s "
+            "(owned by another user)\n",
+            n_atime_opens, (n_atime_opens == 1) ? "" : "s");
+  if (showing_stats)
+    stats_show ();
 }
 
 static void
-try_copy (const char **src_path, size_t n_src, const char *dst_path)
+write_manifest (void)
 {
-  int dst_type;
+  size_t n_entries;
+  char size[SIZE_BUFMAX];
+
+  n_entries = manifest_writer_count (manifest_out);
+  if (!manifest_writer_finish (manifest_out, manifest_out_path))
+    exit (EXIT_FAILURE);
+  manifest_out = NULL;
+  format_size (size, total_bytes, true);
+  printf ("Wrote %zu entries (%s to copy) to `%s'\n",
+          n_entries, size, manifest_out_path);
+}
+
+static bool
+manifest_entry_path (char *buffer, const char *root, const char *path)
+{
+  if (!*path)
+    return snprintf (buffer, PATH_BUFMAX, "%s", root) < PATH_BUFMAX;
+  return snprintf (buffer, PATH_BUFMAX, "%s" DIR_SEPARATOR_S "%s",
+                   root, path) < PATH_BUFMAX;
+}
+
+/* Both paths of entry E of source S, or false (once it is recorded) if
+   either is too long. */
+static bool
+manifest_entry_paths (const struct manifest_source *s,
+                      const struct manifest_entry *e,
+                      char *src,
+                      char *dst)
+{
+  if (manifest_entry_path (src, s->src_path, e->path) &&
+      manifest_entry_path (dst, s->dst_path, e->path))
+    return true;
+  x_error (ENAMETOOLONG, "path too long for `%s'", e->path);
+  record_failure (PHASE_OPEN, ENAMETOOLONG, s->src_path, NULL);
+  return false;
+}
+
+static void
+manifest_entry_stat (const struct manifest_entry *e, struct stat *st)
+{
+  memset (st, 0, sizeof (struct stat));
+  st->st_size = (off_t) e->size;
+  st->st_mtime = (time_t) e->mtime;
+  st->st_atime = (time_t) e->atime;
+  st->st_mode = (mode_t) e->mode;
+  st->st_uid = (uid_t) e->uid;
+  st->st_gid = (gid_t) e->gid;
+}
+
+static void
+skeleton_failed (const char *path, int errnum, void *data)
+{
+  const struct manifest_source *s;
+  char src[PATH_BUFMAX];
+  char dst[PATH_BUFMAX];
+
+  s = (const struct manifest_source *) data;
+  if (!manifest_entry_path (src, s->src_path, path) ||
+      !manifest_entry_path (dst, s->dst_path, path))
+  {
+    record_failure (PHASE_MKDIR, errnum, s->src_path, s->dst_path);
+    return;
+  }
+  record_failure (PHASE_MKDIR, errnum, src, dst);
+}
+
+struct copy_job
+{
+  char *src_path;
+  char *dst_path;
+  struct stat st;
+};
+
+static void
+copy_job_run (void *arg)
+{
+  struct copy_job *j;
+
+  j = (struct copy_job *) arg;
+  __atomic_sub_fetch (&queued_jobs, 1, __ATOMIC_RELAXED);
+  if (!control_cancel_requested () && !failure_recorded () &&
+      (transfer_file (j->src_path, j->dst_path) == TRANSFER_DONE))
+    preserve_attributes (j->src_path, j->dst_path, &j->st);
+  free (j->src_path);
+  free (j->dst_path);
+  free (j);
+}
+
+static void
+copy_job_submit (struct pool *pool,
+                 const char *src_path,
+                 const char *dst_path,
+                 const struct stat *st)
+{
+  struct copy_job *j;
+
+  j = malloc (sizeof (struct copy_job));
+  if (!j)
+    die (errno, "failed to allocate copy job");
+  j->src_path = strdup (src_path);
+  j->dst_path = strdup (dst_path);
+  if (!j->src_path || !j->dst_path)
+    die (errno, "failed to allocate copy job");
+  j->st = *st;
+  __atomic_add_fetch (&queued_jobs, 1, __ATOMIC_RELAXED);
+  pool_submit (pool, copy_job_run, j);
+}
+
+/* Copies everything the manifest lists for source S. All of its
+   directories are created first, then its files are copied by up to JOBS
+   threads in whatever order they finish, and last the attributes of the
+   directories are set, once nothing is written into them anymore. */
+static void
+manifest_copy_source (const struct manifest *m,
+                      const struct manifest_source *s)
+{
+  bool created;
   size_t x;
-  struct stat dst_st;
+  struct stat st;
+  struct pool *pool;
+  struct skeleton_ops ops;
+  struct manifest_cursor c;
+  struct manifest_entry e;
+  char src[PATH_BUFMAX];
+  char dst[PATH_BUFMAX];
+
+  ops.failed = skeleton_failed;
+  ops.data = (void *) s;
+  metrics_phase (METRICS_PHASE_DIRECTORIES);
+  created = skeleton_create (m, s, scan_threads, &ops);
+  stop_if_failing ();
+  if (!created)
+    return;
+
+  metrics_phase (METRICS_PHASE_DATA);
+  pool = pool_new ((jobs > 1) ? jobs : 0, jobs * JOB_QUEUE);
+  if (!manifest_seek (m, &c, s->first_record))
+    die (0, "damaged manifest");
+  for (x = 0; (x < s->n_records) && !control_cancel_requested () &&
+              !failure_recorded (); ++x)
+  {
+    if (!manifest_next (&c, &e))
+      die (0, "damaged manifest");
+    if (S_ISDIR ((mode_t) e.mode) || !manifest_entry_paths (s, &e, src, dst))
+      continue;
+    manifest_entry_stat (&e, &st);
+    if (!*e.path)
+    {
+      char dst_parent[PATH_BUFMAX];
+      dir_name (dst_parent, dst);
+      if (!vfs_make_path (dst_parent))
+      {
+        record_failure (PHASE_MKDIR, errno, src, dst);
+        continue;
+      }
+    }
+    if (!ring_queue (src, dst, &st))
+      copy_job_submit (pool, src, dst, &st);
+  }
+  ring_flush ();
+  pool_wait (pool);
+  pool_free (pool);
+  stop_if_failing ();
+
+  if (!preserving_ownership && !preserving_permissions &&
+      !preserving_timestamp)
+    return;
+  metrics_phase (METRICS_PHASE_ATTRIBUTES);
+  if (!manifest_seek (m, &c, s->first_record))
+    die (0, "damaged manifest");
+  for (x = 0; (x < s->n_records) && !control_cancel_requested (); ++x)
+  {
+    if (!manifest_next (&c, &e))
+      die (0, "damaged manifest");
+    if (!S_ISDIR ((mode_t) e.mode) || !manifest_entry_paths (s, &e, src, dst))
+      continue;
+    manifest_entry_stat (&e, &st);
+    preserve_attributes (src, dst, &st);
+  }
+}
+
+/* Copies source number ITEM (counting from 0) of manifest M. */
+static void
+manifest_copy_item (const struct manifest *m, size_t item)
+{
+  const struct manifest_source *s;
+
+  s = manifest_source (m, item);
+  if (showing_progress)
+    progress_init (s->bytes, item + 1);
+  select_engine (s->src_path, s->dst_path);
+  control_arm (true);
+  manifest_copy_source (m, s);
+  control_arm (false);
+  if (showing_progress)
+    progress_finish ();
+}
+
+/* With more than one job the sources are copied from a manifest of the
+   scan rather than while walking them, so their directories can all be
+   created up front. The manifest is only needed in memory: its file is
+   removed as soon as it is mapped. */
+static struct manifest *
+plan_manifest (void)
+{
+  int fd;
+  const char *dir;
+  struct manifest *m;
+  char path[PATH_BUFMAX];
+
+  dir = getenv ("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  if (snprintf (path, PATH_BUFMAX,
+                "%s" DIR_SEPARATOR_S "copy-manifest.XXXXXX",
+                dir) >= PATH_BUFMAX)
+    die (ENAMETOOLONG, "failed to create manifest in `%s'", dir);
+  fd = mkstemp (path);
+  if (fd == -1)
+    die (errno, "failed to create manifest `%s'", path);
+  close (fd);
+  if (!manifest_writer_finish (manifest_out, path))
+  {
+    (void) unlink (path);
+    exit (EXIT_FAILURE);
+  }
+  manifest_out = NULL;
+  m = manifest_open (path);
+  (void) unlink (path);
+  if (!m)
+    exit (EXIT_FAILURE);
+  return m;
+}
+
+/* Marks the start of the run that notify_finished () reports on, which
+   from then on is also told about any exit on the way. */
+static void
+notify_begin (void)
+{
+  x_gettimeofday (&notify_begun);
+  notify_pending = true;
+}
+
+/* Sends the notifications for the copy started by notify_begin (), once.
+   COMPLETED is false when the program exits in the middle of it, which
+   counts as a failure unless the copy was cancelled. */
+static void
+notify_finished (bool completed)
+{
+  struct timeval now;
+  struct notify_event e;
+
+  if (!notify_pending)
+    return;
+  notify_pending = false;
+  x_gettimeofday (&now);
+  e.errors = error_log_count ();
+  if (control_cancel_requested ())
+    e.status = NOTIFY_CANCELLED;
+  else if (!completed || (e.errors > 0))
+    e.status = NOTIFY_FAILED;
+  else
+    e.status = NOTIFY_DONE;
+  e.bytes = transferred_bytes;
+  e.files = transferred_files;
+  e.seconds = (double) (now.tv_sec - notify_begun.tv_sec) +
+              ((double) (now.tv_usec - notify_begun.tv_usec) / 1000000.0);
+  notify_send (&e);
+}
+
+/* Gives the path the user asked RPATH to be copied to: with
+   --publish-atomic, RPATH is the staging path and this the live one. */
+static const char *
+published_path (char *buffer, const char *rpath)
+{
+  if (publishing_atomic && publish_live_path (buffer, rpath))
+    return buffer;
+  return rpath;
+}
+
+/* Swaps the staged copies in RPATH with their live paths, but only once
+   all of them are complete. */
+static void
+publish_sources (const char **rpath, size_t n_src)
+{
+  size_t x;
+  char live[PATH_BUFMAX];
+
+  if (error_log_count () > 0)
+  {
+    x_error (0, "not publishing -- the copy had errors, staged copies are "
+                "left in place");
+    return;
+  }
+  for (x = 0; (x < n_src); ++x)
+  {
+    if (!publish_live_path (live, rpath[x]))
+      continue;
+    if (!publish (rpath[x], live))
+      error_log_add (PHASE_PUBLISH, errno, rpath[x], NULL);
+  }
+}
+
+/* Copies SRC_PATH[x] to RPATH[x], starting with the 1-based FIRST_ITEM.
+   When RESUMING, that first item was interrupted before and whatever of it
+   already made it to the destination is not copied again. */
+static void
+copy_sources (const char **src_path,
+              const char **rpath,
+              size_t n_src,
+              size_t first_item,
+              bool resuming)
+{
+  size_t x;
+  struct manifest *plan;
   struct stat src_st[n_src];
   byte_t src_size[n_src];
   int src_type[n_src];
-#ifdef ENABLE_SOUND
-  char *error_msg;
-#endif
+  char live[PATH_BUFMAX];
+
+  plan = NULL;
+  if (!manifest_out && (jobs > 1) && !moving_sources && !resuming)
+    manifest_out = manifest_writer_new ();
 
-  memset (&dst_st, 0, sizeof (struct stat));
   for (x = 0; (x < n_src); ++x)
   {
     memset (&src_st[x], 0, sizeof (struct stat));
     src_size[x] = BYTE_C (0);
   }
 
+  metrics_phase (METRICS_PHASE_SCAN);
+  for (x = first_item - 1; (x < n_src); ++x)
+  {
+    src_type[x] = TYPE_UNKNOWN;
+    if (vfs_stat (src_path[x], &src_st[x]) == 0)
+    {
+      if (S_ISDIR (src_st[x].st_mode))
+        src_type[x] = TYPE_DIRECTORY;
+      else if (S_ISREG (src_st[x].st_mode))
+        src_type[x] = TYPE_FILE;
+      else
+        die (0, "unsupported source -- `%s'", src_path[x]);
+      if (manifest_out)
+      {
+        manifest_out_source = manifest_writer_add_source (manifest_out,
+                                                          src_path[x],
+                                                          rpath[x]);
+        manifest_writer_add (manifest_out, manifest_out_source, "",
+                             &src_st[x]);
+      }
+      if (src_type[x] == TYPE_DIRECTORY)
+        directory_content_size (src_path[x], strlen (src_path[x]),
+                                &src_size[x]);
+      else
+        src_size[x] = (byte_t) src_st[x].st_size;
+      total_bytes += src_size[x];
+    }
+    else
+      die (errno, "failed to stat `%s'", src_path[x]);
+  }
+
+  if (manifest_out)
+  {
+    if (manifest_out_path)
+    {
+      write_manifest ();
+      notify_finished (true);
+      return;
+    }
+    plan = plan_manifest ();
+  }
+
+  total_sources = n_src;
+  journal_src_paths = src_path;
+  journal_rpaths = rpath;
+
+  if (showing_report)
+    report_init ();
+
+  for (x = first_item - 1; (x < total_sources); ++x)
+  {
+    if (!resuming &&
+        !check_real_destination_path (published_path (live, rpath[x])))
+      break;
+    current_item = x + 1;
+    resuming_item = resuming && (current_item == first_item);
+    metrics_phase (METRICS_PHASE_DATA);
+    if (plan)
+      manifest_copy_item (plan, x);
+    else
+      do_copy (src_path[x], src_type[x], src_size[x], x + 1, rpath[x]);
+    if (control_cancel_requested ())
+      break;
+  }
+  resuming_item = false;
+  if (plan)
+    manifest_close (plan);
+
+  if (control_cancel_requested ())
+  {
+    move_finish ();
+    if (showing_report)
+      report_show ();
+    write_journal ();
+    if (journal_written)
+      fprintf (stderr, "%s: cancelled -- resume with: %s --resume=%s\n",
+               program_name, program_name, journal_path);
+    exit (EXIT_FAILURE);
+  }
+  if (resuming || journal_written)
+    journal_remove (journal_path);
+
+  if (showing_report)
+    report_show ();
+  error_log_summary ();
+
+  /* moved files were already verified before their sources went away */
+  if (verifying_checksums && !moving_sources)
+  {
+    metrics_phase (METRICS_PHASE_VERIFY);
+    for (x = first_item - 1; (x < total_sources); ++x)
+      verify_copy (src_path[x], rpath[x], src_size[x]);
+  }
+  if (publishing_atomic)
+    publish_sources (rpath, total_sources);
+  notify_finished (true);
+}
+
+static void
+try_copy (const char **src_path, size_t n_src, const char *dst_path)
+{
+  int dst_type;
+  size_t x;
+  struct stat dst_st;
+  char **rpath;
+
+  memset (&dst_st, 0, sizeof (struct stat));
+
   dst_type = TYPE_UNKNOWN;
   if (stat (dst_path, &dst_st) != 0)
   {
@@ -779,7 +2086,8 @@ try_copy (const char **src_path, size_t n_src, const char *dst_path)
     {
       if (n_src > 1)
       {
-        make_path (dst_path);
+        if (!make_path (dst_path))
+          exit (EXIT_FAILURE);
         memset (&dst_st, 0, sizeof (struct stat));
         if (stat (dst_path, &dst_st) != 0)
           die (errno, "failed to stat destination -- `%s'", dst_path);
@@ -790,8 +2098,9 @@ try_copy (const char **src_path, size_t n_src, const char *dst_path)
       else
       {
         char dst_parent[PATH_BUFMAX];
-        dirname (dst_parent, dst_path);
-        make_path (dst_parent);
+        dir_name (dst_parent, dst_path);
+        if (!make_path (dst_parent))
+          exit (EXIT_FAILURE);
         memset (&dst_st, 0, sizeof (struct stat));
         if ((stat (dst_path, &dst_st) != 0) && (errno != ENOENT))
           die (errno, "failed to stat destination -- `%s'", dst_path);
@@ -821,102 +2130,259 @@ try_copy (const char **src_path, size_t n_src, const char *dst_path)
       !get_overwrite_permission (dst_path))
     die (0, "not overwriting destination -- `%s'", dst_path);
 
+  rpath = malloc (n_src * sizeof (char *));
+  if (!rpath)
+    die (errno, "failed to allocate destination paths");
   for (x = 0; (x < n_src); ++x)
   {
-    src_type[x] = TYPE_UNKNOWN;
-    if (stat (src_path[x], &src_st[x]) == 0)
+    char buffer[PATH_BUFMAX];
+    get_real_destination_path (buffer, dst_path, dst_type, src_path[x]);
+    if (publishing_atomic)
     {
-      if (S_ISDIR (src_st[x].st_mode))
-        src_type[x] = TYPE_DIRECTORY;
-      else if (S_ISREG (src_st[x].st_mode))
-        src_type[x] = TYPE_FILE;
-      else
-        die (0, "unsupported source -- `%s'", src_path[x]);
-      if (src_type[x] == TYPE_DIRECTORY)
-        directory_content_size (src_path[x], &src_size[x]);
-      else
-        src_size[x] = (byte_t) src_st[x].st_size;
-      total_bytes += src_size[x];
+      char live[PATH_BUFMAX];
+      memcpy (live, buffer, PATH_BUFMAX);
+      if (!publish_staging_path (buffer, live))
+        die (0, "preventing buffer overflow");
+      if (!publish_prepare (buffer))
+        exit (EXIT_FAILURE);
     }
-    else
-      die (errno, "failed to stat `%s'", src_path[x]);
+    rpath[x] = strdup (buffer);
+    if (!rpath[x])
+      die (errno, "failed to allocate destination paths");
   }
 
-  total_sources = n_src;
+  if (!journal_path)
+  {
+    size_t n = strlen (dst_path);
+    while ((n > 1) && is_dir_separator (dst_path[n - 1]))
+      n--;
+    if ((n + strlen (JOURNAL_SUFFIX)) >= PATH_BUFMAX)
+      die (0, "preventing buffer overflow");
+    memcpy (default_journal_path, dst_path, n);
+    memcpy (default_journal_path + n, JOURNAL_SUFFIX,
+            strlen (JOURNAL_SUFFIX) + 1);
+    journal_path = default_journal_path;
+  }
+
+  copy_sources (src_path, (const char **) rpath, n_src, 1, false);
+
+  for (x = 0; (x < n_src); ++x)
+    free (rpath[x]);
+  free (rpath);
+}
+
+static void
+resume_copy (const char *path)
+{
+  size_t x;
+  struct journal j;
+
+  if (!journal_read (path, &j))
+    exit (EXIT_FAILURE);
+  if (!journal_path)
+    journal_path = path;
+  /* a copy that was staged for --publish-atomic is published when done */
+  publishing_atomic = (j.n_src > 0);
+  for (x = 0; (x < j.n_src); ++x)
+  {
+    char live[PATH_BUFMAX];
+    if (!publish_live_path (live, j.rpath[x]))
+      publishing_atomic = false;
+  }
+  copy_sources ((const char **) j.src_path,
+                (const char **) j.rpath,
+                j.n_src,
+                j.next_item,
+                true);
+  for (x = 0; (x < j.n_src); ++x)
+  {
+    free (j.src_path[x]);
+    free (j.rpath[x]);
+  }
+  free (j.src_path);
+  free (j.rpath);
+}
+
+/* Copies what the manifest at PATH lists, without scanning the sources
+   again. Moves are not done from a manifest. */
+static void
+manifest_copy (const char *path)
+{
+  size_t x;
+  struct manifest *m;
+
+  m = manifest_open (path);
+  if (!m)
+    exit (EXIT_FAILURE);
+  moving_sources = false;
+  total_bytes = manifest_total_bytes (m);
+  total_sources = manifest_n_sources (m);
 
   if (showing_report)
     report_init ();
 
-  chunk = malloc (chunk_size);
-  if (!chunk)
-    die (errno, "failed to initialize data chunk for transfers");
-
-  for (x = 0; (x < total_sources); ++x)
+  for (x = 0; x < total_sources; ++x)
   {
-    char rpath[PATH_BUFMAX];
-    get_real_destination_path (rpath, dst_path, dst_type, src_path[x]);
-    if (!check_real_destination_path (rpath))
+    if (!check_real_destination_path (manifest_source (m, x)->dst_path))
+      break;
+    manifest_copy_item (m, x);
+    if (control_cancel_requested ())
       break;
-    do_copy (src_path[x], src_type[x], src_size[x], x + 1, rpath, dst_type);
   }
+  manifest_close (m);
 
   if (showing_report)
     report_show ();
+  error_log_summary ();
+  notify_finished (true);
+}
 
-#ifdef ENABLE_SOUND
-  if (playing_sound)
+static void
+retry_size_entry (const struct error_entry *e)
+{
+  struct stat st;
+
+  if (!*e->dst_path || (stat (e->src_path, &st) != 0))
+    return;
+  if (S_ISDIR (st.st_mode))
+    directory_content_size (e->src_path, strlen (e->src_path), &total_bytes);
+  else if (S_ISREG (st.st_mode))
+    total_bytes += (byte_t) st.st_size;
+}
+
+static void
+retry_entry (const struct error_entry *e)
+{
+  struct stat st;
+
+  /* failures from the scan have no destination yet, they show up again
+     (with one) if the transfer failed too */
+  if (!*e->dst_path || control_cancel_requested ())
+    return;
+  if (stat (e->src_path, &st) != 0)
   {
-    if (!Sound_Init ())
-    {
-      error_msg = SDL_GetError ();
-      if (error_msg && *error_msg)
-        x_error (0, "error initializing SDL: %s", error_msg);
-      error_msg = (char *) Sound_GetError ();
-      if (error_msg && *error_msg)
-        x_error (0, "error initializing SDL_sound subsystem: %s", error_msg);
-    }
-    else
-    {
-      play_sound ();
-      Sound_Quit ();
-    }
-    SDL_Quit ();
+    x_error (errno, "failed to stat `%s'", e->src_path);
+    record_failure (PHASE_STAT, errno, e->src_path, e->dst_path);
+    return;
   }
-#endif
 
-  if (verifying_checksums)
+  __atomic_add_fetch (&retried_entries, 1, __ATOMIC_RELAXED);
+  control_arm (true);
+  select_engine (e->src_path, e->dst_path);
+  if (S_ISDIR (st.st_mode))
   {
-    for (x = 0; (x < total_sources); ++x)
-    {
-      char rpath[PATH_BUFMAX];
-      get_real_destination_path (rpath, dst_path, dst_type, src_path[x]);
-      verify_checksums (src_path[x], rpath);
-    }
+    /* a directory that failed is copied as a whole, which is also what
+       the rest of its (never reached) contents need */
+    set_directory_transfer_source_root (e->src_path);
+    set_directory_transfer_destination_root (e->dst_path);
+    if (!make_path (e->dst_path))
+      record_failure (PHASE_MKDIR, errno, e->src_path, e->dst_path);
+    else if (transfer_directory (e->src_path))
+      preserve_attributes (e->src_path, e->dst_path, &st);
+  }
+  else if (S_ISREG (st.st_mode))
+  {
+    char dst_parent[PATH_BUFMAX];
+    dir_name (dst_parent, e->dst_path);
+    if (!make_path (dst_parent))
+      record_failure (PHASE_MKDIR, errno, e->src_path, e->dst_path);
+    else if (!ring_queue (e->src_path, e->dst_path, &st) &&
+             (transfer_file (e->src_path, e->dst_path) == TRANSFER_DONE))
+      preserve_attributes (e->src_path, e->dst_path, &st);
   }
+  control_arm (false);
+}
+
+/* Copies again just the entries of an error log written by an earlier
+   run. Moves are not retried since it is unknown how far they got. */
+static void
+retry_copy (const char *path)
+{
+  moving_sources = false;
+  metrics_phase (METRICS_PHASE_SCAN);
+  if (!error_log_read (path, retry_size_entry))
+    exit (EXIT_FAILURE);
+  metrics_phase (METRICS_PHASE_DATA);
+
+  total_sources = 1;
+  if (showing_report)
+    report_init ();
+
+  if (showing_progress)
+    progress_init (total_bytes, 1);
+  error_log_read (path, retry_entry);
+  control_arm (true);
+  ring_flush ();
+  control_arm (false);
+  if (showing_progress)
+    progress_finish ();
+
+  if (showing_report)
+    report_show ();
+  error_log_summary ();
+  notify_finished (true);
+}
+
+static void
+metrics_count (struct metrics_counts *counts)
+{
+  counts->bytes_copied = __atomic_load_n (&transferred_bytes,
+                                          __ATOMIC_RELAXED);
+  counts->bytes_skipped = __atomic_load_n (&skipped_bytes, __ATOMIC_RELAXED);
+  counts->files_copied = __atomic_load_n (&transferred_files,
+                                          __ATOMIC_RELAXED);
+  counts->errors = error_log_count ();
+  counts->retries = __atomic_load_n (&retried_entries, __ATOMIC_RELAXED);
+  counts->files_in_flight = __atomic_load_n (&files_in_flight,
+                                             __ATOMIC_RELAXED);
+  counts->jobs_queued = __atomic_load_n (&queued_jobs, __ATOMIC_RELAXED);
+  counts->uring_queued = __atomic_load_n (&n_ring_batch, __ATOMIC_RELAXED);
 }
 
 static void
 exit_cleanup (void)
 {
-  if (chunk)
-    free (chunk);
+  struct chunk *c;
+
+  metrics_stop ();
+  notify_finished (false);
+  if (error_log_path && (error_log_count () > 0))
+    error_log_write (error_log_path);
+  c = (struct chunk *) pthread_getspecific (chunk_key);
+  if (c)
+    chunk_free (c);
+  uring_free (ring);
 }
 
 int
 main (int argc, char **argv)
 {
   int c;
+  long cpus;
+  size_t x;
   size_t n_files;
+  bool probing;
+  bool probed;
+  const char *retry_path;
+  const char *manifest_path;
+  byte_t size_limit;
+  time_t time_limit;
   char **files;
   const char *dst_path;
   const char **src_path;
 
   set_program_name (argv[0]);
+  set_main_thread ();
+  pthread_key_create (&chunk_key, chunk_free);
   atexit (exit_cleanup);
+  control_init ();
+  retry_path = NULL;
+  probing = false;
+  manifest_path = NULL;
 
   for (;;)
   {
-    c = getopt_long (argc, argv, "c:opPtu:Vhv", options, NULL);
+    c = getopt_long (argc, argv, "c:j:kmopPtu:Vhv", options, NULL);
     if (c == -1)
       break;
     switch (c)
@@ -928,6 +2394,22 @@ main (int argc, char **argv)
           x_error (0, "chunk size cannot be zero -- reverting to default");
           chunk_size = CHUNK_SIZE;
         }
+        else
+          chunk_size_given = true;
+        break;
+      case 'j':
+        jobs = (size_t) strtoul (optarg, (char **) NULL, 10);
+        if (jobs == 0)
+        {
+          x_error (0, "jobs cannot be zero -- copying one file at a time");
+          jobs = 1;
+        }
+        break;
+      case 'k':
+        keeping_going = true;
+        break;
+      case 'm':
+        moving_sources = true;
         break;
       case 'o':
         preserving_ownership = true;
@@ -952,6 +2434,9 @@ main (int argc, char **argv)
         break;
       case 'V':
         verifying_checksums = true;
+        if (optarg && !verify_parse (optarg, &verify_config))
+          die (0, "invalid argument for --verify -- `%s' "
+                  "(md5, compare, tree or sample:P[:SEED])", optarg);
         break;
       case NO_PROGRESS_OPTION:
         showing_progress = false;
@@ -959,9 +2444,122 @@ main (int argc, char **argv)
       case NO_REPORT_OPTION:
         showing_report = false;
         break;
+      case EXCLUDE_OPTION:
+        filter_add (optarg, false);
+        break;
+      case INCLUDE_OPTION:
+        filter_add (optarg, true);
+        break;
+      case FILTER_FILE_OPTION:
+        filter_add_file (optarg);
+        break;
+      case MIN_SIZE_OPTION:
+      case MAX_SIZE_OPTION:
+        if (!parse_size (optarg, &size_limit))
+          die (0, "invalid size -- `%s'", optarg);
+        if (c == MIN_SIZE_OPTION)
+          filter_set_min_size (size_limit);
+        else
+          filter_set_max_size (size_limit);
+        break;
+      case JOURNAL_OPTION:
+        journal_path = optarg;
+        break;
+      case RESUME_OPTION:
+        resume_path = optarg;
+        break;
+      case ERROR_LOG_OPTION:
+        error_log_path = optarg;
+        break;
+      case RETRY_OPTION:
+        retry_path = optarg;
+        break;
+      case ENGINE_OPTION:
+        if (streq (optarg, "auto", false))
+          transfer_engine = -1;
+        else
+        {
+          transfer_engine = engine_find (optarg);
+          if (transfer_engine == -1)
+            die (0, "unknown engine -- `%s'", optarg);
+        }
+        break;
+      case PROBE_OPTION:
+        probing = true;
+        break;
+      case WRITE_MANIFEST_OPTION:
+        manifest_out_path = optarg;
+        break;
+      case MANIFEST_OPTION:
+        manifest_path = optarg;
+        break;
+      case SCAN_THREADS_OPTION:
+        scan_threads = (size_t) strtoul (optarg, (char **) NULL, 10);
+        break;
+      case URING_OPTION:
+        using_uring = true;
+        break;
+      case PROGRESS_LINES_OPTION:
+        showing_lines = true;
+        break;
+      case METRICS_FILE_OPTION:
+        metrics_path = optarg;
+        break;
+      case METRICS_INTERVAL_OPTION:
+        metrics_interval = strtod (optarg, (char **) NULL);
+        if (!(metrics_interval > 0.0) || isinf (metrics_interval))
+          die (0, "invalid metrics interval -- `%s'", optarg);
+        break;
+      case JOB_NAME_OPTION:
+        job_name = optarg;
+        break;
+      case STATS_OPTION:
+        showing_stats = true;
+        break;
+      case VERIFY_THREADS_OPTION:
+        verify_config.n_threads = (size_t) strtoul (optarg, (char **) NULL,
+                                                    10);
+        if (verify_config.n_threads == 0)
+          die (0, "invalid number of verify threads -- `%s'", optarg);
+        break;
+      case NOTIFY_CMD_OPTION:
+        notify_set_command (optarg);
+        break;
+      case NOTIFY_SOCKET_OPTION:
+        notify_set_socket (optarg);
+        break;
+      case PUBLISH_ATOMIC_OPTION:
+        publishing_atomic = true;
+        break;
+      case CHANGE_RETRIES_OPTION:
+        change_retries = (unsigned int) strtoul (optarg, (char **) NULL, 10);
+        break;
+      case VFS_OPTION:
+        if (!vfs_select (optarg))
+          die (0, "invalid argument for --vfs -- `%s' (posix or "
+                  "mem[:SEED[:ENTRIES[:MAX_FILE_SIZE]]])", optarg);
+        break;
+      case SPARSE_OPTION:
+        if (streq (optarg, "always", false))
+          writing_sparse = true;
+        else if (streq (optarg, "never", false))
+          writing_sparse = false;
+        else
+          die (0, "invalid argument for --sparse -- `%s' (always or never)",
+               optarg);
+        break;
+      case NEWER_THAN_OPTION:
+      case OLDER_THAN_OPTION:
+        if (!parse_time_point (optarg, time (NULL), &time_limit))
+          die (0, "invalid time -- `%s'", optarg);
+        if (c == NEWER_THAN_OPTION)
+          filter_set_newer_than (time_limit);
+        else
+          filter_set_older_than (time_limit);
+        break;
 #ifdef ENABLE_SOUND
       case NO_SOUND_OPTION:
-        playing_sound = false;
+        notify_set_sound (false);
         break;
 #endif
       case 'h':
@@ -972,6 +2570,92 @@ main (int argc, char **argv)
         usage (true);
     }
   }
+  notify_begin ();
+
+  if (!vfs_native () &&
+      (moving_sources || verifying_checksums || preserving_ownership ||
+       preserving_permissions || preserving_timestamp || writing_sparse ||
+       using_uring || resume_path || retry_path || manifest_path || probing ||
+       publishing_atomic))
+    die (0, "--vfs=mem only copies -- it does not go with -m, -o, -p, -t, "
+            "-P, -V, --sparse, --uring, --resume, --retry, --manifest, "
+            "--probe or --publish-atomic");
+
+  /* a move renames or unlinks as it goes, and a journal resumes one
+     source at a time, neither of which a manifest plan does */
+  if ((jobs > 1) && (moving_sources || resume_path))
+  {
+    x_error (0, "-j does not go with -m or --resume -- copying one file "
+                "at a time");
+    jobs = 1;
+  }
+
+  if (publishing_atomic && (retry_path || manifest_path || manifest_out_path))
+    die (0, "--publish-atomic does not go with --retry, --manifest or "
+            "--write-manifest");
+
+  if (verify_config.n_threads == 0)
+  {
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    verify_config.n_threads = (cpus > 0) ? (size_t) cpus : 1;
+  }
+
+  if (showing_progress && showing_lines)
+    progress_set_lines (jobs);
+  if (metrics_path)
+    metrics_start (metrics_path, job_name, metrics_interval, metrics_count);
+
+  if (using_uring)
+  {
+    ring = uring_new ();
+    if (!ring)
+      x_error (0, "io_uring is not available -- copying the regular way");
+  }
+
+  if (resume_path)
+  {
+    if (argc > optind)
+    {
+      x_error (0, "--resume takes no SOURCE or DESTINATION");
+      usage (true);
+    }
+    resume_copy (resume_path);
+    exit ((error_log_count () > 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (retry_path)
+  {
+    if (argc > optind)
+    {
+      x_error (0, "--retry takes no SOURCE or DESTINATION");
+      usage (true);
+    }
+    retry_copy (retry_path);
+    exit ((error_log_count () > 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (manifest_path)
+  {
+    if (argc > optind)
+    {
+      x_error (0, "--manifest takes no SOURCE or DESTINATION");
+      usage (true);
+    }
+    manifest_copy (manifest_path);
+    exit ((error_log_count () > 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (probing)
+  {
+    if ((argc - optind) != 2)
+    {
+      x_error (0, "--probe takes a SOURCE and a DESTINATION directory");
+      usage (true);
+    }
+    probed = probe_run (argv[optind], argv[optind + 1]);
+    notify_finished (probed);
+    exit (probed ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
 
   if (argc <= optind)
   {
@@ -990,8 +2674,12 @@ main (int argc, char **argv)
   dst_path = files[--n_files];
   files[n_files] = NULL;
   src_path = (const char **) files;
+  for (x = 0; (x < n_files); ++x)
+    vfs_mount (src_path[x]);
 
+  if (manifest_out_path)
+    manifest_out = manifest_writer_new ();
   try_copy (src_path, n_files, dst_path);
-  exit (EXIT_SUCCESS);
+  exit ((error_log_count () > 0) ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 